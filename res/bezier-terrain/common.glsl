@@ -1,19 +1,60 @@
+/**
+ * Same meaning as the ones in ../common.glsl, keep the block in sync with the
+ * one there.
+ */
+#define SHADOW_CASCADES 3
+layout (std140) uniform FrameUniforms {
+  mat4 uViewProjection;
+  mat4 uShadowCascadeViewProjections[SHADOW_CASCADES];
+  vec3 uCameraPosition;
+  float uFrame;
+  vec3 uLightSourcePosition;
+  float uAmbientLightStrength;
+  vec3 uLightSourceColor;
+  bool uDrawingForShadowMap;
+  vec3 uAmbientLightColor;
+};
+
 uniform mat4 uModel;
-uniform mat4 uShadowMapViewProjection;
 
-#if !defined(FOR_SHADOW_MAP)
-/** Same meaning as the ones in ../common.glsl. */
-uniform mat4 uViewProjection;
+/**
+ * The error and height bounds of each patch, see computePatchBounds in
+ * src/base/BezierTerrain.cpp.
+ */
+uniform samplerBuffer uPatchBounds;
 
-uniform vec3 uCameraPosition;
+/**
+ * The planes of the frustum we're drawing to, that is, the view frustum or the
+ * light one for the shadow map, in the terrain local space. The normals point
+ * inwards, see src/geometry/Frustum.h.
+ */
+uniform vec4 uFrustumPlanes[6];
 
-uniform vec3 uLightSourcePosition;
+/**
+ * Whether the given box (in local units) is fully outside of uFrustumPlanes.
+ *
+ * Like Frustum::intersects, this is conservative near the corners.
+ */
+bool outsideFrustum(vec3 boxMin, vec3 boxMax) {
+  for (int i = 0; i < 6; ++i) {
+    vec4 plane = uFrustumPlanes[i];
+    // The corner furthest along the plane normal.
+    vec3 positive = mix(boxMin, boxMax, greaterThanEqual(plane.xyz, vec3(0.0)));
+    if (dot(plane.xyz, positive) + plane.w < 0.0)
+      return true;
+  }
+  return false;
+}
 
+#if !defined(FOR_SHADOW_MAP)
 /** The texture for UV mapping */
 uniform sampler2D uCover;
 
-/** The shadow map (when we're not rendering _for_ a shadow map). */
-uniform sampler2D uShadowMap;
+/**
+ * The shadow map (when we're not rendering _for_ a shadow map), a layer per
+ * cascade.
+ */
+uniform sampler2DArrayShadow uShadowMap;
 
 uniform float uDimension;
 
@@ -22,4 +63,10 @@ uniform bool uLodEnabled;
 
 /** The level of detail hard-coded if uLodEnabled is false. */
 uniform float uLodLevel;
+
+/**
+ * The size in pixels of something one unit long at a distance of one unit,
+ * divided by the target error in pixels.
+ */
+uniform float uLodScale;
 #endif
@@ -13,36 +13,44 @@ in vec2 fUv;
 
 out vec4 oFragColor;
 
-#define PCF_RANGE 2
+#define PCF_RANGE 1
 #define BIAS 0.0005
 
 float getShadow() {
-  vec4 posLightSpace = uShadowMapViewProjection * vec4(fPosition, 1.0);
-  vec3 properCoords = posLightSpace.xyz / posLightSpace.w;
-  // From normalized device coordinates.
-  properCoords = properCoords * 0.5 + 0.5;
-  if (properCoords.z > 1.0)
-    return 0.0;
-  vec2 uv = properCoords.xy;
-
-  // percentage-closer filtering.
-  // http://http.developer.nvidia.com/GPUGems/gpugems_ch11.html
-  float currentDepth = properCoords.z;
-
-  float shadow = 0.0;
-  vec2 texelSize = 1.0 / textureSize(uShadowMap, 0);
-  for(int x = -PCF_RANGE; x <= PCF_RANGE; ++x) {
-    for(int y = -PCF_RANGE; y <= PCF_RANGE; ++y) {
-      float pcfDepth = texture(uShadowMap, uv + vec2(x, y) * texelSize).r;
-      shadow += (currentDepth - BIAS) > pcfDepth ? 1.0 : 0.0;
+  // Use the first cascade, that is, the most detailed one, which has the
+  // fragment far enough from its edges to filter it.
+  vec2 texelSize = 1.0 / vec2(textureSize(uShadowMap, 0).xy);
+  vec2 margin = 1.0 - 2.0 * (PCF_RANGE + 1) * texelSize;
+  for (int i = 0; i < SHADOW_CASCADES; ++i) {
+    vec4 posLightSpace =
+        uShadowCascadeViewProjections[i] * vec4(fPosition, 1.0);
+    vec3 properCoords = posLightSpace.xyz / posLightSpace.w;
+    if (any(greaterThan(abs(properCoords.xy), margin)))
+      continue;
+    // From normalized device coordinates.
+    properCoords = properCoords * 0.5 + 0.5;
+    if (properCoords.z > 1.0)
+      return 0.0;
+    vec2 uv = properCoords.xy;
+    float reference = properCoords.z - BIAS;
+
+    // percentage-closer filtering.
+    // http://http.developer.nvidia.com/GPUGems/gpugems_ch11.html
+    //
+    // The sampler does the depth comparison, and interpolates the results of
+    // the four texels around each fetch, so every one is already a 2x2 PCF.
+    float lit = 0.0;
+    for(int x = -PCF_RANGE; x <= PCF_RANGE; ++x) {
+      for(int y = -PCF_RANGE; y <= PCF_RANGE; ++y) {
+        vec2 offset = vec2(x, y) * texelSize;
+        lit += texture(uShadowMap, vec4(uv + offset, float(i), reference));
+      }
     }
-  }
 
-  if (PCF_RANGE == 0)
-    return shadow;
+    return 1.0 - lit / pow(PCF_RANGE * 2 + 1, 2);
+  }
 
-  shadow /= pow(PCF_RANGE * 2 + 1, 2);
-  return shadow;
+  return 0.0;
 }
 
 void main() {
@@ -1,44 +1,106 @@
 layout (vertices = 16) out;
 
-#define MAX_TESS_LEVEL 7.0
+#define MAX_TESS_LEVEL 16.0
 
-// TODO: Be better at this.
-float chooseTessLevel() {
-#if defined(FOR_SHADOW_MAP)
-  return MAX_TESS_LEVEL;
-
-#else
+#if !defined(FOR_SHADOW_MAP)
+// Chooses the tessellation level that keeps an error (in local units) under
+// the target in pixels, given the bounding box (also in local units) of what
+// we're tessellating.
+//
+// The error of the tessellated surface goes down with the square of the
+// tessellation level, so that's what we need for the error at the closest
+// point of the box to the camera to be small enough.
+float tessLevelFor(vec3 boxMin, vec3 boxMax, float error) {
+  boxMin = vec3(uModel * vec4(boxMin, 1.0));
+  boxMax = vec3(uModel * vec4(boxMax, 1.0));
 
-  if (!uLodEnabled)
-    return uLodLevel;
+  vec3 outside = max(boxMin - uCameraPosition, uCameraPosition - boxMax);
+  float d = max(length(max(outside, vec3(0.0))), 0.001);
 
-  vec3 pos = vec3(gl_in[gl_InvocationID].gl_Position);
-  pos = vec3(uModel * vec4(pos, 1.0));
-
-  float d = abs(distance(uCameraPosition, pos));
-  if (d > 50.0)
-    return 1.0;
+  float level = ceil(sqrt(error * uDimension * uLodScale / d));
+  return clamp(level, 1.0, MAX_TESS_LEVEL);
+}
 
-  if (d > 10.0)
-    return 4.0;
+// The tessellation level of the edge of the patch going through the given
+// control points.
+//
+// The edge is a cubic Bézier curve, so its error is bounded by 3 / 4 of the
+// largest second difference of its control points, and it's inside their
+// bounding box. That only depends on the control points of the edge, so the
+// patches at both sides agree on it and there are no cracks.
+float edgeTessLevel(int a, int b, int c, int d) {
+  vec3 p0 = vec3(gl_in[a].gl_Position);
+  vec3 p1 = vec3(gl_in[b].gl_Position);
+  vec3 p2 = vec3(gl_in[c].gl_Position);
+  vec3 p3 = vec3(gl_in[d].gl_Position);
 
-  return MAX_TESS_LEVEL;
-#endif
+  float error = 0.75 * max(abs(p0.y - 2.0 * p1.y + p2.y),
+                           abs(p1.y - 2.0 * p2.y + p3.y));
+  vec3 boxMin = min(min(p0, p1), min(p2, p3));
+  vec3 boxMax = max(max(p0, p1), max(p2, p3));
+  return tessLevelFor(boxMin, boxMax, error);
 }
+#endif
 
 void main() {
   // Pass through the position.
   gl_out[gl_InvocationID].gl_Position = gl_in[gl_InvocationID].gl_Position;
 
-  if (gl_InvocationID == 0) {
-    float tessLevel = chooseTessLevel();
+  if (gl_InvocationID != 0)
+    return;
+
+  // The patch is inside the convex hull of its control points, and these are
+  // evenly spaced, so its corners and height bounds give us a box for it.
+  vec4 bounds = texelFetch(uPatchBounds, gl_PrimitiveID);
+  vec3 corner = vec3(gl_in[0].gl_Position);
+  vec3 oppositeCorner = vec3(gl_in[15].gl_Position);
+  vec3 boxMin = vec3(min(corner.x, oppositeCorner.x), bounds.y,
+                     min(corner.z, oppositeCorner.z));
+  vec3 boxMax = vec3(max(corner.x, oppositeCorner.x), bounds.z,
+                     max(corner.z, oppositeCorner.z));
+
+  // Patches with an outer level of zero are discarded before evaluating them.
+  if (outsideFrustum(boxMin, boxMax)) {
+    gl_TessLevelInner[0] = 0.0;
+    gl_TessLevelInner[1] = 0.0;
 
-    gl_TessLevelInner[0] = tessLevel;
-    gl_TessLevelInner[1] = tessLevel;
+    gl_TessLevelOuter[0] = 0.0;
+    gl_TessLevelOuter[1] = 0.0;
+    gl_TessLevelOuter[2] = 0.0;
+    gl_TessLevelOuter[3] = 0.0;
+    return;
+  }
+
+#if defined(FOR_SHADOW_MAP)
+  gl_TessLevelInner[0] = MAX_TESS_LEVEL;
+  gl_TessLevelInner[1] = MAX_TESS_LEVEL;
+
+  gl_TessLevelOuter[0] = MAX_TESS_LEVEL;
+  gl_TessLevelOuter[1] = MAX_TESS_LEVEL;
+  gl_TessLevelOuter[2] = MAX_TESS_LEVEL;
+  gl_TessLevelOuter[3] = MAX_TESS_LEVEL;
+#else
+  if (!uLodEnabled) {
+    gl_TessLevelInner[0] = uLodLevel;
+    gl_TessLevelInner[1] = uLodLevel;
 
-    gl_TessLevelOuter[0] = tessLevel;
-    gl_TessLevelOuter[1] = tessLevel;
-    gl_TessLevelOuter[2] = tessLevel;
-    gl_TessLevelOuter[3] = tessLevel;
+    gl_TessLevelOuter[0] = uLodLevel;
+    gl_TessLevelOuter[1] = uLodLevel;
+    gl_TessLevelOuter[2] = uLodLevel;
+    gl_TessLevelOuter[3] = uLodLevel;
+    return;
   }
+
+  // The control points are laid out with u going along the rows, see the
+  // evaluation shader.
+  gl_TessLevelOuter[0] = edgeTessLevel(0, 1, 2, 3);      // u = 0
+  gl_TessLevelOuter[1] = edgeTessLevel(0, 4, 8, 12);     // v = 0
+  gl_TessLevelOuter[2] = edgeTessLevel(12, 13, 14, 15);  // u = 1
+  gl_TessLevelOuter[3] = edgeTessLevel(3, 7, 11, 15);    // v = 1
+
+  float inner = tessLevelFor(boxMin, boxMax, bounds.x);
+
+  gl_TessLevelInner[0] = inner;
+  gl_TessLevelInner[1] = inner;
+#endif
 }
@@ -1,8 +1,9 @@
 layout(quads) in;
 
-#if !defined(FOR_SHADOW_MAP)
+#if !defined(FOR_SHADOW_MAP) && !defined(NORMALS_IN_GEOMETRY_SHADER)
+out vec3 fPosition;
+out vec3 fNormal;
 out vec2 fUv;
-out vec4 fPosition;
 #endif
 
 void basisFunctions(out float[4] b, out float[4] db, float t) {
@@ -26,36 +27,37 @@ void main() {
   float u = gl_TessCoord.x;
   float v = gl_TessCoord.y;
 
-  vec4 p00 = gl_in[0].gl_Position;
-  vec4 p01 = gl_in[1].gl_Position;
-  vec4 p02 = gl_in[2].gl_Position;
-  vec4 p03 = gl_in[3].gl_Position;
-  vec4 p10 = gl_in[4].gl_Position;
-  vec4 p11 = gl_in[5].gl_Position;
-  vec4 p12 = gl_in[6].gl_Position;
-  vec4 p13 = gl_in[7].gl_Position;
-  vec4 p20 = gl_in[8].gl_Position;
-  vec4 p21 = gl_in[9].gl_Position;
-  vec4 p22 = gl_in[10].gl_Position;
-  vec4 p23 = gl_in[11].gl_Position;
-  vec4 p30 = gl_in[12].gl_Position;
-  vec4 p31 = gl_in[13].gl_Position;
-  vec4 p32 = gl_in[14].gl_Position;
-  vec4 p33 = gl_in[15].gl_Position;
-
   float bu[4], bv[4]; // Basis functions for u and v
   float dbu[4], dbv[4]; // Derivatives for u and v
   basisFunctions(bu, dbu, u);
   basisFunctions(bv, dbv, v);
 
-  gl_Position = p00 * bu[0] * bv[0] + p01 * bu[0] * bv[1] + p02 * bu[0] * bv[2] + p03 * bu[0] * bv[3] +
-                p10 * bu[1] * bv[0] + p11 * bu[1] * bv[1] + p12 * bu[1] * bv[2] + p13 * bu[1] * bv[3] +
-                p20 * bu[2] * bv[0] + p21 * bu[2] * bv[1] + p22 * bu[2] * bv[2] + p23 * bu[2] * bv[3] +
-                p30 * bu[3] * bv[0] + p31 * bu[3] * bv[1] + p32 * bu[3] * bv[2] + p33 * bu[3] * bv[3];
+  // The control points are laid out with u going along the rows, that is,
+  // gl_in[4 * i + j] is multiplied by bu[i] * bv[j].
+  vec4 position = vec4(0.0);
+  vec3 tangentU = vec3(0.0);
+  vec3 tangentV = vec3(0.0);
+  for (int i = 0; i < 4; ++i) {
+    for (int j = 0; j < 4; ++j) {
+      vec4 p = gl_in[4 * i + j].gl_Position;
+      position += p * bu[i] * bv[j];
+      tangentU += p.xyz * dbu[i] * bv[j];
+      tangentV += p.xyz * bu[i] * dbv[j];
+    }
+  }
 
 #if defined(FOR_SHADOW_MAP)
-  gl_Position = uShadowMapViewProjection * uModel * gl_Position;
-#else
+  gl_Position = uViewProjection * uModel * position;
+#elif defined(NORMALS_IN_GEOMETRY_SHADER)
   // Geometry takes care of it.
+  gl_Position = position;
+#else
+  gl_Position = uViewProjection * uModel * position;
+  fUv = vec2(position.x, position.z);
+  fPosition = vec3(uModel * position);
+  // u goes along x and v along z, so this points up.
+  // FIXME: Same problem than in the vertex shader, no proper normal matrix.
+  vec3 normal = normalize(cross(tangentV, tangentU));
+  fNormal = normalize(vec3(uModel * vec4(normal, 0.0)));
 #endif
 }
@@ -0,0 +1,48 @@
+/**
+ * Same meaning as the ones in ../common.glsl, keep the block in sync with the
+ * one there.
+ */
+#define SHADOW_CASCADES 3
+layout (std140) uniform FrameUniforms {
+  mat4 uViewProjection;
+  mat4 uShadowCascadeViewProjections[SHADOW_CASCADES];
+  vec3 uCameraPosition;
+  float uFrame;
+  vec3 uLightSourcePosition;
+  float uAmbientLightStrength;
+  vec3 uLightSourceColor;
+  bool uDrawingForShadowMap;
+  vec3 uAmbientLightColor;
+};
+
+uniform mat4 uModel;
+
+/** The texture for UV mapping */
+uniform sampler2D uCover;
+
+/** The heightmap */
+uniform sampler2D uHeightMap;
+
+/** The the shadow map with the scene objects, a layer per cascade */
+uniform sampler2DArrayShadow uShadowMap;
+
+/** The number of quads in each side of the grid. */
+uniform float uGridQuads;
+
+/**
+ * Maps a position in the terrain local space to the center of the texel of
+ * the sample there in a texture of the given size, which is where
+ * HeightField::sample puts it, so what we draw matches the CPU queries.
+ *
+ * res/dyn-terrain/fragment.glsl uses it too, so every terrain common header
+ * it's compiled with needs to define it.
+ */
+vec2 sampleCoords(vec2 pos, ivec2 size) {
+  return pos + vec2(0.5, 0.5) + 0.5 / vec2(size);
+}
+
+float getHeight(vec2 pos) {
+  vec2 uv = sampleCoords(pos, textureSize(uHeightMap, 0));
+  float v = textureLod(uHeightMap, uv, 0.0).r;
+  return (v - 0.5) / 3.0;
+}
@@ -0,0 +1,57 @@
+#line 1
+
+/** The position in the node grid, in [0, 1]. */
+layout (location = 0) in vec2 vGridPosition;
+
+/**
+ * The node being drawn: offset (xy) and size (z) in the terrain local space,
+ * and level (w).
+ */
+layout (location = 1) in vec4 vNode;
+
+/** The camera distances where morphing to the next level starts and ends. */
+layout (location = 2) in vec2 vMorphRange;
+
+#if !defined(FOR_SHADOW_MAP)
+out vec3 fPosition;
+out vec3 fNormal;
+out vec2 fUv;
+#endif
+
+// Moves the odd vertices of the grid towards the even ones as morphK goes to
+// one, so at the end of the range the node looks exactly like its parent.
+vec2 morphVertex(vec2 gridPosition, float morphK) {
+  vec2 fraction = fract(gridPosition * uGridQuads * 0.5) * 2.0 / uGridQuads;
+  return gridPosition - fraction * morphK;
+}
+
+void main() {
+  vec2 pos = vNode.xy + vGridPosition * vNode.z;
+  vec3 worldPos = vec3(uModel * vec4(pos.x, getHeight(pos), pos.y, 1.0));
+
+  float cameraDistance = distance(uCameraPosition, worldPos);
+  float morphK = clamp((cameraDistance - vMorphRange.x) /
+                         (vMorphRange.y - vMorphRange.x), 0.0, 1.0);
+
+  pos = vNode.xy + morphVertex(vGridPosition, morphK) * vNode.z;
+  vec4 localPos = vec4(pos.x, getHeight(pos), pos.y, 1.0);
+
+#if !defined(FOR_SHADOW_MAP)
+  // Central differences over the heightmap.
+  vec2 texel = 1.0 / vec2(textureSize(uHeightMap, 0));
+  float left = getHeight(pos - vec2(texel.x, 0.0));
+  float right = getHeight(pos + vec2(texel.x, 0.0));
+  float down = getHeight(pos - vec2(0.0, texel.y));
+  float up = getHeight(pos + vec2(0.0, texel.y));
+  vec3 normal = normalize(vec3((left - right) / (2.0 * texel.x), 1.0,
+                               (down - up) / (2.0 * texel.y)));
+
+  // FIXME: Same problem than in the main vertex shader, no proper normal
+  // matrix, but the terrain is uniformly scaled anyway.
+  fNormal = normalize(vec3(uModel * vec4(normal, 0.0)));
+  fPosition = vec3(uModel * localPos);
+  fUv = pos;
+#endif
+
+  gl_Position = uViewProjection * uModel * localPos;
+}
@@ -1,17 +1,74 @@
-/** The view-projection transform to use. */
-uniform mat4 uViewProjection;
+/**
+ * The number of cascades of the shadow map, keep in sync with SHADOW_CASCADES
+ * in src/base/Scene.h.
+ */
+#define SHADOW_CASCADES 3
+
+/**
+ * The values that only change once per frame or per pass, which every program
+ * reads from the same buffer, see FrameUniforms in src/base/Scene.h. Keep the
+ * layout in sync with it, and with the copies of the block in the other
+ * shaders.
+ */
+layout (std140) uniform FrameUniforms {
+  /** The view-projection transform to use. */
+  mat4 uViewProjection;
+
+  /** The matrices to transform to the light space of each shadow cascade. */
+  mat4 uShadowCascadeViewProjections[SHADOW_CASCADES];
+
+  /**
+   * The camera position, in world space, or the light one when drawing a
+   * shadow map.
+   */
+  vec3 uCameraPosition;
+
+  /**
+   * The current frame we're in, currently just to do fancy stuff because I'm
+   * to lazy to use proper timing and stuff.
+   */
+  float uFrame;
+
+  /**
+   * The position of the light source, in world space.
+   *
+   * We assume a single light source, because we're pussies.
+   */
+  vec3 uLightSourcePosition;
+
+  /** The strength of the ambient light, from 0 to 1 */
+  float uAmbientLightStrength;
+
+  /** The color of the light source */
+  vec3 uLightSourceColor;
+
+  /** Whether we're doing a shadow map pass */
+  bool uDrawingForShadowMap;
+
+  /** The color of the ambient light */
+  vec3 uAmbientLightColor;
+};
 
 /** The model transform */
 uniform mat4 uModel;
 
+/**
+ * Whether we're drawing the instances of an InstancedNode, in which case uModel
+ * is relative to each of them.
+ */
+uniform bool uInstanced;
+
 /** The texture for UV mapping */
 uniform bool uUsesTexture;
 
 /** The texture for UV mapping */
 uniform sampler2D uTexture;
 
-/** The shadow map */
-uniform sampler2D uShadowMap;
+/**
+ * The shadow map, with a layer per cascade, from the closest to the camera to
+ * the furthest.
+ */
+uniform sampler2DArrayShadow uShadowMap;
 
 /** The model material */
 struct Material {
@@ -23,35 +80,27 @@ struct Material {
   float m_shininess_percent;
 };
 
-uniform Material uMaterial;
-
 /**
- * The current frame we're in, currently just to do fancy stuff because I'm to
- * lazy to use proper timing and stuff.
+ * The materials of every model, see src/geometry/MaterialTable.h for the
+ * layout.
  */
-uniform float uFrame;
-
-/** The color of the ambient light */
-uniform vec3 uAmbientLightColor;
-
-/** The strength of the ambient light, from 0 to 1 */
-uniform float uAmbientLightStrength;
-
-/**
- * The position of the light source, in world space.
- *
- * We assume a single light source, because we're pussies.
- */
-uniform vec3 uLightSourcePosition;
-
-/** The color of the light source */
-uniform vec3 uLightSourceColor;
+uniform samplerBuffer uMaterials;
 
-/** The camera position, in world space */
-uniform vec3 uCameraPosition;
+/** The index of the material of the model in uMaterials */
+uniform int uMaterialIndex;
 
-/** Whether we're doing a shadow map pass */
-uniform bool uDrawingForShadowMap;
+#define TEXELS_PER_MATERIAL 5
 
-/** The matrix to transform to light space */
-uniform mat4 uShadowMapViewProjection;
+/** The material of the model, from uMaterials. */
+Material getMaterial() {
+  int base = uMaterialIndex * TEXELS_PER_MATERIAL;
+  Material material;
+  material.m_diffuse = texelFetch(uMaterials, base);
+  material.m_specular = texelFetch(uMaterials, base + 1);
+  material.m_ambient = texelFetch(uMaterials, base + 2);
+  material.m_emissive = texelFetch(uMaterials, base + 3);
+  vec4 shininess = texelFetch(uMaterials, base + 4);
+  material.m_shininess = shininess.x;
+  material.m_shininess_percent = shininess.y;
+  return material;
+}
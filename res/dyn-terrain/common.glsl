@@ -1,10 +1,21 @@
-/** Same meaning as the ones in ../common.glsl. */
-uniform mat4 uViewProjection;
-uniform mat4 uModel;
-uniform mat4 uShadowMapViewProjection;
+/**
+ * Same meaning as the ones in ../common.glsl, keep the block in sync with the
+ * one there.
+ */
+#define SHADOW_CASCADES 3
+layout (std140) uniform FrameUniforms {
+  mat4 uViewProjection;
+  mat4 uShadowCascadeViewProjections[SHADOW_CASCADES];
+  vec3 uCameraPosition;
+  float uFrame;
+  vec3 uLightSourcePosition;
+  float uAmbientLightStrength;
+  vec3 uLightSourceColor;
+  bool uDrawingForShadowMap;
+  vec3 uAmbientLightColor;
+};
 
-uniform vec3 uCameraPosition;
-uniform vec3 uLightSourcePosition;
+uniform mat4 uModel;
 
 /** The texture for UV mapping */
 uniform sampler2D uCover;
@@ -12,13 +23,68 @@ uniform sampler2D uCover;
 /** The heightmap */
 uniform sampler2D uHeightMap;
 
-/** The the shadow map with the scene objects */
-uniform sampler2D uShadowMap;
+/** The normals of the heightmap, in local space. */
+uniform sampler2D uNormalMap;
+
+/** The the shadow map with the scene objects, a layer per cascade */
+uniform sampler2DArrayShadow uShadowMap;
 
 uniform float uDimension;
 
+/**
+ * The error and height bounds around each vertex of the patch grids, see
+ * vertexLodBounds in src/base/DynTerrain.cpp.
+ */
+uniform sampler2D uLodBounds;
+
+/**
+ * The size in pixels of something one unit long at a distance of one unit,
+ * divided by the target error in pixels.
+ */
+uniform float uLodScale;
+
+/**
+ * The planes of the frustum we're drawing to, that is, the view frustum or the
+ * light one for the shadow map, in the terrain local space. The normals point
+ * inwards, see src/geometry/Frustum.h.
+ */
+uniform vec4 uFrustumPlanes[6];
+
+/**
+ * Whether the given box (in local units) is fully outside of uFrustumPlanes.
+ *
+ * Like Frustum::intersects, this is conservative near the corners.
+ */
+bool outsideFrustum(vec3 boxMin, vec3 boxMax) {
+  for (int i = 0; i < 6; ++i) {
+    vec4 plane = uFrustumPlanes[i];
+    // The corner furthest along the plane normal.
+    vec3 positive = mix(boxMin, boxMax, greaterThanEqual(plane.xyz, vec3(0.0)));
+    if (dot(plane.xyz, positive) + plane.w < 0.0)
+      return true;
+  }
+  return false;
+}
+
+/**
+ * Maps a position in the terrain local space to the center of the texel of
+ * the sample there in a texture of the given size, which is where
+ * HeightField::sample puts it, so what we draw matches the CPU queries.
+ *
+ * res/dyn-terrain/fragment.glsl uses it too, so every terrain common header
+ * it's compiled with needs to define it.
+ */
+vec2 sampleCoords(vec2 pos, ivec2 size) {
+  return pos + vec2(0.5, 0.5) + 0.5 / vec2(size);
+}
+
 float getHeight(vec2 pos) {
-  pos += vec2(0.5, 0.5);
-  float v = texture2D(uHeightMap, pos).g;
+  vec2 uv = sampleCoords(pos, textureSize(uHeightMap, 0));
+  float v = texture(uHeightMap, uv).r;
   return (v - 0.5) / 3.0;
 }
+
+vec3 getNormal(vec2 pos) {
+  vec2 uv = sampleCoords(pos, textureSize(uNormalMap, 0));
+  return normalize(texture(uNormalMap, uv).xyz);
+}
@@ -1,27 +1,38 @@
 layout (vertices = 3) out;
 
-// TODO: Be better at this.
-float chooseTessLevel() {
-  // if (!uLodEnabled)
-  //   return uLodLevel;
-  // TODO: The extra texture fetch kinda sucks.
-  vec3 pos = vec3(gl_in[gl_InvocationID].gl_Position);
-  pos.y = getHeight(vec2(pos.x, pos.z));
+in vec3 tcLodBounds[];
 
-  // To world coords.
-  pos = vec3(uModel * vec4(pos, 1.0));
+#define MAX_TESS_LEVEL 7.0
 
-  float d = abs(distance(uCameraPosition, pos));
-  if (d > 50.0)
-    return 1.0;
+// Chooses the tessellation level of the edge between two vertices, so the
+// error of the edge stays under the target in pixels.
+//
+// The error of a linear interpolation goes down with the square of the
+// number of segments, so that's what we need for the error at the closest
+// point of the edge to the camera to be small enough.
+float edgeTessLevel(int a, int b) {
+#if defined(FOR_SHADOW_MAP)
+  return MAX_TESS_LEVEL;
+#else
+  vec3 posA = vec3(gl_in[a].gl_Position);
+  vec3 posB = vec3(gl_in[b].gl_Position);
+  vec3 boundsA = tcLodBounds[a];
+  vec3 boundsB = tcLodBounds[b];
 
-  if (d > 30.0)
-    return 2.0;
+  vec3 boxMin = vec3(min(posA.x, posB.x), min(boundsA.y, boundsB.y),
+                     min(posA.z, posB.z));
+  vec3 boxMax = vec3(max(posA.x, posB.x), max(boundsA.z, boundsB.z),
+                     max(posA.z, posB.z));
+  boxMin = vec3(uModel * vec4(boxMin, 1.0));
+  boxMax = vec3(uModel * vec4(boxMax, 1.0));
 
-  if (d > 10.0)
-    return 4.0;
+  vec3 outside = max(boxMin - uCameraPosition, uCameraPosition - boxMax);
+  float d = max(length(max(outside, vec3(0.0))), 0.001);
 
-  return 7.0;
+  float error = max(boundsA.x, boundsB.x) * uDimension;
+  float level = ceil(sqrt(error * uLodScale / d));
+  return clamp(level, 1.0, MAX_TESS_LEVEL);
+#endif
 }
 
 void main() {
@@ -29,12 +40,33 @@ void main() {
   gl_out[gl_InvocationID].gl_Position = gl_in[gl_InvocationID].gl_Position;
 
   if (gl_InvocationID == 0) {
-    float tessLevel = chooseTessLevel();
+    // The triangle is inside the box of its corners, with the heights of the
+    // quads around them.
+    vec3 boxMin = vec3(gl_in[0].gl_Position);
+    vec3 boxMax = boxMin;
+    for (int i = 0; i < 3; ++i) {
+      vec3 position = vec3(gl_in[i].gl_Position);
+      boxMin = min(boxMin, vec3(position.x, tcLodBounds[i].y, position.z));
+      boxMax = max(boxMax, vec3(position.x, tcLodBounds[i].z, position.z));
+    }
 
-    gl_TessLevelInner[0] = tessLevel;
+    // Patches with an outer level of zero are discarded before evaluating
+    // them.
+    if (outsideFrustum(boxMin, boxMax)) {
+      gl_TessLevelOuter[0] = 0.0;
+      gl_TessLevelOuter[1] = 0.0;
+      gl_TessLevelOuter[2] = 0.0;
+      gl_TessLevelInner[0] = 0.0;
+      return;
+    }
 
-    gl_TessLevelOuter[0] = tessLevel;
-    gl_TessLevelOuter[1] = tessLevel;
-    gl_TessLevelOuter[2] = tessLevel;
+    // Each edge only depends on its vertices, so neighbouring patches agree
+    // on the level of the edges they share and there are no cracks.
+    gl_TessLevelOuter[0] = edgeTessLevel(1, 2);
+    gl_TessLevelOuter[1] = edgeTessLevel(2, 0);
+    gl_TessLevelOuter[2] = edgeTessLevel(0, 1);
+
+    gl_TessLevelInner[0] = max(gl_TessLevelOuter[0],
+                               max(gl_TessLevelOuter[1], gl_TessLevelOuter[2]));
   }
 }
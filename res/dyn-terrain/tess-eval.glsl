@@ -1,10 +1,28 @@
 layout(triangles, equal_spacing) in;
 
+#if !defined(FOR_SHADOW_MAP) && !defined(NORMALS_IN_GEOMETRY_SHADER)
+out vec3 fPosition;
+out vec3 fNormal;
+out vec2 fUv;
+#endif
+
 void main() {
-  gl_Position = gl_TessCoord.x * gl_in[0].gl_Position +
-                gl_TessCoord.y * gl_in[1].gl_Position +
-                gl_TessCoord.z * gl_in[2].gl_Position;
-  gl_Position.y = getHeight(vec2(gl_Position.x, gl_Position.z));
-  // Geometry takes care of this.
-  // gl_Position = uViewProjection * uModel * gl_Position;
+  vec4 position = gl_TessCoord.x * gl_in[0].gl_Position +
+                  gl_TessCoord.y * gl_in[1].gl_Position +
+                  gl_TessCoord.z * gl_in[2].gl_Position;
+  position.y = getHeight(vec2(position.x, position.z));
+
+#if defined(NORMALS_IN_GEOMETRY_SHADER)
+  // Geometry takes care of the rest.
+  gl_Position = position;
+#else
+  gl_Position = uViewProjection * uModel * position;
+#if !defined(FOR_SHADOW_MAP)
+  fUv = vec2(position.x, position.z);
+  fPosition = vec3(uModel * position);
+  // FIXME: Same problem than in the vertex shader, no proper normal matrix.
+  vec3 normal = getNormal(vec2(position.x, position.z));
+  fNormal = normalize(vec3(uModel * vec4(normal, 0.0)));
+#endif
+#endif
 }
@@ -1,7 +1,18 @@
 #line 1
 
-layout (location = 0) in vec2 vPosition;
+// The position inside the patch grid, in [0, 1].
+layout (location = 0) in vec2 vGridPosition;
+// The offset (xy) and scale (z) of the patch this vertex belongs to.
+layout (location = 1) in vec3 vPatch;
+
+// The error and height bounds around this vertex, see uLodBounds.
+out vec3 tcLodBounds;
 
 void main () {
-  gl_Position = vec4(vPosition.x, 0.0, vPosition.y, 1.0);
+  vec2 position = vPatch.xy + vGridPosition * vPatch.z;
+  gl_Position = vec4(position.x, 0.0, position.y, 1.0);
+
+  float quads = float(textureSize(uLodBounds, 0).x - 1);
+  ivec2 vertex = ivec2(round((position + vec2(0.5)) * quads));
+  tcLodBounds = texelFetch(uLodBounds, vertex, 0).xyz;
 }
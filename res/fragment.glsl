@@ -6,46 +6,54 @@ in vec3 fPosition;
 in vec3 fNormal;
 in vec2 fUv;
 
-#define PCF_RANGE 2
+#define PCF_RANGE 1
 #define BIAS 0.05
 
 float getShadow() {
-  vec4 posLightSpace = uShadowMapViewProjection * vec4(fPosition, 1.0);
-  vec3 properCoords = posLightSpace.xyz / posLightSpace.w;
-  if (properCoords.z > 1.0)
-    return 0.0;
-  // The  coordinates are in normalized device coords, convert back to [0, 1]..
-  properCoords = properCoords * 0.5 + 0.5;
-  vec2 uv = properCoords.xy;
+  // Use the first cascade, that is, the most detailed one, which has the
+  // fragment far enough from its edges to filter it.
+  vec2 texelSize = 1.0 / vec2(textureSize(uShadowMap, 0).xy);
+  vec2 margin = 1.0 - 2.0 * (PCF_RANGE + 1) * texelSize;
+  for (int i = 0; i < SHADOW_CASCADES; ++i) {
+    vec4 posLightSpace =
+        uShadowCascadeViewProjections[i] * vec4(fPosition, 1.0);
+    vec3 properCoords = posLightSpace.xyz / posLightSpace.w;
+    if (any(greaterThan(abs(properCoords.xy), margin)))
+      continue;
+    if (properCoords.z > 1.0)
+      return 0.0;
+    // The coordinates are in normalized device coords, convert back to [0, 1].
+    properCoords = properCoords * 0.5 + 0.5;
+    vec2 uv = properCoords.xy;
+    float reference = properCoords.z - BIAS;
 
-  // percentage-closer filtering.
-  // http://http.developer.nvidia.com/GPUGems/gpugems_ch11.html
-  float currentDepth = properCoords.z;
-  // return currentDepth;
-
-  float shadow = 0.0;
-  vec2 texelSize = 1.0 / textureSize(uShadowMap, 0);
-  for(int x = -PCF_RANGE; x <= PCF_RANGE; ++x) {
-    for(int y = -PCF_RANGE; y <= PCF_RANGE; ++y) {
-      float pcfDepth = texture(uShadowMap, uv + vec2(x, y) * texelSize).r;
-      shadow += currentDepth - BIAS > pcfDepth ? 1.0 : 0.0;
+    // percentage-closer filtering.
+    // http://http.developer.nvidia.com/GPUGems/gpugems_ch11.html
+    //
+    // The sampler does the depth comparison, and interpolates the results of
+    // the four texels around each fetch, so every one is already a 2x2 PCF.
+    float lit = 0.0;
+    for(int x = -PCF_RANGE; x <= PCF_RANGE; ++x) {
+      for(int y = -PCF_RANGE; y <= PCF_RANGE; ++y) {
+        vec2 offset = vec2(x, y) * texelSize;
+        lit += texture(uShadowMap, vec4(uv + offset, float(i), reference));
+      }
     }
-  }
 
-  if (PCF_RANGE == 0)
-    return shadow;
+    return 1.0 - lit / pow(PCF_RANGE * 2 + 1, 2);
+  }
 
-  shadow /= pow(PCF_RANGE * 2 + 1, 2);
-  return shadow;
+  return 0.0;
 }
 
 void main() {
   if (uDrawingForShadowMap)
     return;
 
-  vec4 diffuseColor = uMaterial.m_diffuse;
-  vec4 ambientColor = uMaterial.m_ambient;
-  vec4 specColor = uMaterial.m_specular;
+  Material material = getMaterial();
+  vec4 diffuseColor = material.m_diffuse;
+  vec4 ambientColor = material.m_ambient;
+  vec4 specColor = material.m_specular;
   if (uUsesTexture)
     diffuseColor = ambientColor = specColor = texture2D(uTexture, fUv);
 
@@ -61,9 +69,9 @@ void main() {
   // Then the specular strength to finish up the Phong model.
   vec3 reflectionDirection = reflect(-lightDirection, fNormal);
 
-  float spec = uMaterial.m_shininess_percent *
+  float spec = material.m_shininess_percent *
     pow(max(dot(lightDirection, reflectionDirection), 0.0),
-        uMaterial.m_shininess);
+        material.m_shininess);
 
   vec4 specular = specColor * max(spec, 0.0);
   float shadow = getShadow();
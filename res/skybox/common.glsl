@@ -1,2 +1,17 @@
-uniform mat4 uViewProjection;
+/**
+ * Same meaning as the ones in ../common.glsl, keep the block in sync with the
+ * one there.
+ */
+#define SHADOW_CASCADES 3
+layout (std140) uniform FrameUniforms {
+  mat4 uViewProjection;
+  mat4 uShadowCascadeViewProjections[SHADOW_CASCADES];
+  vec3 uCameraPosition;
+  float uFrame;
+  vec3 uLightSourcePosition;
+  float uAmbientLightStrength;
+  vec3 uLightSourceColor;
+  bool uDrawingForShadowMap;
+  vec3 uAmbientLightColor;
+};
 uniform samplerCube uSkybox;
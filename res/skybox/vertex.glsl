@@ -5,6 +5,7 @@ layout (location = 0) in vec3 vPosition;
 out vec3 fPosition;
 
 void main() {
-  gl_Position = uViewProjection * vec4(vPosition, 1.0);
+  // The skybox is centered on the camera, so it never gets any closer.
+  gl_Position = uViewProjection * vec4(uCameraPosition + vPosition, 1.0);
   fPosition = vPosition;
 }
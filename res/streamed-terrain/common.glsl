@@ -0,0 +1,56 @@
+/**
+ * Same meaning as the ones in ../common.glsl, keep the block in sync with the
+ * one there.
+ */
+#define SHADOW_CASCADES 3
+layout (std140) uniform FrameUniforms {
+  mat4 uViewProjection;
+  mat4 uShadowCascadeViewProjections[SHADOW_CASCADES];
+  vec3 uCameraPosition;
+  float uFrame;
+  vec3 uLightSourcePosition;
+  float uAmbientLightStrength;
+  vec3 uLightSourceColor;
+  bool uDrawingForShadowMap;
+  vec3 uAmbientLightColor;
+};
+
+uniform mat4 uModel;
+
+/** The texture for UV mapping */
+uniform sampler2D uCover;
+
+/** The resident tiles of the heightmap, one per layer, in world units. */
+uniform sampler2DArray uHeightTiles;
+
+/** The the shadow map with the scene objects, a layer per cascade */
+uniform sampler2DArrayShadow uShadowMap;
+
+/** The number of quads in each side of a tile. */
+uniform int uTileQuads;
+
+/** Maps local positions to cover coordinates. */
+uniform float uCoverScale;
+
+/**
+ * The samples of the neighbouring tiles stored around each one, keep in sync
+ * with TiledHeightMap::TILE_APRON.
+ */
+#define TILE_APRON 1
+
+/**
+ * The height of a sample of the tile, from -TILE_APRON to
+ * uTileQuads + TILE_APRON.
+ */
+float getHeight(ivec2 texel, int layer) {
+  texel = clamp(texel, ivec2(-TILE_APRON), ivec2(uTileQuads + TILE_APRON));
+  return texelFetch(uHeightTiles, ivec3(texel + TILE_APRON, layer), 0).r;
+}
+
+/**
+ * Same as the one in ../dyn-terrain/common.glsl, which its fragment shader
+ * (that we reuse) needs, even if we don't have a horizon map to sample.
+ */
+vec2 sampleCoords(vec2 pos, ivec2 size) {
+  return pos + vec2(0.5, 0.5) + 0.5 / vec2(size);
+}
@@ -0,0 +1,38 @@
+#line 1
+
+/** The position in the tile grid, in [0, 1]. */
+layout (location = 0) in vec2 vGridPosition;
+
+/**
+ * The tile being drawn: offset (xy) and size (z) in the terrain local space,
+ * and layer of the tile cache (w).
+ */
+layout (location = 1) in vec4 vTile;
+
+out vec3 fPosition;
+out vec3 fNormal;
+out vec2 fUv;
+
+void main() {
+  // Grid vertices fall exactly on tile samples.
+  ivec2 texel = ivec2(vGridPosition * float(uTileQuads) + 0.5);
+  int layer = int(vTile.w);
+
+  vec2 pos = vTile.xy + vGridPosition * vTile.z;
+  vec4 localPos = vec4(pos.x, getHeight(texel, layer), pos.y, 1.0);
+
+  // Central differences, reaching into the apron at the borders.
+  float spacing = vTile.z / float(uTileQuads);
+  float left = getHeight(texel - ivec2(1, 0), layer);
+  float right = getHeight(texel + ivec2(1, 0), layer);
+  float down = getHeight(texel - ivec2(0, 1), layer);
+  float up = getHeight(texel + ivec2(0, 1), layer);
+  vec3 normal = normalize(vec3(left - right, 2.0 * spacing, down - up));
+
+  // The model matrix is just a translation, no need for a normal matrix.
+  fNormal = normalize(vec3(uModel * vec4(normal, 0.0)));
+  fPosition = vec3(uModel * localPos);
+  fUv = pos * uCoverScale - vec2(1.0, 1.0);
+
+  gl_Position = uViewProjection * uModel * localPos;
+}
@@ -4,6 +4,12 @@ layout (location = 0) in vec3 vPosition;
 layout (location = 1) in vec3 vNormal;
 layout (location = 2) in vec2 vUv;
 
+/**
+ * The world transform of the instance, only when uInstanced, see
+ * src/geometry/InstancedNode.h.
+ */
+layout (location = 3) in mat4 vInstanceTransform;
+
 /** The fragment position in world space, passed to the fragment shader. */
 out vec3 fPosition;
 
@@ -21,10 +27,11 @@ void main () {
   // something like:
   //
   // http://www.lighthouse3d.com/tutorials/glsl-12-tutorial/the-normal-matrix/
+  mat4 model = uInstanced ? vInstanceTransform * uModel : uModel;
   if (!uDrawingForShadowMap) {
-    fPosition = vec3(uModel * vec4(vPosition, 1.0));
-    fNormal = normalize(vec3(uModel * vec4(vNormal, 0.0)));
+    fPosition = vec3(model * vec4(vPosition, 1.0));
+    fNormal = normalize(vec3(model * vec4(vNormal, 0.0)));
     fUv = vUv;
   }
-  gl_Position = uViewProjection * uModel * vec4(vPosition, 1.0);
+  gl_Position = uViewProjection * model * vec4(vPosition, 1.0);
 }
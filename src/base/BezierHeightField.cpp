@@ -0,0 +1,234 @@
+#include "base/BezierHeightField.h"
+
+#include <algorithm>
+#include <cassert>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+static_assert(sizeof(glm::vec2) == 2 * sizeof(float),
+              "sampleMany reads points as packed floats");
+
+namespace {
+
+const uint32_t TABLE_SIZE = BezierHeightField::BERNSTEIN_TABLE_SIZE;
+
+// The cubic Bernstein weights at t = i / TABLE_SIZE, for i in
+// [0, TABLE_SIZE], padded so each entry can be loaded as a vector.
+struct BernsteinTable {
+  alignas(16) float m_weights[TABLE_SIZE + 1][4];
+
+  BernsteinTable() {
+    for (uint32_t i = 0; i <= TABLE_SIZE; ++i) {
+      // Same as basisFunctions in res/bezier-terrain/tess-eval.glsl.
+      float t = float(i) / TABLE_SIZE;
+      float t1 = 1.0f - t;
+      m_weights[i][0] = t1 * t1 * t1;
+      m_weights[i][1] = 3.0f * t1 * t1 * t;
+      m_weights[i][2] = 3.0f * t1 * t * t;
+      m_weights[i][3] = t * t * t;
+    }
+  }
+};
+
+const BernsteinTable& bernsteinTable() {
+  static const BernsteinTable sTable;
+  return sTable;
+}
+
+// The table entry and interpolation factor for t in [0, 1].
+struct TableLookup {
+  uint32_t m_index;
+  float m_fraction;
+};
+
+inline TableLookup lookup(float t) {
+  float position = t * TABLE_SIZE;
+  TableLookup ret;
+  ret.m_index = std::min(uint32_t(position), TABLE_SIZE - 1);
+  ret.m_fraction = position - ret.m_index;
+  return ret;
+}
+
+// Evaluates a patch given the table lookups for both of its parameters, u
+// going along the x axis of the control grid, and v along the y axis.
+inline float evaluatePatch(const float* a_patch,
+                           const TableLookup& a_u,
+                           const TableLookup& a_v) {
+  const BernsteinTable& table = bernsteinTable();
+  const float* u0 = table.m_weights[a_u.m_index];
+  const float* u1 = table.m_weights[a_u.m_index + 1];
+  const float* v0 = table.m_weights[a_v.m_index];
+  const float* v1 = table.m_weights[a_v.m_index + 1];
+
+#if defined(__SSE2__)
+  __m128 wu = _mm_load_ps(u0);
+  wu = _mm_add_ps(wu, _mm_mul_ps(_mm_sub_ps(_mm_load_ps(u1), wu),
+                                 _mm_set1_ps(a_u.m_fraction)));
+  __m128 wv = _mm_load_ps(v0);
+  wv = _mm_add_ps(wv, _mm_mul_ps(_mm_sub_ps(_mm_load_ps(v1), wv),
+                                 _mm_set1_ps(a_v.m_fraction)));
+
+  // Blend the four rows of the patch with the u weights, then the result with
+  // the v weights.
+  __m128 row = _mm_mul_ps(_mm_loadu_ps(a_patch),
+                          _mm_shuffle_ps(wu, wu, _MM_SHUFFLE(0, 0, 0, 0)));
+  row = _mm_add_ps(row,
+                   _mm_mul_ps(_mm_loadu_ps(a_patch + 4),
+                              _mm_shuffle_ps(wu, wu, _MM_SHUFFLE(1, 1, 1, 1))));
+  row = _mm_add_ps(row,
+                   _mm_mul_ps(_mm_loadu_ps(a_patch + 8),
+                              _mm_shuffle_ps(wu, wu, _MM_SHUFFLE(2, 2, 2, 2))));
+  row = _mm_add_ps(row,
+                   _mm_mul_ps(_mm_loadu_ps(a_patch + 12),
+                              _mm_shuffle_ps(wu, wu, _MM_SHUFFLE(3, 3, 3, 3))));
+
+  __m128 products = _mm_mul_ps(row, wv);
+  __m128 shuffled = _mm_shuffle_ps(products, products, _MM_SHUFFLE(2, 3, 0, 1));
+  __m128 sums = _mm_add_ps(products, shuffled);
+  shuffled = _mm_movehl_ps(shuffled, sums);
+  return _mm_cvtss_f32(_mm_add_ss(sums, shuffled));
+#else
+  float wu[4];
+  float wv[4];
+  for (size_t i = 0; i < 4; ++i) {
+    wu[i] = u0[i] + (u1[i] - u0[i]) * a_u.m_fraction;
+    wv[i] = v0[i] + (v1[i] - v0[i]) * a_v.m_fraction;
+  }
+
+  float ret = 0.0f;
+  for (size_t j = 0; j < 4; ++j)
+    for (size_t k = 0; k < 4; ++k)
+      ret += a_patch[j * 4 + k] * wu[j] * wv[k];
+  return ret;
+#endif
+}
+
+}  // namespace
+
+BezierHeightField::BezierHeightField(uint32_t a_size,
+                                     ArrayView<const float> a_controlHeights)
+  : m_size(a_size), m_patchesPerSide((a_size - 4) / 3 + 1) {
+  assert(a_size > 4 && (a_size - 4) % 3 == 0);
+  assert(a_controlHeights.size() == size_t(a_size) * a_size);
+
+  m_patches.reserve(m_patchesPerSide * m_patchesPerSide * 16);
+  for (uint32_t patchX = 0; patchX < m_patchesPerSide; ++patchX)
+    for (uint32_t patchY = 0; patchY < m_patchesPerSide; ++patchY)
+      for (uint32_t j = 0; j < 4; ++j)
+        for (uint32_t k = 0; k < 4; ++k)
+          m_patches.push_back(
+              a_controlHeights[(patchX * 3 + j) * a_size + patchY * 3 + k]);
+}
+
+// Takes coordinates in control points.
+float BezierHeightField::evaluate(float a_gridX, float a_gridY) const {
+  const float max = float(m_size - 1);
+  const uint32_t lastPatch = m_patchesPerSide - 1;
+
+  float x = glm::clamp(a_gridX, 0.0f, max);
+  float y = glm::clamp(a_gridY, 0.0f, max);
+  uint32_t patchX = std::min(uint32_t(x / 3.0f), lastPatch);
+  uint32_t patchY = std::min(uint32_t(y / 3.0f), lastPatch);
+
+  // Each patch spans three control point intervals.
+  float u = glm::clamp((x - patchX * 3.0f) / 3.0f, 0.0f, 1.0f);
+  float v = glm::clamp((y - patchY * 3.0f) / 3.0f, 0.0f, 1.0f);
+
+  const float* patch =
+      &m_patches[(size_t(patchX) * m_patchesPerSide + patchY) * 16];
+  return evaluatePatch(patch, lookup(u), lookup(v));
+}
+
+float BezierHeightField::sample(float u, float v) const {
+  assert(!empty());
+  return evaluate(u * m_size, v * m_size);
+}
+
+void BezierHeightField::sampleMany(ArrayView<const glm::vec2> a_points,
+                                   ArrayView<float> a_out,
+                                   float a_pointScale,
+                                   float a_heightScale) const {
+  assert(!empty());
+  assert(a_out.size() >= a_points.size());
+
+  const size_t count = a_points.size();
+  const float scale = a_pointScale * m_size;
+  size_t i = 0;
+
+#if defined(__SSE2__)
+  const float* points = reinterpret_cast<const float*>(a_points.data());
+
+  const __m128 zero = _mm_setzero_ps();
+  const __m128 one = _mm_set1_ps(1.0f);
+  const __m128 three = _mm_set1_ps(3.0f);
+  const __m128 third = _mm_set1_ps(1.0f / 3.0f);
+  const __m128 scaleVector = _mm_set1_ps(scale);
+  const __m128 max = _mm_set1_ps(float(m_size - 1));
+  const __m128 lastPatch = _mm_set1_ps(float(m_patchesPerSide - 1));
+  const __m128 tableSize = _mm_set1_ps(float(TABLE_SIZE));
+  const __m128 lastEntry = _mm_set1_ps(float(TABLE_SIZE - 1));
+
+  alignas(16) int32_t patches[4];
+  alignas(16) int32_t entriesU[4];
+  alignas(16) int32_t entriesV[4];
+  alignas(16) float fractionsU[4];
+  alignas(16) float fractionsV[4];
+
+  // Find the patches and table entries of four points at a time, then
+  // evaluate each of them.
+  for (; i + 4 <= count; i += 4) {
+    __m128 a = _mm_loadu_ps(points + 2 * i);
+    __m128 b = _mm_loadu_ps(points + 2 * i + 4);
+    __m128 x = _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0));
+    __m128 y = _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1));
+
+    x = _mm_min_ps(_mm_max_ps(_mm_mul_ps(x, scaleVector), zero), max);
+    y = _mm_min_ps(_mm_max_ps(_mm_mul_ps(y, scaleVector), zero), max);
+
+    // Everything is non-negative, so truncating is flooring, and we can clamp
+    // in floating point before converting.
+    __m128 patchX = _mm_min_ps(
+        _mm_cvtepi32_ps(_mm_cvttps_epi32(_mm_mul_ps(x, third))), lastPatch);
+    __m128 patchY = _mm_min_ps(
+        _mm_cvtepi32_ps(_mm_cvttps_epi32(_mm_mul_ps(y, third))), lastPatch);
+
+    __m128 u = _mm_div_ps(_mm_sub_ps(x, _mm_mul_ps(patchX, three)), three);
+    __m128 v = _mm_div_ps(_mm_sub_ps(y, _mm_mul_ps(patchY, three)), three);
+    u = _mm_min_ps(_mm_max_ps(u, zero), one);
+    v = _mm_min_ps(_mm_max_ps(v, zero), one);
+
+    __m128 positionU = _mm_mul_ps(u, tableSize);
+    __m128 positionV = _mm_mul_ps(v, tableSize);
+    __m128 entryU =
+        _mm_min_ps(_mm_cvtepi32_ps(_mm_cvttps_epi32(positionU)), lastEntry);
+    __m128 entryV =
+        _mm_min_ps(_mm_cvtepi32_ps(_mm_cvttps_epi32(positionV)), lastEntry);
+
+    __m128 patch = _mm_add_ps(
+        _mm_mul_ps(patchX, _mm_set1_ps(float(m_patchesPerSide))), patchY);
+
+    _mm_store_si128(reinterpret_cast<__m128i*>(patches),
+                    _mm_cvttps_epi32(patch));
+    _mm_store_si128(reinterpret_cast<__m128i*>(entriesU),
+                    _mm_cvttps_epi32(entryU));
+    _mm_store_si128(reinterpret_cast<__m128i*>(entriesV),
+                    _mm_cvttps_epi32(entryV));
+    _mm_store_ps(fractionsU, _mm_sub_ps(positionU, entryU));
+    _mm_store_ps(fractionsV, _mm_sub_ps(positionV, entryV));
+
+    for (size_t j = 0; j < 4; ++j) {
+      const float* data = &m_patches[size_t(patches[j]) * 16];
+      TableLookup lookupU = {uint32_t(entriesU[j]), fractionsU[j]};
+      TableLookup lookupV = {uint32_t(entriesV[j]), fractionsV[j]};
+      a_out[i + j] = evaluatePatch(data, lookupU, lookupV) * a_heightScale;
+    }
+  }
+#endif
+
+  for (; i < count; ++i) {
+    const glm::vec2& point = a_points[i];
+    a_out[i] = evaluate(point.x * scale, point.y * scale) * a_heightScale;
+  }
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include "glm/glm.hpp"
+#include "tools/ArrayView.h"
+
+#include <cstdint>
+#include <vector>
+
+/**
+ * The CPU counterpart of the bicubic Bézier surface that BezierTerrain
+ * renders, so heights can be queried without going through the GPU.
+ *
+ * The control grid is a square of size x size heights, where control point
+ * (x, y) sits at the normalized coordinates (x / size, y / size). Patches are
+ * 4x4 control points that share their borders, exactly like makePlane in
+ * BezierTerrain.cpp builds them and res/bezier-terrain/tess-eval.glsl
+ * evaluates them.
+ *
+ * Since control points are evenly spaced, the surface is linear in x and z, so
+ * we only need to keep the heights, stored contiguously for each patch.
+ * Bernstein weights come from a precomputed table.
+ */
+class BezierHeightField final {
+public:
+  // The number of intervals of the Bernstein weight table. The weights are
+  // linearly interpolated between entries, which with this many is off by at
+  // most 1.5e-6 of the height range of a patch.
+  static const uint32_t BERNSTEIN_TABLE_SIZE = 1024;
+
+private:
+  uint32_t m_size;
+  uint32_t m_patchesPerSide;
+  // 16 heights per patch, patch-major, then x-major inside each patch.
+  std::vector<float> m_patches;
+
+  float evaluate(float a_gridX, float a_gridY) const;
+
+public:
+  BezierHeightField() : m_size(0), m_patchesPerSide(0) {}
+
+  /**
+   * a_controlHeights has a_size * a_size heights, where the height of control
+   * point (x, y) is at x * a_size + y, which is the order makePlane pushes
+   * them in.
+   */
+  BezierHeightField(uint32_t a_size, ArrayView<const float> a_controlHeights);
+
+  bool empty() const {
+    return m_patches.empty();
+  }
+
+  /**
+   * Returns the height of the surface at the normalized coordinates (u, v).
+   * Coordinates past the last patch are clamped to it.
+   */
+  float sample(float u, float v) const;
+
+  /**
+   * Batched version of sample(), with the same conventions as
+   * HeightField::sampleMany().
+   */
+  void sampleMany(ArrayView<const glm::vec2> a_points,
+                  ArrayView<float> a_out,
+                  float a_pointScale = 1.0f,
+                  float a_heightScale = 1.0f) const;
+};
@@ -7,10 +7,22 @@
 #include "base/Program.h"
 #include "base/ErrorChecker.h"
 #include "base/Scene.h"
+#include "base/TerrainCache.h"
+#include "geometry/Frustum.h"
 #include "glm/gtc/type_ptr.hpp"
 
+#include <algorithm>
+#include <cmath>
+#include <vector>
 #include <SFML/Graphics.hpp>
 
+// The size of the control point grid, see makePlane.
+const size_t PLANE_SIZE = 20 * 3 + 4;
+
+static const char* HEIGHTMAP_PATH = "res/terrain/heightmap.png";
+static const char* COVER_PATH = "res/terrain/cover.png";
+static const char* CACHE_PATH = "res/terrain/bezier-terrain.cache";
+
 // Map byte from 255 to 0, to +0.25/-0.25
 static inline float mapToHeight(uint8_t byte) {
   float portion = ((float)byte) / 255.0;
@@ -72,17 +84,95 @@ static void makePlane(const sf::Image& heightMap,
   }
 }
 
+// Computes the bounds the tessellation control shader needs to choose the
+// inner tessellation level of each patch, in the order makePlane emits them:
+//
+//  * x: The geometric error of the patch when tessellated once, that is, how
+//    far it gets from the quad between its corners. It's bounded by the
+//    second differences of the control points, see Filip, Magedson and
+//    Markot, "Surface algorithms using bounds on derivatives". The error goes
+//    down with the square of the tessellation level.
+//  * y, z: The minimum and maximum heights of the control points, which bound
+//    the patch too.
+//
+// Only the heights matter, since the control points are evenly spaced on the
+// other axes.
+static std::vector<glm::vec4> computePatchBounds(
+    ArrayView<const glm::vec3> controlPoints) {
+  const size_t size = PLANE_SIZE;
+  const size_t patchesPerRow = (size - 4) / 3 + 1;
+  auto height = [&](size_t x, size_t y) {
+    return controlPoints[x * size + y].y;
+  };
+
+  std::vector<glm::vec4> ret;
+  ret.reserve(patchesPerRow * patchesPerRow);
+  for (size_t patchX = 0; patchX < patchesPerRow; ++patchX) {
+    for (size_t patchY = 0; patchY < patchesPerRow; ++patchY) {
+      const size_t x0 = patchX * 3;
+      const size_t y0 = patchY * 3;
+
+      float minHeight = height(x0, y0);
+      float maxHeight = minHeight;
+      float secondU = 0.0f;
+      float secondV = 0.0f;
+      float twist = 0.0f;
+      for (size_t j = 0; j < 4; ++j) {
+        for (size_t k = 0; k < 4; ++k) {
+          const size_t x = x0 + j;
+          const size_t y = y0 + k;
+          float h = height(x, y);
+          minHeight = std::min(minHeight, h);
+          maxHeight = std::max(maxHeight, h);
+
+          if (j < 2) {
+            float difference = h - 2.0f * height(x + 1, y) + height(x + 2, y);
+            secondU = std::max(secondU, std::abs(difference));
+          }
+          if (k < 2) {
+            float difference = h - 2.0f * height(x, y + 1) + height(x, y + 2);
+            secondV = std::max(secondV, std::abs(difference));
+          }
+          if (j < 3 && k < 3) {
+            float difference = h - height(x + 1, y) - height(x, y + 1) +
+                               height(x + 1, y + 1);
+            twist = std::max(twist, std::abs(difference));
+          }
+        }
+      }
+
+      // For a bicubic patch the second derivatives are bounded by 6 times the
+      // second differences, and the twist by 9 times the mixed ones.
+      float error = (6.0f * secondU + 2.0f * 9.0f * twist + 6.0f * secondV) /
+                    8.0f;
+      ret.push_back(glm::vec4(error, minHeight, maxHeight, 0.0f));
+    }
+  }
+
+  return ret;
+}
+
 BezierTerrain::BezierTerrain(std::unique_ptr<Program> program,
+                             std::unique_ptr<Program> programWithGeometryShader,
                              std::unique_ptr<Program> programForShadowMap,
                              GLuint texture,
-                             const std::vector<glm::vec3>& vertices,
-                             const std::vector<GLuint>& indices)
+                             ArrayView<const glm::vec3> vertices,
+                             ArrayView<const GLuint> indices,
+                             const ShadowMapSettings& shadowMapSettings)
   : m_program(std::move(program))
+  , m_programWithGeometryShader(std::move(programWithGeometryShader))
   , m_programForShadowMap(std::move(programForShadowMap))
   , m_coverTexture(texture)
   , m_indicesCount(indices.size()) {
   AutoGLErrorChecker checker;
 
+  std::vector<float> controlHeights;
+  controlHeights.reserve(vertices.size());
+  for (const auto& vertex : vertices)
+    controlHeights.push_back(vertex.y);
+  m_heightField = BezierHeightField(
+      PLANE_SIZE, View(controlHeights.data(), controlHeights.size()));
+
   glGenVertexArrays(1, &m_vao);
 
   glBindVertexArray(m_vao);
@@ -101,23 +191,19 @@ BezierTerrain::BezierTerrain(std::unique_ptr<Program> program,
   glEnableVertexAttribArray(0);
   glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(glm::vec3), 0);
 
-  glGenTextures(1, &m_shadowMapTexture);
+  std::vector<glm::vec4> patchBounds = computePatchBounds(vertices);
+  assert(patchBounds.size() * 16 == indices.size());
+  glGenBuffers(1, &m_patchBoundsBuffer);
+  glBindBuffer(GL_TEXTURE_BUFFER, m_patchBoundsBuffer);
+  glBufferData(GL_TEXTURE_BUFFER, sizeof(glm::vec4) * patchBounds.size(),
+               patchBounds.data(), GL_STATIC_DRAW);
+  glGenTextures(1, &m_patchBoundsTexture);
+  glBindTexture(GL_TEXTURE_BUFFER, m_patchBoundsTexture);
+  glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, m_patchBoundsBuffer);
+  glBindTexture(GL_TEXTURE_BUFFER, 0);
+  glBindBuffer(GL_TEXTURE_BUFFER, 0);
 
-  // Create the proper depth map and attach it to our shadowmap framebuffer.
-  glBindTexture(GL_TEXTURE_2D, m_shadowMapTexture);
-  glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT, SHADOW_WIDTH,
-               SHADOW_HEIGHT, 0, GL_DEPTH_COMPONENT, GL_FLOAT, NULL);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-
-  glGenFramebuffers(1, &m_shadowMapFB);
-  glBindFramebuffer(GL_FRAMEBUFFER, m_shadowMapFB);
-  glReadBuffer(GL_NONE);
-  glDrawBuffer(GL_NONE);
-  glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D,
-                         m_shadowMapTexture, 0);
+  shadowMapSettings.createCache(m_shadowMapTexture, m_shadowMapFB);
 
   glBindVertexArray(0);
   glBindTexture(GL_TEXTURE_2D, 0);
@@ -134,6 +220,26 @@ BezierTerrain::~BezierTerrain() {
   glDeleteVertexArrays(1, &m_vao);
   glDeleteBuffers(1, &m_vbo);
   glDeleteBuffers(1, &m_ebo);
+  glDeleteTextures(1, &m_patchBoundsTexture);
+  glDeleteBuffers(1, &m_patchBoundsBuffer);
+}
+
+float BezierTerrain::heightAt(float x, float y) const {
+  return m_heightField.sample(x / TERRAIN_DIMENSIONS, y / TERRAIN_DIMENSIONS) *
+         TERRAIN_DIMENSIONS;
+}
+
+void BezierTerrain::heightsAt(ArrayView<const glm::vec2> a_points,
+                              ArrayView<float> a_out) const {
+  m_heightField.sampleMany(a_points, a_out, 1.0f / TERRAIN_DIMENSIONS,
+                           TERRAIN_DIMENSIONS);
+}
+
+Optional<float> BezierTerrain::raycast(const Ray& a_ray) const {
+  // A few steps per control point interval is enough for a surface this
+  // smooth.
+  const float step = float(TERRAIN_DIMENSIONS) / (PLANE_SIZE * 4);
+  return marchRay(a_ray, glm::vec2(TERRAIN_DIMENSIONS), step);
 }
 
 #define QUERY(u)                                                               \
@@ -144,24 +250,24 @@ BezierTerrain::~BezierTerrain() {
 
 void BezierTerrainUniformsForShadowMap::query(const Program& program) {
   QUERY(uModel);
-  QUERY(uShadowMapViewProjection);
+  QUERY(uPatchBounds);
+  QUERY(uFrustumPlanes);
 }
 
 void BezierTerrainUniforms::query(const Program& program) {
   BezierTerrainUniformsForShadowMap::query(program);
-  QUERY(uCameraPosition);
-  QUERY(uLightSourcePosition);
   QUERY(uLodLevel);
-  QUERY(uViewProjection);
   QUERY(uCover);
   QUERY(uShadowMap);
   QUERY(uDimension);
   QUERY(uLodEnabled);
+  QUERY(uLodScale);
 }
 
 void BezierTerrain::queryUniforms() {
   m_uniformsForShadowMap.query(*m_programForShadowMap);
   m_uniforms.query(*m_program);
+  m_uniformsWithGeometryShader.query(*m_programWithGeometryShader);
 }
 
 void BezierTerrain::drawTerrain(const Scene& scene) const {
@@ -174,80 +280,129 @@ void BezierTerrain::drawTerrainInternal(const Scene& scene,
   AutoGLErrorChecker checker;
   glCullFace(forShadowMap ? GL_BACK : GL_FRONT);
 
+  const bool withGeometryShader =
+      !forShadowMap && scene.terrainNormalsInGeometryShader();
+  const BezierTerrainUniforms& uniforms =
+      withGeometryShader ? m_uniformsWithGeometryShader : m_uniforms;
   Program& applicableProgram =
-      forShadowMap ? *m_programForShadowMap : *m_program;
+      forShadowMap ? *m_programForShadowMap
+                   : withGeometryShader ? *m_programWithGeometryShader
+                                        : *m_program;
   const BezierTerrainUniformsForShadowMap& applicableUniforms =
-      forShadowMap ? m_uniformsForShadowMap : m_uniforms;
+      forShadowMap ? m_uniformsForShadowMap : uniforms;
+
+  glm::mat4 viewProjection =
+      forShadowMap ? scene.shadowMapViewProjection() : scene.viewProjection();
 
   applicableProgram.use();
+  scene.uploadPassUniforms(viewProjection, forShadowMap);
   glBindVertexArray(m_vao);
   glUniformMatrix4fv(applicableUniforms.uModel, 1, GL_FALSE,
                      glm::value_ptr(transform()));
-  glUniformMatrix4fv(applicableUniforms.uShadowMapViewProjection, 1, GL_FALSE,
-                     glm::value_ptr(scene.shadowMapViewProjection()));
 
-  if (!forShadowMap) {
-    const glm::vec3& cameraPos = scene.cameraPosition();
+  // The tessellation control shader discards the patches outside of the
+  // frustum we're drawing to, using their bounds.
+  Frustum frustum =
+      Frustum::fromMatrix(viewProjection).inLocalSpace(transform());
+  glUniform4fv(applicableUniforms.uFrustumPlanes, 6,
+               glm::value_ptr(*frustum.planes()));
+
+  glActiveTexture(GL_TEXTURE2);
+  glBindTexture(GL_TEXTURE_BUFFER, m_patchBoundsTexture);
+  glUniform1i(applicableUniforms.uPatchBounds, 2);
 
+  if (!forShadowMap) {
     glActiveTexture(GL_TEXTURE0);
     glBindTexture(GL_TEXTURE_2D, m_coverTexture);
 
     glActiveTexture(GL_TEXTURE1);
-    glBindTexture(GL_TEXTURE_2D, *scene.shadowMap());
-    glUniformMatrix4fv(m_uniforms.uViewProjection, 1, GL_FALSE,
-                       glm::value_ptr(scene.viewProjection()));
-
-    glUniform3fv(m_uniforms.uCameraPosition, 1, glm::value_ptr(cameraPos));
-    glUniform3fv(m_uniforms.uLightSourcePosition, 1,
-                 glm::value_ptr(scene.lightSourcePosition()));
-    glUniform1i(m_uniforms.uLodEnabled, scene.dynamicTessellationEnabled());
-    glUniform1f(m_uniforms.uLodLevel, scene.tessLevel());
+    glBindTexture(GL_TEXTURE_2D_ARRAY, *scene.shadowMap());
+    glUniform1i(uniforms.uLodEnabled, scene.dynamicTessellationEnabled());
+    glUniform1f(uniforms.uLodLevel, scene.tessLevel());
+    glUniform1f(uniforms.uLodScale,
+                scene.projectionScale() / scene.lodPixelError());
 
     // These should be constant.
-    glUniform1i(m_uniforms.uCover, 0);
-    glUniform1i(m_uniforms.uShadowMap, 1);
-    glUniform1f(m_uniforms.uDimension, TERRAIN_DIMENSIONS);
+    glUniform1i(uniforms.uCover, 0);
+    glUniform1i(uniforms.uShadowMap, 1);
+    glUniform1f(uniforms.uDimension, TERRAIN_DIMENSIONS);
   }
 
   glPatchParameteri(GL_PATCH_VERTICES, 16);
   glDrawElements(GL_PATCHES, m_indicesCount, GL_UNSIGNED_INT, nullptr);
 
+  glBindTexture(GL_TEXTURE_BUFFER, 0);
   glBindTexture(GL_TEXTURE_2D, 0);
   glBindVertexArray(0);
   glUseProgram(0);
 }
 
-std::unique_ptr<BezierTerrain> BezierTerrain::create() {
+std::unique_ptr<BezierTerrain> BezierTerrain::create(
+    const ShadowMapSettings& a_shadowMapSettings) {
   ShaderSet shaders("res/bezier-terrain/common.glsl",
                     "res/bezier-terrain/vertex.glsl",
                     "res/bezier-terrain/fragment.glsl");
   shaders.m_tessellation_control = "res/bezier-terrain/tess-control.glsl";
   shaders.m_tessellation_evaluation = "res/bezier-terrain/tess-eval.glsl";
-  shaders.m_geometry = "res/bezier-terrain/geometry.glsl";
 
+  // The evaluation shader computes the normals from the derivatives of the
+  // patch, so there's no need for a geometry shader, which tends to be the
+  // slowest stage.
   auto program = Program::fromShaders(shaders);
   if (!program) {
     ERROR("Failed to create quad BezierTerrain program");
     return nullptr;
   }
 
+  ShaderSet geometryShaders = shaders;
+  geometryShaders.m_raw_prefix = "#define NORMALS_IN_GEOMETRY_SHADER\n";
+  geometryShaders.m_geometry = "res/bezier-terrain/geometry.glsl";
+  auto programWithGeometryShader = Program::fromShaders(geometryShaders);
+  if (!programWithGeometryShader) {
+    ERROR("Failed to create quad BezierTerrain program with a geometry shader");
+    return nullptr;
+  }
+
   shaders.m_raw_prefix = "#define FOR_SHADOW_MAP\n";
-  shaders.m_geometry.clear();
   auto shadowMapProgram = Program::fromShaders(shaders);
   if (!shadowMapProgram) {
     ERROR("Failed to create quad BezierTerrain program");
     return nullptr;
   }
 
+  // Skip decoding the images and building the plane if we've done it before.
+  const uint64_t cacheKey =
+      TerrainCache::hashFiles({HEIGHTMAP_PATH, COVER_PATH}, PLANE_SIZE);
+  std::unique_ptr<BezierTerrain> terrain;
+  if (auto cache = TerrainCache::open(CACHE_PATH, cacheKey)) {
+    auto vertices = cache->view<glm::vec3>("controlPoints");
+    auto indices = cache->view<GLuint>("indices");
+    GLuint coverTexture = 0;
+    if (!vertices.empty() && !indices.empty())
+      coverTexture = cache->texture("cover");
+
+    if (coverTexture) {
+      terrain = std::unique_ptr<BezierTerrain>(
+          new BezierTerrain(std::move(program),
+                            std::move(programWithGeometryShader),
+                            std::move(shadowMapProgram), coverTexture,
+                            vertices, indices, a_shadowMapSettings));
+      terrain->scale(TERRAIN_DIMENSIONS);
+      return terrain;
+    }
+
+    WARN("Incomplete BezierTerrain cache, rebuilding it");
+  }
+
   sf::Image heightMap;
-  if (!heightMap.loadFromFile("res/terrain/heightmap.png")) {
+  if (!heightMap.loadFromFile(HEIGHTMAP_PATH)) {
   // if (!heightMap.loadFromFile("res/terrain/maribor.png")) {
     ERROR("Error loading heightmap");
     return nullptr;
   }
 
   sf::Image cover;
-  if (!cover.loadFromFile("res/terrain/cover.png")) {
+  if (!cover.loadFromFile(COVER_PATH)) {
     ERROR("Error loading cover");
     return nullptr;
   }
@@ -256,11 +411,21 @@ std::unique_ptr<BezierTerrain> BezierTerrain::create() {
 
   std::vector<glm::vec3> vertices;
   std::vector<GLuint> indices;
-  makePlane<20 * 3 + 4>(heightMap, vertices, indices);
-
-  auto terrain = std::unique_ptr<BezierTerrain>(
-      new BezierTerrain(std::move(program), std::move(shadowMapProgram),
-                        coverTexture, vertices, indices));
+  makePlane<PLANE_SIZE>(heightMap, vertices, indices);
+
+  TerrainCache::Writer cacheWriter;
+  cacheWriter.add("controlPoints", View(vertices.data(), vertices.size()));
+  cacheWriter.add("indices", View(indices.data(), indices.size()));
+  cacheWriter.addTexture("cover", coverTexture);
+  cacheWriter.write(CACHE_PATH, cacheKey);
+
+  terrain = std::unique_ptr<BezierTerrain>(
+      new BezierTerrain(std::move(program),
+                        std::move(programWithGeometryShader),
+                        std::move(shadowMapProgram), coverTexture,
+                        View(vertices.data(), vertices.size()),
+                        View(indices.data(), indices.size()),
+                        a_shadowMapSettings));
 
   terrain->scale(TERRAIN_DIMENSIONS);
 
@@ -270,6 +435,7 @@ std::unique_ptr<BezierTerrain> BezierTerrain::create() {
 // We compute a shadow map at the max resolution once.
 void BezierTerrain::recomputeShadowMap(const Scene& scene) {
   AutoGLErrorChecker checker;
+  AutoShadowMapViewport viewport(scene.shadowMapSettings());
 
   glBindFramebuffer(GL_FRAMEBUFFER, m_shadowMapFB);
   glClear(GL_DEPTH_BUFFER_BIT);
@@ -1,8 +1,11 @@
 #pragma once
 
 #include "geometry/Node.h"
+#include "base/BezierHeightField.h"
 #include "base/gl.h"
+#include "base/ShadowMapSettings.h"
 #include "ITerrain.h"
+#include "tools/ArrayView.h"
 
 #include <vector>
 
@@ -11,20 +14,19 @@ class Scene;
 
 struct BezierTerrainUniformsForShadowMap {
   GLint uModel;
-  GLint uShadowMapViewProjection;
+  GLint uPatchBounds;
+  GLint uFrustumPlanes;
 
   void query(const Program&);
 };
 
 struct BezierTerrainUniforms : public BezierTerrainUniformsForShadowMap {
-  GLint uCameraPosition;
-  GLint uLightSourcePosition;
   GLint uLodEnabled;
   GLint uLodLevel;
   GLint uCover;
   GLint uShadowMap;
   GLint uDimension;
-  GLint uViewProjection;
+  GLint uLodScale;
 
   void query(const Program&);
   void update(const Scene&) const;
@@ -33,16 +35,25 @@ struct BezierTerrainUniforms : public BezierTerrainUniformsForShadowMap {
 class BezierTerrain final : public Node, public ITerrain {
   std::unique_ptr<Program> m_program;
   BezierTerrainUniforms m_uniforms;
+  // Computes the normals in a geometry shader, only kept around to compare
+  // it against m_program. See Scene::terrainNormalsInGeometryShader.
+  std::unique_ptr<Program> m_programWithGeometryShader;
+  BezierTerrainUniforms m_uniformsWithGeometryShader;
   std::unique_ptr<Program> m_programForShadowMap;
   BezierTerrainUniformsForShadowMap m_uniformsForShadowMap;
 
   GLuint m_coverTexture;
 
-  // We don't bother to keep the vertices in memory, maybe we should?
-  // std::vector<glm::vec3> m_vertices;
-  // std::vector<GLuint> m_indices;
+  // Only the heights of the control points are kept in memory, to answer
+  // heightAt() without going through the GPU.
+  BezierHeightField m_heightField;
   size_t m_indicesCount;
 
+  // The error and height bounds of each patch, see computePatchBounds in
+  // BezierTerrain.cpp.
+  GLuint m_patchBoundsBuffer;
+  GLuint m_patchBoundsTexture;
+
   GLuint m_vao;
   GLuint m_ebo;
   GLuint m_vbo;
@@ -51,10 +62,12 @@ class BezierTerrain final : public Node, public ITerrain {
   GLuint m_shadowMapTexture;
 
   BezierTerrain(std::unique_ptr<Program>,
+                std::unique_ptr<Program>,
                 std::unique_ptr<Program>,
                 GLuint,
-                const std::vector<glm::vec3>&,
-                const std::vector<GLuint>&);
+                ArrayView<const glm::vec3> a_controlPoints,
+                ArrayView<const GLuint> a_indices,
+                const ShadowMapSettings&);
 
   void queryUniforms();
 
@@ -64,7 +77,7 @@ public:
 
   virtual ~BezierTerrain();
 
-  static std::unique_ptr<BezierTerrain> create();
+  static std::unique_ptr<BezierTerrain> create(const ShadowMapSettings&);
 
   virtual void recomputeShadowMap(const Scene&) override;
   virtual Optional<GLuint> shadowMapFBO() const override;
@@ -76,9 +89,8 @@ public:
     assert(false && "call drawTerrain instead!");
   }
 
-  virtual float heightAt(float, float) const override {
-    // FIXME(emilio): Proper height.
-    // assert(false && "Unimplemented!");
-    return 0.0;
-  }
+  virtual float heightAt(float x, float y) const override;
+  virtual void heightsAt(ArrayView<const glm::vec2>,
+                         ArrayView<float>) const override;
+  virtual Optional<float> raycast(const Ray&) const override;
 };
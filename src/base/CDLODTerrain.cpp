@@ -0,0 +1,393 @@
+#include "base/CDLODTerrain.h"
+#include "base/DynTerrain.h"
+#include "base/ErrorChecker.h"
+#include "base/Logging.h"
+#include "base/Scene.h"
+#include "base/Terrain.h"
+#include "geometry/PatchGrid.h"
+
+#include "glm/gtc/type_ptr.hpp"
+
+#include <algorithm>
+#include <cstddef>
+#include <SFML/Graphics.hpp>
+
+// How far into a level's range vertices start morphing to the next level.
+const float MORPH_START_RATIO = 0.66f;
+
+static uint32_t nodesPerSide(uint32_t a_level) {
+  return 1 << (CDLODTerrain::LOD_LEVELS - 1 - a_level);
+}
+
+CDLODTerrain::CDLODTerrain(std::unique_ptr<Program> a_program,
+                           std::unique_ptr<Program> a_programForShadowMap,
+                           HeightField&& a_heightField,
+                           GLuint a_cover,
+                           GLuint a_heightmap,
+                           const ShadowMapSettings& a_shadowMapSettings)
+  : m_program(std::move(a_program))
+  , m_programForShadowMap(std::move(a_programForShadowMap))
+  , m_coverTexture(a_cover)
+  , m_heightmapTexture(a_heightmap)
+  , m_heightField(std::move(a_heightField))
+  , m_pyramid(m_heightField)
+  , m_grid(PatchGrid::get(GRID_QUADS)) {
+  AutoGLErrorChecker checker;
+
+  // Compute the height bounds of the leaves from the heightfield, then merge
+  // them up the tree.
+  m_nodeHeightBounds.resize(LOD_LEVELS);
+  const uint32_t leaves = nodesPerSide(0);
+  const uint32_t width = m_heightField.width();
+  const uint32_t height = m_heightField.height();
+  m_nodeHeightBounds[0].resize(leaves * leaves);
+  for (uint32_t y = 0; y < leaves; ++y) {
+    // Include the texels shared with the next node.
+    uint32_t y0 = y * height / leaves;
+    uint32_t y1 = std::min(height - 1, (y + 1) * height / leaves);
+    for (uint32_t x = 0; x < leaves; ++x) {
+      uint32_t x0 = x * width / leaves;
+      uint32_t x1 = std::min(width - 1, (x + 1) * width / leaves);
+
+      glm::vec2 bounds(m_heightField.at(x0, y0));
+      for (uint32_t texelY = y0; texelY <= y1; ++texelY) {
+        for (uint32_t texelX = x0; texelX <= x1; ++texelX) {
+          float h = m_heightField.at(texelX, texelY);
+          bounds.x = std::min(bounds.x, h);
+          bounds.y = std::max(bounds.y, h);
+        }
+      }
+      m_nodeHeightBounds[0][y * leaves + x] = bounds;
+    }
+  }
+
+  for (uint32_t level = 1; level < LOD_LEVELS; ++level) {
+    const uint32_t count = nodesPerSide(level);
+    const auto& children = m_nodeHeightBounds[level - 1];
+    auto& bounds = m_nodeHeightBounds[level];
+    bounds.resize(count * count);
+    for (uint32_t y = 0; y < count; ++y) {
+      for (uint32_t x = 0; x < count; ++x) {
+        glm::vec2 merged = children[(2 * y) * count * 2 + 2 * x];
+        for (uint32_t quadrant = 1; quadrant < 4; ++quadrant) {
+          uint32_t childX = 2 * x + (quadrant & 1);
+          uint32_t childY = 2 * y + (quadrant >> 1);
+          const glm::vec2& child = children[childY * count * 2 + childX];
+          merged.x = std::min(merged.x, child.x);
+          merged.y = std::max(merged.y, child.y);
+        }
+        bounds[y * count + x] = merged;
+      }
+    }
+  }
+
+  // Each level is used up to twice the world size of its nodes, and ranges
+  // double with each level, which keeps neighbouring nodes at most one level
+  // apart.
+  const float leafSize = float(TERRAIN_DIMENSIONS) / leaves;
+  for (uint32_t level = 0; level < LOD_LEVELS; ++level)
+    m_lodRanges[level] = 2.0f * leafSize * (1 << level);
+
+  glGenVertexArrays(1, &m_vao);
+  glBindVertexArray(m_vao);
+
+  m_grid->setupVertexArray(0);
+
+  // The per-node attributes. Their pointers are set up before each draw call,
+  // since nodes are drawn in batches from different parts of the buffer.
+  glGenBuffers(1, &m_instancesVBO);
+  glEnableVertexAttribArray(1);
+  glEnableVertexAttribArray(2);
+  glVertexAttribDivisor(1, 1);
+  glVertexAttribDivisor(2, 1);
+
+  glBindVertexArray(0);
+
+  a_shadowMapSettings.createCache(m_cachedShadowMap, m_cachedShadowMapFBO);
+
+  m_uniforms.query(*m_program);
+  m_uniformsForShadowMap.query(*m_programForShadowMap);
+}
+
+CDLODTerrain::~CDLODTerrain() {
+  glDeleteTextures(1, &m_coverTexture);
+  glDeleteTextures(1, &m_heightmapTexture);
+
+  glDeleteTextures(1, &m_cachedShadowMap);
+  glDeleteFramebuffers(1, &m_cachedShadowMapFBO);
+
+  glDeleteBuffers(1, &m_instancesVBO);
+  glDeleteVertexArrays(1, &m_vao);
+}
+
+/* static */ std::unique_ptr<CDLODTerrain> CDLODTerrain::create(
+    const ShadowMapSettings& a_shadowMapSettings) {
+  ShaderSet shaders("res/cdlod-terrain/common.glsl",
+                    "res/cdlod-terrain/vertex.glsl",
+                    "res/dyn-terrain/fragment.glsl");
+
+  auto program = Program::fromShaders(shaders);
+  if (!program) {
+    ERROR("Failed to create CDLODTerrain program");
+    return nullptr;
+  }
+
+  shaders.m_raw_prefix = "#define FOR_SHADOW_MAP\n";
+  auto shadowMapProgram = Program::fromShaders(shaders);
+  if (!shadowMapProgram) {
+    ERROR("Failed to create CDLODTerrain program for shadow mapping");
+    return nullptr;
+  }
+
+  HeightField heightField = DynTerrain::loadHeightField();
+  if (heightField.empty()) {
+    ERROR("Error loading heightmap");
+    return nullptr;
+  }
+
+  sf::Image coverImporter;
+  if (!coverImporter.loadFromFile("res/terrain/cover.png")) {
+    ERROR("Error loading cover");
+    return nullptr;
+  }
+
+  GLuint cover = DynTerrain::textureFromImage(coverImporter, true);
+  GLuint heightmap = DynTerrain::textureFromHeightField(heightField);
+
+  auto ret = std::unique_ptr<CDLODTerrain>(
+      new CDLODTerrain(std::move(program), std::move(shadowMapProgram),
+                       std::move(heightField), cover, heightmap,
+                       a_shadowMapSettings));
+
+  ret->scale(TERRAIN_DIMENSIONS);
+  return ret;
+}
+
+void CDLODTerrain::Uniforms::query(const Program& program) {
+#define QUERY(u)                                                               \
+  do {                                                                         \
+    u = glGetUniformLocation(program.id(), #u);                                \
+    /* assert(u != -1); */                                                     \
+  } while (0)
+
+  QUERY(uModel);
+  QUERY(uCover);
+  QUERY(uHeightMap);
+  QUERY(uShadowMap);
+  QUERY(uGridQuads);
+
+#undef QUERY
+}
+
+AABB CDLODTerrain::nodeBounds(uint32_t a_level,
+                              uint32_t a_x,
+                              uint32_t a_y) const {
+  const uint32_t count = nodesPerSide(a_level);
+  const float size = 1.0f / count;
+  const glm::vec2& heights = m_nodeHeightBounds[a_level][a_y * count + a_x];
+
+  glm::vec2 offset = glm::vec2(a_x, a_y) * size - glm::vec2(0.5f);
+  return AABB(glm::vec3(offset.x, heights.x, offset.y),
+              glm::vec3(offset.x + size, heights.y, offset.y + size));
+}
+
+void CDLODTerrain::addToSelection(uint32_t a_level,
+                                  uint32_t a_x,
+                                  uint32_t a_y,
+                                  int32_t a_quadrant) const {
+  SelectedNode node;
+  node.m_size = 1.0f / nodesPerSide(a_level);
+  node.m_offset = glm::vec2(a_x, a_y) * node.m_size - glm::vec2(0.5f);
+  node.m_level = a_level;
+  node.m_quadrant = a_quadrant;
+  m_selection.push_back(node);
+}
+
+// Returns false if the node is out of range for its level, so the parent has
+// to draw that area itself.
+bool CDLODTerrain::selectNode(const SelectionContext& a_context,
+                              uint32_t a_level,
+                              uint32_t a_x,
+                              uint32_t a_y) const {
+  AABB bounds = nodeBounds(a_level, a_x, a_y).transformed(transform());
+  float distance = bounds.distanceSquaredTo(a_context.m_cameraPosition);
+
+  float range = m_lodRanges[a_level];
+  if (distance > range * range)
+    return false;
+
+  // Not visible, but we've handled it.
+  if (!a_context.m_frustum.intersects(bounds))
+    return true;
+
+  if (a_level == 0) {
+    addToSelection(a_level, a_x, a_y, PatchGrid::WHOLE_GRID);
+    return true;
+  }
+
+  float childRange = m_lodRanges[a_level - 1];
+  if (distance > childRange * childRange) {
+    addToSelection(a_level, a_x, a_y, PatchGrid::WHOLE_GRID);
+    return true;
+  }
+
+  for (int32_t quadrant = 0; quadrant < 4; ++quadrant) {
+    uint32_t childX = 2 * a_x + (quadrant & 1);
+    uint32_t childY = 2 * a_y + (quadrant >> 1);
+    if (!selectNode(a_context, a_level - 1, childX, childY))
+      addToSelection(a_level, a_x, a_y, quadrant);
+  }
+
+  return true;
+}
+
+void CDLODTerrain::drawTerrain(const Scene& scene) const {
+  drawTerrainInternal(scene, false);
+}
+
+void CDLODTerrain::drawTerrainInternal(const Scene& scene,
+                                       bool forShadowMap) const {
+  AutoGLErrorChecker checker;
+
+  Program& program = forShadowMap ? *m_programForShadowMap : *m_program;
+  const Uniforms& uniforms = forShadowMap ? m_uniformsForShadowMap : m_uniforms;
+  glm::mat4 viewProjection =
+      forShadowMap ? scene.shadowMapViewProjection() : scene.viewProjection();
+
+  m_selection.clear();
+  if (forShadowMap) {
+    // The terrain shadow map is cached, so there's no camera to choose the
+    // detail for, just use the finest level everywhere.
+    const uint32_t leaves = nodesPerSide(0);
+    for (uint32_t y = 0; y < leaves; ++y)
+      for (uint32_t x = 0; x < leaves; ++x)
+        addToSelection(0, x, y, PatchGrid::WHOLE_GRID);
+  } else {
+    SelectionContext context;
+    context.m_frustum = Frustum::fromMatrix(viewProjection);
+    context.m_cameraPosition = scene.cameraPosition();
+    // If even the root is out of range, draw it at the coarsest level.
+    if (!selectNode(context, LOD_LEVELS - 1, 0, 0))
+      addToSelection(LOD_LEVELS - 1, 0, 0, PatchGrid::WHOLE_GRID);
+  }
+
+  program.use();
+  scene.uploadPassUniforms(viewProjection, forShadowMap);
+  glCullFace(forShadowMap ? GL_FRONT : GL_BACK);
+  glBindVertexArray(m_vao);
+
+  glUniformMatrix4fv(uniforms.uModel, 1, GL_FALSE, glm::value_ptr(transform()));
+  glUniform1f(uniforms.uGridQuads, GRID_QUADS);
+
+  glActiveTexture(GL_TEXTURE0);
+  glBindTexture(GL_TEXTURE_2D, m_coverTexture);
+
+  glActiveTexture(GL_TEXTURE0 + 1);
+  glBindTexture(GL_TEXTURE_2D, m_heightmapTexture);
+
+  if (!forShadowMap && scene.shadowMap()) {
+    glActiveTexture(GL_TEXTURE0 + 2);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, *scene.shadowMap());
+  }
+
+  glUniform1i(uniforms.uCover, 0);
+  glUniform1i(uniforms.uHeightMap, 1);
+  glUniform1i(uniforms.uShadowMap, 2);
+
+  // Sort the nodes by the part of the grid they need, so each part can be
+  // drawn with a single instanced call.
+  std::sort(m_selection.begin(), m_selection.end(),
+            [](const SelectedNode& a, const SelectedNode& b) {
+              return a.m_quadrant < b.m_quadrant;
+            });
+
+  m_instances.clear();
+  for (const auto& node : m_selection) {
+    NodeInstance instance;
+    instance.m_node = glm::vec4(node.m_offset, node.m_size, node.m_level);
+    if (forShadowMap) {
+      // Never morph.
+      instance.m_morphRange = glm::vec2(1e30f, 2e30f);
+    } else {
+      float end = m_lodRanges[node.m_level];
+      float start = node.m_level ? m_lodRanges[node.m_level - 1] : 0.0f;
+      start += (end - start) * MORPH_START_RATIO;
+      instance.m_morphRange = glm::vec2(start, end);
+    }
+    m_instances.push_back(instance);
+  }
+
+  // Orphan the previous contents so we don't stall on the previous frame.
+  glBindBuffer(GL_ARRAY_BUFFER, m_instancesVBO);
+  glBufferData(GL_ARRAY_BUFFER, sizeof(NodeInstance) * m_instances.size(),
+               nullptr, GL_STREAM_DRAW);
+  glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(NodeInstance) * m_instances.size(),
+                  m_instances.data());
+
+  size_t first = 0;
+  while (first < m_selection.size()) {
+    int32_t quadrant = m_selection[first].m_quadrant;
+    size_t last = first;
+    while (last < m_selection.size() &&
+           m_selection[last].m_quadrant == quadrant)
+      ++last;
+
+    // We can't rely on glDrawElementsInstancedBaseInstance (GL 4.2), so point
+    // the attributes to the first instance of the batch instead.
+    size_t base = first * sizeof(NodeInstance);
+    glVertexAttribPointer(1, 4, GL_FLOAT, GL_FALSE, sizeof(NodeInstance),
+                          (GLvoid*)(base + offsetof(NodeInstance, m_node)));
+    glVertexAttribPointer(
+        2, 2, GL_FLOAT, GL_FALSE, sizeof(NodeInstance),
+        (GLvoid*)(base + offsetof(NodeInstance, m_morphRange)));
+
+    glDrawElementsInstanced(GL_TRIANGLES, m_grid->indexCount(quadrant),
+                            m_grid->indexType(), m_grid->indexOffset(quadrant),
+                            last - first);
+    first = last;
+  }
+
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
+  glBindVertexArray(0);
+  glUseProgram(0);
+  glEnable(GL_CULL_FACE);
+}
+
+AABB CDLODTerrain::worldBounds() const {
+  glm::vec2 heights = m_pyramid.heightRange();
+  return AABB(glm::vec3(-0.5f, heights.x, -0.5f),
+              glm::vec3(0.5f, heights.y, 0.5f))
+      .transformed(transform());
+}
+
+float CDLODTerrain::heightAt(float x, float y) const {
+  return m_heightField.sample(x / TERRAIN_DIMENSIONS, y / TERRAIN_DIMENSIONS) *
+         TERRAIN_DIMENSIONS;
+}
+
+void CDLODTerrain::heightsAt(ArrayView<const glm::vec2> a_points,
+                             ArrayView<float> a_out) const {
+  m_heightField.sampleMany(a_points, a_out, 1.0f / TERRAIN_DIMENSIONS,
+                           TERRAIN_DIMENSIONS);
+}
+
+Optional<float> CDLODTerrain::raycast(const Ray& a_ray) const {
+  return m_pyramid.raycast(a_ray, 1.0f / TERRAIN_DIMENSIONS);
+}
+
+void CDLODTerrain::raycastMany(ArrayView<const Ray> a_rays,
+                               ArrayView<Optional<float>> a_out) const {
+  m_pyramid.raycastMany(a_rays, a_out, 1.0f / TERRAIN_DIMENSIONS);
+}
+
+Optional<GLuint> CDLODTerrain::shadowMapFBO() const {
+  return Some(m_cachedShadowMapFBO);
+}
+
+void CDLODTerrain::recomputeShadowMap(const Scene& scene) {
+  AutoShadowMapViewport viewport(scene.shadowMapSettings());
+  glBindFramebuffer(GL_FRAMEBUFFER, m_cachedShadowMapFBO);
+  glClear(GL_DEPTH_BUFFER_BIT);
+  drawTerrainInternal(scene, true);
+  glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
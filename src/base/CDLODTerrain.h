@@ -0,0 +1,146 @@
+#pragma once
+
+#include "base/gl.h"
+#include "base/HeightField.h"
+#include "base/HeightFieldPyramid.h"
+#include "base/ITerrain.h"
+#include "base/Program.h"
+#include "base/ShadowMapSettings.h"
+#include "geometry/AABB.h"
+#include "geometry/Frustum.h"
+#include "geometry/Node.h"
+
+#include <memory>
+#include <vector>
+
+class PatchGrid;
+class Scene;
+
+/**
+ * A continuous level of detail terrain, as described in Filip Strugar's
+ * "Continuous Distance-Dependent Level of Detail for Rendering Heightmaps"
+ * (CDLOD).
+ *
+ * The terrain is a quadtree of nodes, all of them rendered with the same grid
+ * mesh, so nodes higher up in the tree are coarser. Nodes are selected on the
+ * CPU by their distance to the camera, and the vertex shader morphs vertices
+ * between levels to avoid seams and popping.
+ *
+ * This only needs GL 3.3, so it's what we use when tessellation shaders aren't
+ * available.
+ */
+class CDLODTerrain final : public Node, public ITerrain {
+public:
+  // The number of levels of the quadtree, level 0 being the finest.
+  static const uint32_t LOD_LEVELS = 5;
+
+  // The number of quads on each side of the grid mesh each node is drawn with.
+  static const uint32_t GRID_QUADS = 16;
+
+private:
+  struct Uniforms {
+    GLint uModel;
+    GLint uCover;
+    GLint uHeightMap;
+    GLint uShadowMap;
+    GLint uGridQuads;
+
+    void query(const Program&);
+  };
+
+  // A node picked to be drawn this frame.
+  struct SelectedNode {
+    // The offset and size of the node in the terrain local space.
+    glm::vec2 m_offset;
+    float m_size;
+    uint32_t m_level;
+    // The quadrant of the node to draw, or PatchGrid::WHOLE_GRID.
+    int32_t m_quadrant;
+  };
+
+  // The per-instance attributes of a selected node, see
+  // res/cdlod-terrain/vertex.glsl.
+  struct NodeInstance {
+    // Offset (xy) and size (z) in the terrain local space, and level (w).
+    glm::vec4 m_node;
+    // The camera distances where morphing to the next level starts and ends.
+    glm::vec2 m_morphRange;
+  };
+
+  struct SelectionContext {
+    Frustum m_frustum;
+    glm::vec3 m_cameraPosition;
+  };
+
+  std::unique_ptr<Program> m_program;
+  std::unique_ptr<Program> m_programForShadowMap;
+  Uniforms m_uniforms;
+  Uniforms m_uniformsForShadowMap;
+
+  GLuint m_coverTexture;
+  GLuint m_heightmapTexture;
+
+  HeightField m_heightField;
+  HeightFieldPyramid m_pyramid;
+
+  // The min and max heights of each quadtree node, indexed by level first,
+  // then row-major.
+  std::vector<std::vector<glm::vec2>> m_nodeHeightBounds;
+
+  // The world-space distance up to which each level is used.
+  float m_lodRanges[LOD_LEVELS];
+
+  // Reused across frames to avoid allocating.
+  mutable std::vector<SelectedNode> m_selection;
+  mutable std::vector<NodeInstance> m_instances;
+
+  std::shared_ptr<PatchGrid> m_grid;
+
+  GLuint m_vao;
+  // Streamed every frame with the selected nodes.
+  GLuint m_instancesVBO;
+
+  GLuint m_cachedShadowMapFBO;
+  GLuint m_cachedShadowMap;
+
+  CDLODTerrain(std::unique_ptr<Program>,
+               std::unique_ptr<Program>,
+               HeightField&&,
+               GLuint a_cover,
+               GLuint a_heightmap,
+               const ShadowMapSettings&);
+
+  AABB nodeBounds(uint32_t a_level, uint32_t a_x, uint32_t a_y) const;
+  bool selectNode(const SelectionContext&,
+                  uint32_t a_level,
+                  uint32_t a_x,
+                  uint32_t a_y) const;
+  void addToSelection(uint32_t a_level,
+                      uint32_t a_x,
+                      uint32_t a_y,
+                      int32_t a_quadrant) const;
+
+  void drawTerrainInternal(const Scene&, bool forShadowMap) const;
+
+public:
+  virtual ~CDLODTerrain();
+  static std::unique_ptr<CDLODTerrain> create(const ShadowMapSettings&);
+
+  virtual void drawTerrain(const Scene&) const override;
+  virtual void recomputeShadowMap(const Scene&) override;
+  virtual Optional<GLuint> shadowMapFBO() const override;
+  virtual bool wantsShadowMap() const override {
+    return true;
+  }
+  virtual AABB worldBounds() const override;
+  virtual float heightAt(float x, float y) const override;
+  virtual void heightsAt(ArrayView<const glm::vec2>,
+                         ArrayView<float>) const override;
+  virtual Optional<float> raycast(const Ray&) const override;
+  virtual void raycastMany(ArrayView<const Ray>,
+                           ArrayView<Optional<float>>) const override;
+
+  void draw(DrawContext&) const override {
+    assert(false && "not implemented! use drawTerrain instead!");
+  }
+};
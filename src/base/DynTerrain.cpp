@@ -3,85 +3,253 @@
 #include "base/Scene.h"
 #include "base/Terrain.h"
 #include "geometry/DrawContext.h"
+#include "geometry/Frustum.h"
+#include "geometry/PatchGrid.h"
 
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <limits>
 #include <vector>
 #include <SFML/Graphics.hpp>
 
-// TODO: Share this among terrains, possibly converting this to a EBO.
-std::vector<glm::vec2> makePlane(uint32_t width, uint32_t height) {
-  std::vector<glm::vec2> ret;
-  ret.reserve(width * height * 4);
-
-  float frac_x = 1.0f / width;
-  float frac_y = 1.0f / height;
-
-#define AT(x, y) (glm::vec2((frac_x * (x)-0.5), (frac_y * (y)-0.5)))
-
-  // TODO: Could we send quads and just split those?
-  for (size_t x = 0; x < width; ++x) {
-    for (size_t y = 0; y < height; ++y) {
-      ret.push_back(AT(x, y + 1));
-      ret.push_back(AT(x + 1, y));
-      ret.push_back(AT(x, y));
-      ret.push_back(AT(x + 1, y + 1));
-      ret.push_back(AT(x + 1, y));
-      ret.push_back(AT(x, y + 1));
+// The number of quads on each side of the patch grid, the terrain is made of
+// as many instances of it as needed to reach the requested resolution.
+const uint32_t PATCH_QUADS = 10;
+
+// The size in pixels of the tiles of the cached shadow map we redraw when the
+// terrain changes.
+const GLint SHADOW_MAP_TILE = 64;
+
+// How many azimuths we bake the horizon for, and how many samples away we look
+// for it. Changing the terrain rebakes the horizons up to that far around.
+const uint32_t HORIZON_DIRECTIONS = 16;
+const uint32_t HORIZON_MAX_DISTANCE = 64;
+
+// The heightmap we load first, if it exists, and the one we fall back to.
+static const char* HEIGHTMAP_16_BIT_PATH = "res/terrain/heightmap.r16";
+static const char* HEIGHTMAP_PATH = "res/terrain/heightmap.png";
+
+// Heightmap values go from [0, 1] to [-1/6, 1/6] in the terrain local units.
+// This needs to be kept in sync with getHeight in res/dyn-terrain/common.glsl
+// and res/cdlod-terrain/common.glsl.
+const float HEIGHT_SCALE = 1.0f / 3.0f;
+const float HEIGHT_BIAS = -0.5f / 3.0f;
+
+static uint16_t encodeHeight(float a_height) {
+  float value =
+      glm::clamp((a_height - HEIGHT_BIAS) / HEIGHT_SCALE, 0.0f, 1.0f);
+  return uint16_t(std::round(value * 65535.0f));
+}
+
+static float decodeHeight(uint16_t a_value) {
+  return a_value / 65535.0f * HEIGHT_SCALE + HEIGHT_BIAS;
+}
+
+// The per-instance offset (xy) and scale (z) of each patch, in the terrain
+// local space.
+static std::vector<glm::vec3> makePatches(uint32_t resolution) {
+  assert(resolution % PATCH_QUADS == 0);
+  const uint32_t patchesPerSide = resolution / PATCH_QUADS;
+  const float scale = 1.0f / patchesPerSide;
+
+  std::vector<glm::vec3> ret;
+  ret.reserve(patchesPerSide * patchesPerSide);
+  for (uint32_t y = 0; y < patchesPerSide; ++y)
+    for (uint32_t x = 0; x < patchesPerSide; ++x)
+      ret.push_back(glm::vec3(x * scale - 0.5f, y * scale - 0.5f, scale));
+
+  return ret;
+}
+
+// Computes the bounds of the quad (x, y) of a grid of resolution x resolution
+// quads over the heightfield, from which we get the ones the tessellation
+// control shader needs to choose a tessellation level (see vertexLodBounds):
+//
+//  * x: The geometric error, that is, how far the heightmap gets from the
+//    flat quad between its corners.
+//  * y, z: The minimum and maximum heights of the quad.
+//
+// Everything is in the terrain local units.
+static glm::vec4 quadLodBounds(const HeightField& field,
+                               uint32_t resolution,
+                               uint32_t x,
+                               uint32_t y) {
+  const uint32_t width = field.width();
+  const uint32_t height = field.height();
+
+  const float v0 = float(y) / resolution;
+  const float v1 = float(y + 1) / resolution;
+  const uint32_t texelY0 = y * height / resolution;
+  const uint32_t texelY1 = std::min(height - 1, (y + 1) * height / resolution);
+
+  const float u0 = float(x) / resolution;
+  const float u1 = float(x + 1) / resolution;
+  const uint32_t texelX0 = x * width / resolution;
+  const uint32_t texelX1 = std::min(width - 1, (x + 1) * width / resolution);
+
+  float h00 = field.sample(u0, v0);
+  float h10 = field.sample(u1, v0);
+  float h01 = field.sample(u0, v1);
+  float h11 = field.sample(u1, v1);
+
+  glm::vec4 bounds(0.0f, std::min(std::min(h00, h10), std::min(h01, h11)),
+                   std::max(std::max(h00, h10), std::max(h01, h11)), 0.0f);
+  for (uint32_t texelY = texelY0; texelY <= texelY1; ++texelY) {
+    float t =
+        glm::clamp(float(texelY) * resolution / height - y, 0.0f, 1.0f);
+    for (uint32_t texelX = texelX0; texelX <= texelX1; ++texelX) {
+      float s = glm::clamp(float(texelX) * resolution / width - x, 0.0f, 1.0f);
+      float top = h00 + (h10 - h00) * s;
+      float bottom = h01 + (h11 - h01) * s;
+      float flat = top + (bottom - top) * t;
+
+      float sample = field.at(texelX, texelY);
+      bounds.x = std::max(bounds.x, std::abs(sample - flat));
+      bounds.y = std::min(bounds.y, sample);
+      bounds.z = std::max(bounds.z, sample);
+    }
+  }
+
+  return bounds;
+}
+
+// The bounds of the vertex (x, y) of the grid, that is, the error and height
+// bounds of all the quads around it, so the edges that touch it can choose
+// their tessellation level.
+static glm::vec4 vertexLodBounds(const std::vector<glm::vec4>& quads,
+                                 uint32_t resolution,
+                                 uint32_t x,
+                                 uint32_t y) {
+  glm::vec4 bounds(0.0f, std::numeric_limits<float>::max(),
+                   -std::numeric_limits<float>::max(), 0.0f);
+  for (uint32_t quadY = y ? y - 1 : 0; quadY <= y && quadY < resolution;
+       ++quadY) {
+    for (uint32_t quadX = x ? x - 1 : 0; quadX <= x && quadX < resolution;
+         ++quadX) {
+      const glm::vec4& quad = quads[quadY * resolution + quadX];
+      bounds.x = std::max(bounds.x, quad.x);
+      bounds.y = std::min(bounds.y, quad.y);
+      bounds.z = std::max(bounds.z, quad.z);
     }
   }
+  return bounds;
+}
 
-#undef AT
+// Computes the normal of the heightfield at each of the samples of the
+// region, from the central differences of the heights around it, in the
+// terrain local space.
+static std::vector<glm::vec3> computeNormals(const HeightField& field,
+                                             const HeightFieldRegion& region) {
+  const uint32_t width = field.width();
+  const uint32_t height = field.height();
+
+  std::vector<glm::vec3> ret;
+  ret.reserve(size_t(region.m_width) * region.m_height);
+  for (uint32_t y = region.m_y; y < region.m_y + region.m_height; ++y) {
+    const uint32_t up = y ? y - 1 : 0;
+    const uint32_t down = std::min(y + 1, height - 1);
+    for (uint32_t x = region.m_x; x < region.m_x + region.m_width; ++x) {
+      const uint32_t left = x ? x - 1 : 0;
+      const uint32_t right = std::min(x + 1, width - 1);
+
+      // The samples are 1 / width (or 1 / height) apart.
+      float dx = (field.at(right, y) - field.at(left, y)) * width /
+                 std::max(1u, right - left);
+      float dz = (field.at(x, down) - field.at(x, up)) * height /
+                 std::max(1u, down - up);
+      ret.push_back(glm::normalize(glm::vec3(-dx, 1.0f, -dz)));
+    }
+  }
 
   return ret;
 }
 
 DynTerrain::DynTerrain(std::unique_ptr<Program> a_program,
+                       std::unique_ptr<Program> a_programWithGeometryShader,
                        std::unique_ptr<Program> a_programForShadowMapping,
-                       sf::Image&& a_image,
+                       HeightField&& a_heightField,
                        GLuint a_cover,
                        GLuint a_heightmap,
-                       std::vector<glm::vec2> a_vertices)
+                       uint32_t a_resolution,
+                       const ShadowMapSettings& a_shadowMapSettings)
   : m_program(std::move(a_program))
+  , m_programWithGeometryShader(std::move(a_programWithGeometryShader))
   , m_programForShadowMap(std::move(a_programForShadowMapping))
   , m_coverTexture(a_cover)
   , m_heightmapTexture(a_heightmap)
-  , m_heightmap(std::move(a_image))
-  , m_vertices(std::move(a_vertices)) {
+  , m_lodResolution(a_resolution)
+  , m_heightField(std::move(a_heightField))
+  , m_pyramid(m_heightField)
+  , m_horizonShadows(false)
+  , m_lightAzimuth(0.0f)
+  , m_patchGrid(PatchGrid::get(PATCH_QUADS)) {
   AutoGLErrorChecker checker;
+
+  std::vector<glm::vec3> patches = makePatches(a_resolution);
+  m_patchCount = patches.size();
+
   glGenVertexArrays(1, &m_vao);
 
   glBindVertexArray(m_vao);
-  glGenBuffers(1, &m_vbo);
+  m_patchGrid->setupVertexArray(0);
 
-  glBindBuffer(GL_ARRAY_BUFFER, m_vbo);
-  glBufferData(GL_ARRAY_BUFFER, sizeof(glm::vec2) * m_vertices.size(),
-               m_vertices.data(), GL_STATIC_DRAW);
+  glGenBuffers(1, &m_patchesVBO);
+  glBindBuffer(GL_ARRAY_BUFFER, m_patchesVBO);
+  glBufferData(GL_ARRAY_BUFFER, sizeof(glm::vec3) * patches.size(),
+               patches.data(), GL_STATIC_DRAW);
 
-  glEnableVertexAttribArray(0);
-  glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, sizeof(glm::vec2), 0);
+  glEnableVertexAttribArray(1);
+  glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(glm::vec3), 0);
+  glVertexAttribDivisor(1, 1);
 
   glBindVertexArray(0);
 
-  glGenTextures(1, &m_cachedShadowMap);
-  glBindTexture(GL_TEXTURE_2D, m_cachedShadowMap);
+  glGenTextures(1, &m_lodBoundsTexture);
+  glBindTexture(GL_TEXTURE_2D, m_lodBoundsTexture);
   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-  glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT, SHADOW_WIDTH,
-               SHADOW_HEIGHT, 0, GL_DEPTH_COMPONENT, GL_FLOAT, nullptr);
-
-  glGenFramebuffers(1, &m_cachedShadowMapFBO);
-  glBindFramebuffer(GL_FRAMEBUFFER, m_cachedShadowMapFBO);
-  glReadBuffer(GL_NONE);
-  glDrawBuffer(GL_NONE);
-  glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D,
-                         m_cachedShadowMap, 0);
-  assert(glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, a_resolution + 1,
+               a_resolution + 1, 0, GL_RGBA, GL_FLOAT, nullptr);
+  m_lodQuadBounds.resize(a_resolution * a_resolution);
+  updateLodBounds(HeightFieldRegion(0, 0, a_resolution, a_resolution));
+
+  const HeightFieldRegion everything(0, 0, m_heightField.width(),
+                                     m_heightField.height());
+  std::vector<glm::vec3> normals = computeNormals(m_heightField, everything);
+  glGenTextures(1, &m_normalMapTexture);
+  glBindTexture(GL_TEXTURE_2D, m_normalMapTexture);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB16F, m_heightField.width(),
+               m_heightField.height(), 0, GL_RGB, GL_FLOAT, normals.data());
+
+  auto start = std::chrono::steady_clock::now();
+  m_horizonMap =
+      HorizonMap(m_heightField, HORIZON_DIRECTIONS, HORIZON_MAX_DISTANCE);
+  auto end = std::chrono::steady_clock::now();
+  LOG("Baked %u horizons per sample in %.2fms", HORIZON_DIRECTIONS,
+      std::chrono::duration<double, std::milli>(end - start).count());
+
+  // Which horizons we upload depends on the light, so this gets filled in
+  // recomputeShadowMap.
+  glGenTextures(1, &m_horizonTexture);
+  glBindTexture(GL_TEXTURE_2D, m_horizonTexture);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+  glTexImage2D(GL_TEXTURE_2D, 0, GL_R8, m_heightField.width(),
+               m_heightField.height(), 0, GL_RED, GL_UNSIGNED_BYTE, nullptr);
 
-  glBindTexture(GL_TEXTURE_2D, 0);
-  glBindFramebuffer(GL_FRAMEBUFFER, 0);
+  a_shadowMapSettings.createCache(m_cachedShadowMap, m_cachedShadowMapFBO);
 
   m_uniforms.query(*m_program);
+  m_uniformsWithGeometryShader.query(*m_programWithGeometryShader);
   m_uniformsForShadowMap.query(*m_programForShadowMap);
 }
 
@@ -121,46 +289,94 @@ GLuint DynTerrain::textureFromImage(const sf::Image& image, bool a_mipmaps) {
   return ret;
 }
 
-std::unique_ptr<DynTerrain> DynTerrain::create() {
+/* static */ HeightField DynTerrain::loadHeightField() {
+  HeightField ret =
+      HeightField::fromFile(HEIGHTMAP_16_BIT_PATH, HEIGHT_SCALE, HEIGHT_BIAS);
+  if (ret.empty())
+    ret = HeightField::fromFile(HEIGHTMAP_PATH, HEIGHT_SCALE, HEIGHT_BIAS);
+  return ret;
+}
+
+/* static */ GLuint DynTerrain::textureFromHeightField(
+    const HeightField& a_field) {
+  std::vector<uint16_t> texels(size_t(a_field.width()) * a_field.height());
+  for (size_t i = 0; i < texels.size(); ++i)
+    texels[i] = encodeHeight(a_field.data()[i]);
+
+  GLuint ret;
+
+  AutoGLErrorChecker checker;
+  glGenTextures(1, &ret);
+  glBindTexture(GL_TEXTURE_2D, ret);
+  glPixelStorei(GL_UNPACK_ALIGNMENT, 2);
+  glTexImage2D(GL_TEXTURE_2D, 0, GL_R16, a_field.width(), a_field.height(), 0,
+               GL_RED, GL_UNSIGNED_SHORT, texels.data());
+  glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+
+  // The shaders sample the edges of the heightmap, don't let them wrap
+  // around, like HeightField::sample() doesn't.
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+  glBindTexture(GL_TEXTURE_2D, 0);
+
+  return ret;
+}
+
+std::unique_ptr<DynTerrain> DynTerrain::create(
+    const ShadowMapSettings& a_shadowMapSettings) {
   ShaderSet shaders("res/dyn-terrain/common.glsl",
                     "res/dyn-terrain/vertex.glsl",
                     "res/dyn-terrain/fragment.glsl");
-  shaders.m_geometry = "res/dyn-terrain/geometry.glsl";
   shaders.m_tessellation_control = "res/dyn-terrain/tess-control.glsl";
   shaders.m_tessellation_evaluation = "res/dyn-terrain/tess-eval.glsl";
 
+  // The evaluation shader computes the normals itself, so there's no need for
+  // a geometry shader, which tends to be the slowest stage.
   auto program = Program::fromShaders(shaders);
   if (!program) {
     ERROR("Failed to create DynTerrain program");
     return nullptr;
   }
+
+  ShaderSet geometryShaders = shaders;
+  geometryShaders.m_raw_prefix = "#define NORMALS_IN_GEOMETRY_SHADER\n";
+  geometryShaders.m_geometry = "res/dyn-terrain/geometry.glsl";
+  auto programWithGeometryShader = Program::fromShaders(geometryShaders);
+  if (!programWithGeometryShader) {
+    ERROR("Failed to create DynTerrain program with a geometry shader");
+    return nullptr;
+  }
+
   shaders.m_raw_prefix = "#define FOR_SHADOW_MAP\n";
   auto shadowMapProgram = Program::fromShaders(shaders);
   if (!shadowMapProgram) {
     ERROR("Failed to create DynTerrain program for shadow mapping");
     return nullptr;
   }
-  sf::Image heightMapImporter;
-  sf::Image coverImporter;
-
-  if (!heightMapImporter.loadFromFile("res/terrain/heightmap.png")) {
-    // if (!heightMapImporter.loadFromFile("res/terrain/maribor.png")) {
+  HeightField heightField = loadHeightField();
+  if (heightField.empty()) {
     ERROR("Error loading heightmap");
     return nullptr;
   }
 
+  sf::Image coverImporter;
   if (!coverImporter.loadFromFile("res/terrain/cover.png")) {
     ERROR("Error loading cover");
     return nullptr;
   }
 
   GLuint cover = textureFromImage(coverImporter, true);
-  GLuint heightmap = textureFromImage(heightMapImporter, false);
+  GLuint heightmap = textureFromHeightField(heightField);
 
   auto ret = std::unique_ptr<DynTerrain>(
-      new DynTerrain(std::move(program), std::move(shadowMapProgram),
-                     std::move(heightMapImporter), cover, heightmap,
-                     makePlane(TERRAIN_DIMENSIONS, TERRAIN_DIMENSIONS)));
+      new DynTerrain(std::move(program), std::move(programWithGeometryShader),
+                     std::move(shadowMapProgram),
+                     std::move(heightField), cover, heightmap,
+                     TERRAIN_DIMENSIONS, a_shadowMapSettings));
 
   ret->scale(TERRAIN_DIMENSIONS);
   return ret;
@@ -169,11 +385,14 @@ std::unique_ptr<DynTerrain> DynTerrain::create() {
 DynTerrain::~DynTerrain() {
   glDeleteTextures(1, &m_coverTexture);
   glDeleteTextures(1, &m_heightmapTexture);
+  glDeleteTextures(1, &m_lodBoundsTexture);
+  glDeleteTextures(1, &m_normalMapTexture);
+  glDeleteTextures(1, &m_horizonTexture);
 
   glDeleteTextures(1, &m_cachedShadowMap);
   glDeleteFramebuffers(1, &m_cachedShadowMapFBO);
 
-  glDeleteBuffers(1, &m_vbo);
+  glDeleteBuffers(1, &m_patchesVBO);
   glDeleteVertexArrays(1, &m_vao);
 }
 
@@ -184,44 +403,233 @@ void DynTerrain::Uniforms::query(Program& program) {
     /* assert(u != -1); */                                                     \
   } while (0)
 
-  QUERY(uCameraPosition);
-  QUERY(uLightSourcePosition);
-  QUERY(uViewProjection);
-  QUERY(uShadowMapViewProjection);
   QUERY(uModel);
   QUERY(uCover);
   QUERY(uHeightMap);
+  QUERY(uNormalMap);
   QUERY(uShadowMap);
   QUERY(uDimension);
+  QUERY(uLodBounds);
+  QUERY(uLodScale);
+  QUERY(uFrustumPlanes);
+  QUERY(uHorizonMap);
+  QUERY(uHorizonShadows);
 }
 
 void DynTerrain::drawTerrain(const Scene& scene) const {
   drawTerrainInternal(scene, false);
 }
 
-void DynTerrain::drawTerrainInternal(const Scene& scene,
-                                     bool forShadowMap) const {
-  Program& program = forShadowMap ? *m_programForShadowMap : *m_program;
-  const Uniforms& uniforms = forShadowMap ? m_uniformsForShadowMap : m_uniforms;
+void DynTerrain::updateLodBounds(const HeightFieldRegion& a_quads) {
+  const uint32_t resolution = m_lodResolution;
+  for (uint32_t y = a_quads.m_y; y < a_quads.m_y + a_quads.m_height; ++y)
+    for (uint32_t x = a_quads.m_x; x < a_quads.m_x + a_quads.m_width; ++x)
+      m_lodQuadBounds[y * resolution + x] =
+          quadLodBounds(m_heightField, resolution, x, y);
+
+  // The vertices of the quads, which are one more on each side.
+  const HeightFieldRegion vertices(a_quads.m_x, a_quads.m_y,
+                                   a_quads.m_width + 1, a_quads.m_height + 1);
+  std::vector<glm::vec4> bounds;
+  bounds.reserve(size_t(vertices.m_width) * vertices.m_height);
+  for (uint32_t y = vertices.m_y; y < vertices.m_y + vertices.m_height; ++y)
+    for (uint32_t x = vertices.m_x; x < vertices.m_x + vertices.m_width; ++x)
+      bounds.push_back(vertexLodBounds(m_lodQuadBounds, resolution, x, y));
+
+  glBindTexture(GL_TEXTURE_2D, m_lodBoundsTexture);
+  glTexSubImage2D(GL_TEXTURE_2D, 0, vertices.m_x, vertices.m_y,
+                  vertices.m_width, vertices.m_height, GL_RGBA, GL_FLOAT,
+                  bounds.data());
+  glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+bool DynTerrain::modifyRegion(const Scene& scene,
+                              const glm::vec2& a_min,
+                              const glm::vec2& a_max,
+                              const HeightOp& a_op,
+                              AABB& a_changedBounds) {
+  AutoGLErrorChecker checker;
+
+  const float dimension = TERRAIN_DIMENSIONS;
+  const uint32_t width = m_heightField.width();
+  const uint32_t height = m_heightField.height();
+  const HeightFieldRegion region =
+      m_heightField.regionBetween(a_min / dimension, a_max / dimension);
+  if (region.empty())
+    return true;
+
+  // Remember the heights the surface had there too, since the shadow map
+  // needs to be updated both where it was and where it is now.
+  float minHeight = std::numeric_limits<float>::max();
+  float maxHeight = -std::numeric_limits<float>::max();
+
+  std::vector<uint16_t> texels;
+  texels.reserve(size_t(region.m_width) * region.m_height);
+  for (uint32_t y = region.m_y; y < region.m_y + region.m_height; ++y) {
+    for (uint32_t x = region.m_x; x < region.m_x + region.m_width; ++x) {
+      glm::vec2 position(float(x) / width, float(y) / height);
+      float before = m_heightField.at(x, y);
+      float after = a_op(position * dimension, before * dimension);
+
+      // Keep the heights we query in sync with the ones we draw, which only
+      // have 16 bits.
+      uint16_t encoded = encodeHeight(after / dimension);
+      after = decodeHeight(encoded);
+      m_heightField.set(x, y, after);
+
+      minHeight = std::min(minHeight, std::min(before, after));
+      maxHeight = std::max(maxHeight, std::max(before, after));
+      texels.push_back(encoded);
+    }
+  }
+
+  m_pyramid.update(region);
+  const HeightFieldRegion horizons = m_horizonMap.update(m_heightField, region);
+
+  glBindTexture(GL_TEXTURE_2D, m_heightmapTexture);
+  glPixelStorei(GL_UNPACK_ALIGNMENT, 2);
+  glTexSubImage2D(GL_TEXTURE_2D, 0, region.m_x, region.m_y, region.m_width,
+                  region.m_height, GL_RED, GL_UNSIGNED_SHORT, texels.data());
+  glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+
+  // The interpolated surface and the normals around the region depend on it
+  // too.
+  const HeightFieldRegion border = region.inflated(1, width, height);
+  std::vector<glm::vec3> normals = computeNormals(m_heightField, border);
+  glBindTexture(GL_TEXTURE_2D, m_normalMapTexture);
+  glTexSubImage2D(GL_TEXTURE_2D, 0, border.m_x, border.m_y, border.m_width,
+                  border.m_height, GL_RGB, GL_FLOAT, normals.data());
+  glBindTexture(GL_TEXTURE_2D, 0);
+
+  for (uint32_t y = border.m_y; y < border.m_y + border.m_height; ++y) {
+    for (uint32_t x = border.m_x; x < border.m_x + border.m_width; ++x) {
+      minHeight = std::min(minHeight, m_heightField.at(x, y));
+      maxHeight = std::max(maxHeight, m_heightField.at(x, y));
+    }
+  }
+
+  // The quads whose bounds may have changed: A quad looks at the samples
+  // between its corners, plus the next one for the interpolated corners.
+  const uint32_t resolution = m_lodResolution;
+  const uint32_t lastX = border.m_x + border.m_width - 1;
+  const uint32_t lastY = border.m_y + border.m_height - 1;
+  uint32_t quadX0 = border.m_x * resolution / width;
+  uint32_t quadY0 = border.m_y * resolution / height;
+  quadX0 = quadX0 ? quadX0 - 1 : 0;
+  quadY0 = quadY0 ? quadY0 - 1 : 0;
+  uint32_t quadX1 = std::min(resolution - 1, lastX * resolution / width);
+  uint32_t quadY1 = std::min(resolution - 1, lastY * resolution / height);
+  updateLodBounds(HeightFieldRegion(quadX0, quadY0, quadX1 - quadX0 + 1,
+                                    quadY1 - quadY0 + 1));
+
+  // Back to the terrain local space, where x and z go from -0.5 to 0.5.
+  glm::vec3 boxMin(float(border.m_x) / width - 0.5f, minHeight,
+                   float(border.m_y) / height - 0.5f);
+  glm::vec3 boxMax(float(lastX + 1) / width - 0.5f, maxHeight,
+                   float(lastY + 1) / height - 0.5f);
+  a_changedBounds = AABB(boxMin, boxMax).transformed(transform());
+
+  // The cached shadow map gets redrawn as a whole when switching back to it.
+  if (m_horizonShadows)
+    uploadHorizons(horizons);
+  else
+    redrawShadowMap(scene, boxMin, boxMax);
+  return true;
+}
+
+void DynTerrain::uploadHorizons(const HeightFieldRegion& a_region) {
+  std::vector<uint8_t> texels = m_horizonMap.slice(m_lightAzimuth, a_region);
+  glBindTexture(GL_TEXTURE_2D, m_horizonTexture);
+  glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+  glTexSubImage2D(GL_TEXTURE_2D, 0, a_region.m_x, a_region.m_y,
+                  a_region.m_width, a_region.m_height, GL_RED,
+                  GL_UNSIGNED_BYTE, texels.data());
+  glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+  glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+void DynTerrain::redrawShadowMap(const Scene& scene,
+                                 const glm::vec3& a_min,
+                                 const glm::vec3& a_max) {
+  // Find the rectangle the box covers in the shadow map, in normalized device
+  // coordinates first.
+  glm::mat4 transform = scene.shadowMapViewProjection() * this->transform();
+  glm::vec2 ndcMin(std::numeric_limits<float>::max());
+  glm::vec2 ndcMax(-std::numeric_limits<float>::max());
+  for (size_t i = 0; i < 8; ++i) {
+    glm::vec4 corner(i & 1 ? a_max.x : a_min.x, i & 2 ? a_max.y : a_min.y,
+                     i & 4 ? a_max.z : a_min.z, 1.0f);
+    glm::vec4 projected = transform * corner;
+    glm::vec2 ndc = glm::vec2(projected) / projected.w;
+    ndcMin = glm::min(ndcMin, ndc);
+    ndcMax = glm::max(ndcMax, ndc);
+  }
+  ndcMin = glm::max(ndcMin, glm::vec2(-1.0f));
+  ndcMax = glm::min(ndcMax, glm::vec2(1.0f));
+  if (ndcMin.x >= ndcMax.x || ndcMin.y >= ndcMax.y)
+    return;
+
+  // Then in whole tiles.
+  const GLint width = scene.shadowMapSettings().m_size;
+  const GLint height = width;
+  auto toTile = [&](float a_ndc, GLint a_size, bool a_end) {
+    float pixel = (a_ndc * 0.5f + 0.5f) * a_size / SHADOW_MAP_TILE;
+    return GLint(a_end ? std::ceil(pixel) : std::floor(pixel));
+  };
+  GLint x0 = toTile(ndcMin.x, width, false) * SHADOW_MAP_TILE;
+  GLint y0 = toTile(ndcMin.y, height, false) * SHADOW_MAP_TILE;
+  GLint x1 = std::min(width, toTile(ndcMax.x, width, true) * SHADOW_MAP_TILE);
+  GLint y1 =
+      std::min(height, toTile(ndcMax.y, height, true) * SHADOW_MAP_TILE);
+
+  // Only the patches under those tiles need to be drawn, so narrow the
+  // frustum the tessellation control shader culls against to them.
+  glm::vec2 tileMin(float(x0) / width * 2.0f - 1.0f,
+                    float(y0) / height * 2.0f - 1.0f);
+  glm::vec2 tileMax(float(x1) / width * 2.0f - 1.0f,
+                    float(y1) / height * 2.0f - 1.0f);
+  glm::mat4 crop(1.0f);
+  crop[0][0] = 2.0f / (tileMax.x - tileMin.x);
+  crop[1][1] = 2.0f / (tileMax.y - tileMin.y);
+  crop[3][0] = -(tileMax.x + tileMin.x) / (tileMax.x - tileMin.x);
+  crop[3][1] = -(tileMax.y + tileMin.y) / (tileMax.y - tileMin.y);
+
+  AutoShadowMapViewport viewport(scene.shadowMapSettings());
+  glBindFramebuffer(GL_FRAMEBUFFER, m_cachedShadowMapFBO);
+  glEnable(GL_SCISSOR_TEST);
+  glScissor(x0, y0, x1 - x0, y1 - y0);
+  glClear(GL_DEPTH_BUFFER_BIT);
+  drawTerrainInternal(scene, true,
+                      Some(crop * scene.shadowMapViewProjection()));
+  glDisable(GL_SCISSOR_TEST);
+  glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+void DynTerrain::drawTerrainInternal(
+    const Scene& scene,
+    bool forShadowMap,
+    const Optional<glm::mat4>& a_cullingViewProjection) const {
+  const bool withGeometryShader =
+      !forShadowMap && scene.terrainNormalsInGeometryShader();
+  Program& program =
+      forShadowMap ? *m_programForShadowMap
+                   : withGeometryShader ? *m_programWithGeometryShader
+                                        : *m_program;
+  const Uniforms& uniforms =
+      forShadowMap ? m_uniformsForShadowMap
+                   : withGeometryShader ? m_uniformsWithGeometryShader
+                                        : m_uniforms;
   glm::mat4 viewProjection =
       forShadowMap ? scene.shadowMapViewProjection() : scene.viewProjection();
-  const glm::vec3& cameraPos =
-      forShadowMap ? scene.lightSourcePosition() : scene.cameraPosition();
 
   program.use();
+  scene.uploadPassUniforms(viewProjection, forShadowMap);
 
   // TODO(emilio): Bring face culling back!
   // glDisable(GL_CULL_FACE);
   glCullFace(forShadowMap ? GL_FRONT : GL_BACK);
   glBindVertexArray(m_vao);
 
-  glUniform3fv(uniforms.uCameraPosition, 1, glm::value_ptr(cameraPos));
-  glUniform3fv(uniforms.uLightSourcePosition, 1,
-               glm::value_ptr(scene.lightSourcePosition()));
-  glUniformMatrix4fv(uniforms.uViewProjection, 1, GL_FALSE,
-                     glm::value_ptr(viewProjection));
-  glUniformMatrix4fv(uniforms.uShadowMapViewProjection, 1, GL_FALSE,
-                     glm::value_ptr(scene.shadowMapViewProjection()));
   glUniformMatrix4fv(uniforms.uModel, 1, GL_FALSE, glm::value_ptr(transform()));
 
   glActiveTexture(GL_TEXTURE0);
@@ -232,41 +640,86 @@ void DynTerrain::drawTerrainInternal(const Scene& scene,
 
   if (!forShadowMap && scene.shadowMap()) {
     glActiveTexture(GL_TEXTURE0 + 2);
-    glBindTexture(GL_TEXTURE_2D, *scene.shadowMap());
+    glBindTexture(GL_TEXTURE_2D_ARRAY, *scene.shadowMap());
   }
 
+  glActiveTexture(GL_TEXTURE0 + 3);
+  glBindTexture(GL_TEXTURE_2D, m_lodBoundsTexture);
+
+  glActiveTexture(GL_TEXTURE0 + 4);
+  glBindTexture(GL_TEXTURE_2D, m_normalMapTexture);
+
+  glActiveTexture(GL_TEXTURE0 + 5);
+  glBindTexture(GL_TEXTURE_2D, m_horizonTexture);
+
+  glUniform1f(uniforms.uLodScale,
+              scene.projectionScale() / scene.lodPixelError());
+
+  // The tessellation control shader discards the patches outside of this.
+  Frustum frustum =
+      Frustum::fromMatrix(a_cullingViewProjection ? *a_cullingViewProjection
+                                                  : viewProjection)
+          .inLocalSpace(transform());
+  glUniform4fv(uniforms.uFrustumPlanes, 6, glm::value_ptr(*frustum.planes()));
+
   // These should be constant.
   glUniform1i(uniforms.uCover, 0);
   glUniform1i(uniforms.uHeightMap, 1);
   glUniform1i(uniforms.uShadowMap, 2);
+  glUniform1i(uniforms.uLodBounds, 3);
+  glUniform1i(uniforms.uNormalMap, 4);
+  glUniform1i(uniforms.uHorizonMap, 5);
+  glUniform1i(uniforms.uHorizonShadows, m_horizonShadows);
   glUniform1f(uniforms.uDimension, TERRAIN_DIMENSIONS);
 
+  GLenum mode = GL_TRIANGLES;
   if (program.tessControlShader()) {
     glPatchParameteri(GL_PATCH_VERTICES, 3);
-    glDrawArrays(GL_PATCHES, 0, m_vertices.size());
-  } else {
-    glDrawArrays(GL_TRIANGLES, 0, m_vertices.size());
+    mode = GL_PATCHES;
   }
 
+  glDrawElementsInstanced(mode, m_patchGrid->indexCount(),
+                          m_patchGrid->indexType(),
+                          m_patchGrid->indexOffset(), m_patchCount);
+
   glBindVertexArray(0);
   glUseProgram(0);
   glEnable(GL_CULL_FACE);
 }
 
+AABB DynTerrain::worldBounds() const {
+  glm::vec2 heights = m_pyramid.heightRange();
+  return AABB(glm::vec3(-0.5f, heights.x, -0.5f),
+              glm::vec3(0.5f, heights.y, 0.5f))
+      .transformed(transform());
+}
+
 float DynTerrain::heightAt(float x, float y) const {
-  assert(x < TERRAIN_DIMENSIONS);
-  assert(y < TERRAIN_DIMENSIONS);
-  float x_ = x / TERRAIN_DIMENSIONS;
-  float y_ = y / TERRAIN_DIMENSIONS;
-  auto size = m_heightmap.getSize();
-
-  // This is kind of fiddly, because we're duplicating the stuff that is in the
-  // fragment shader, but oh well.
-  float v = m_heightmap.getPixel(x_ * size.x, y_ * size.y).g / 255.0f;
-  return (v - 0.5) / 3.0 * TERRAIN_DIMENSIONS;
+  return m_heightField.sample(x / TERRAIN_DIMENSIONS, y / TERRAIN_DIMENSIONS) *
+         TERRAIN_DIMENSIONS;
+}
+
+void DynTerrain::heightsAt(ArrayView<const glm::vec2> a_points,
+                           ArrayView<float> a_out) const {
+  m_heightField.sampleMany(a_points, a_out, 1.0f / TERRAIN_DIMENSIONS,
+                           TERRAIN_DIMENSIONS);
+}
+
+Optional<float> DynTerrain::raycast(const Ray& a_ray) const {
+  return m_pyramid.raycast(a_ray, 1.0f / TERRAIN_DIMENSIONS);
+}
+
+void DynTerrain::raycastMany(ArrayView<const Ray> a_rays,
+                             ArrayView<Optional<float>> a_out) const {
+  m_pyramid.raycastMany(a_rays, a_out, 1.0f / TERRAIN_DIMENSIONS);
 }
 
 Optional<GLuint> DynTerrain::shadowMapFBO() const {
+  // The terrain shadows itself with the horizons, so the shadow map is left
+  // for the objects, which don't get the shadows of the terrain then. That's
+  // why it's not the default, see Scene::terrainHorizonShadows.
+  if (m_horizonShadows)
+    return None;
   return Some(m_cachedShadowMapFBO);
 }
 
@@ -275,6 +728,20 @@ bool DynTerrain::wantsShadowMap() const {
 }
 
 void DynTerrain::recomputeShadowMap(const Scene& scene) {
+  m_horizonShadows = scene.terrainHorizonShadows();
+  if (m_horizonShadows) {
+    // The light is far enough to treat it as a directional one, and the
+    // terrain isn't rotated, so its local x and z axes are the ones of the
+    // heightfield.
+    glm::vec3 light = glm::vec3(glm::inverse(transform()) *
+                                glm::vec4(scene.lightSourcePosition(), 1.0f));
+    m_lightAzimuth = std::atan2(light.z, light.x);
+    uploadHorizons(HeightFieldRegion(0, 0, m_heightField.width(),
+                                     m_heightField.height()));
+    return;
+  }
+
+  AutoShadowMapViewport viewport(scene.shadowMapSettings());
   glBindFramebuffer(GL_FRAMEBUFFER, m_cachedShadowMapFBO);
   glClear(GL_DEPTH_BUFFER_BIT);
   drawTerrainInternal(scene, true);
@@ -1,13 +1,18 @@
 #pragma once
 
 #include "base/Program.h"
-#include "base/Program.h"
+#include "base/HeightField.h"
+#include "base/HeightFieldPyramid.h"
+#include "base/HorizonMap.h"
 #include "base/ITerrain.h"
+#include "base/ShadowMapSettings.h"
 #include "geometry/Node.h"
 #include <memory>
 #include <vector>
 #include <SFML/Graphics.hpp>
 
+class PatchGrid;
+
 /**
  * This is intended to be an alternative terrain representation using quads
  * instead of triangles, that will allow me to use fancy tessellation shaders
@@ -15,64 +20,136 @@
  */
 class DynTerrain final : public Node, public ITerrain {
   std::unique_ptr<Program> m_program;
+  // Computes the normals in a geometry shader, only kept around to compare
+  // it against m_program. See Scene::terrainNormalsInGeometryShader.
+  std::unique_ptr<Program> m_programWithGeometryShader;
   std::unique_ptr<Program> m_programForShadowMap;
 
   GLuint m_coverTexture;
 
-  // TODO: If we want to eventually do collision detection with this terrain we
-  // have to either keep the heightmap in memory, or similar.
   GLuint m_heightmapTexture;
 
-  sf::Image m_heightmap;
+  // The normals of the heightmap, in the terrain local space, so the
+  // evaluation shader doesn't need to compute them.
+  GLuint m_normalMapTexture;
+
+  // The error and height bounds of the terrain around each vertex of the
+  // patch grids, which the tessellation control shader uses to choose the
+  // tessellation level. See vertexLodBounds in DynTerrain.cpp.
+  GLuint m_lodBoundsTexture;
+
+  // The number of quads on each side of the terrain, and the bounds of each
+  // of them, from which the ones of the vertices are computed. We keep them
+  // around to update just the modified ones.
+  uint32_t m_lodResolution;
+  std::vector<glm::vec4> m_lodQuadBounds;
+
+  // The decoded heightmap, used for CPU-side height queries.
+  HeightField m_heightField;
+  HeightFieldPyramid m_pyramid;
+
+  // The horizons around every sample of the heightfield, and the ones towards
+  // the light, which is all the terrain needs to shadow itself. See
+  // Scene::terrainHorizonShadows.
+  HorizonMap m_horizonMap;
+  GLuint m_horizonTexture;
+  bool m_horizonShadows;
+  float m_lightAzimuth;
 
-  // A vector with the vertices divided in quads. Note that we calculate the
-  // height of the terrain dynamically in the vertex shader.
-  std::vector<glm::vec2> m_vertices;
+  // The grid every patch of the terrain is drawn with. Note that we calculate
+  // the height of the terrain dynamically in the shaders.
+  std::shared_ptr<PatchGrid> m_patchGrid;
+  size_t m_patchCount;
 
   struct Uniforms {
-    GLint uCameraPosition;
-    GLint uLightSourcePosition;
-    GLint uViewProjection;
-    GLint uShadowMapViewProjection;
     GLint uModel;
     GLint uCover;
     GLint uHeightMap;
+    GLint uNormalMap;
     GLint uDimension;
     GLint uShadowMap;
+    GLint uLodBounds;
+    GLint uLodScale;
+    GLint uFrustumPlanes;
+    GLint uHorizonMap;
+    GLint uHorizonShadows;
 
     void query(Program&);
   };
 
   Uniforms m_uniforms;
+  Uniforms m_uniformsWithGeometryShader;
   Uniforms m_uniformsForShadowMap;
 
   DynTerrain(std::unique_ptr<Program>,
              std::unique_ptr<Program>,
-             sf::Image&&,
+             std::unique_ptr<Program>,
+             HeightField&&,
              GLuint,
              GLuint,
-             std::vector<glm::vec2>);
+             uint32_t a_resolution,
+             const ShadowMapSettings&);
 
   GLuint m_vao;
-  // TODO: We could maybe optimize the memory representation of the quads using
-  // an ebo, but in practice it doesn't matter that much.
-  GLuint m_vbo;
+  // The per-instance offset and scale of each patch.
+  GLuint m_patchesVBO;
 
   GLuint m_cachedShadowMapFBO;
   GLuint m_cachedShadowMap;
 
+  // Recomputes the bounds of the given quads of the LOD grid, and uploads the
+  // ones of the vertices around them.
+  void updateLodBounds(const HeightFieldRegion& a_quads);
+
+  // Uploads the horizons of the given samples towards m_lightAzimuth.
+  void uploadHorizons(const HeightFieldRegion&);
+
+  // Redraws the tiles of the cached shadow map a box (in the terrain local
+  // space) can be drawn to.
+  void redrawShadowMap(const Scene&,
+                       const glm::vec3& a_min,
+                       const glm::vec3& a_max);
+
 public:
   virtual ~DynTerrain();
-  static std::unique_ptr<DynTerrain> create();
+  static std::unique_ptr<DynTerrain> create(const ShadowMapSettings&);
   static GLuint textureFromImage(const sf::Image& image, bool a_mipmaps);
 
+  /**
+   * Loads the terrain heightmap, from a 16-bit one if there's any, see
+   * getHeight in res/dyn-terrain/common.glsl for the units.
+   */
+  static HeightField loadHeightField();
+
+  /**
+   * Uploads a heightfield loaded with loadHeightField as a single-channel,
+   * 16-bit texture.
+   */
+  static GLuint textureFromHeightField(const HeightField&);
+
   virtual void drawTerrain(const Scene&) const override;
   virtual void recomputeShadowMap(const Scene&) override;
   virtual Optional<GLuint> shadowMapFBO() const override;
   virtual bool wantsShadowMap() const override;
+  virtual AABB worldBounds() const override;
   virtual float heightAt(float x, float y) const override;
+  virtual void heightsAt(ArrayView<const glm::vec2>,
+                         ArrayView<float>) const override;
+  virtual Optional<float> raycast(const Ray&) const override;
+  virtual void raycastMany(ArrayView<const Ray>,
+                           ArrayView<Optional<float>>) const override;
+  virtual bool modifyRegion(const Scene&,
+                            const glm::vec2& a_min,
+                            const glm::vec2& a_max,
+                            const HeightOp&,
+                            AABB& a_changedBounds) override;
 
-  void drawTerrainInternal(const Scene&, bool forShadowMap) const;
+  // a_cullingViewProjection allows to only draw the patches in a part of the
+  // frustum we're drawing to.
+  void drawTerrainInternal(
+      const Scene&,
+      bool forShadowMap,
+      const Optional<glm::mat4>& a_cullingViewProjection = None) const;
   void draw(DrawContext&) const override {
     assert(false && "not implemented! use drawTerrain instead!");
   }
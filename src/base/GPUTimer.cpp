@@ -0,0 +1,73 @@
+#include "base/GPUTimer.h"
+#include "base/Platform.h"
+
+#include <cassert>
+
+GPUTimer::GPUTimer()
+  : m_current(0)
+  , m_waitForGPU(false)
+  , m_totalNanoseconds(0)
+  , m_samples(0) {
+  // Waiting stalls the frame, so only do it when we're going to log the time.
+#ifdef DEBUG
+  m_waitForGPU = Platform::isSoftwareRenderer();
+#endif
+  glGenQueries(2, m_queries);
+  m_pending[0] = m_pending[1] = false;
+}
+
+GPUTimer::~GPUTimer() {
+  glDeleteQueries(2, m_queries);
+}
+
+void GPUTimer::collect(uint32_t a_index) {
+  if (!m_pending[a_index])
+    return;
+
+  // This was issued a frame ago, so it should be ready by now.
+  GLuint64 nanoseconds = 0;
+  glGetQueryObjectui64v(m_queries[a_index], GL_QUERY_RESULT, &nanoseconds);
+  m_pending[a_index] = false;
+
+  m_totalNanoseconds += nanoseconds;
+  m_samples++;
+}
+
+void GPUTimer::begin() {
+  if (m_waitForGPU) {
+    glFinish();
+    m_start = std::chrono::steady_clock::now();
+    return;
+  }
+
+  collect(m_current);
+  glBeginQuery(GL_TIME_ELAPSED, m_queries[m_current]);
+}
+
+void GPUTimer::end() {
+  if (m_waitForGPU) {
+    glFinish();
+    auto elapsed = std::chrono::steady_clock::now() - m_start;
+    m_totalNanoseconds +=
+        std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+    m_samples++;
+    return;
+  }
+
+  glEndQuery(GL_TIME_ELAPSED);
+  m_pending[m_current] = true;
+  m_current ^= 1;
+}
+
+Optional<double> GPUTimer::averageMilliseconds() const {
+  if (!m_samples)
+    return None;
+  return Some(double(m_totalNanoseconds) / m_samples / 1e6);
+}
+
+void GPUTimer::reset() {
+  // Results of queries issued before the reset don't count.
+  m_pending[0] = m_pending[1] = false;
+  m_totalNanoseconds = 0;
+  m_samples = 0;
+}
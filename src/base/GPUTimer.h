@@ -0,0 +1,58 @@
+#pragma once
+
+#include "base/gl.h"
+#include "tools/Optional.h"
+
+#include <chrono>
+#include <cstdint>
+
+/**
+ * Measures how long the GPU takes to run the commands issued between begin()
+ * and end(), using GL_TIME_ELAPSED queries.
+ *
+ * We keep two queries in flight and only read each one back when we're about
+ * to reuse it, a frame later, so measuring doesn't stall the pipeline.
+ *
+ * Software renderers don't do the work until they flush, so the queries read
+ * zero there. In debug builds we wait for them to finish and measure on the
+ * CPU instead.
+ */
+class GPUTimer final {
+  GLuint m_queries[2];
+  bool m_pending[2];
+  uint32_t m_current;
+
+  bool m_waitForGPU;
+  std::chrono::steady_clock::time_point m_start;
+
+  uint64_t m_totalNanoseconds;
+  uint32_t m_samples;
+
+  void collect(uint32_t a_index);
+
+public:
+  GPUTimer();
+  ~GPUTimer();
+
+  GPUTimer(const GPUTimer&) = delete;
+  GPUTimer& operator=(const GPUTimer&) = delete;
+
+  void begin();
+  void end();
+
+  uint32_t sampleCount() const {
+    return m_samples;
+  }
+
+  /**
+   * The average time of the measurements collected since the last reset(), if
+   * any.
+   */
+  Optional<double> averageMilliseconds() const;
+
+  /**
+   * Forgets the collected measurements, the ones still in flight are dropped
+   * too.
+   */
+  void reset();
+};
@@ -0,0 +1,211 @@
+#include "base/HeightField.h"
+
+#include "base/Logging.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <SFML/Graphics.hpp>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+static_assert(sizeof(glm::vec2) == 2 * sizeof(float),
+              "sampleMany reads points as packed floats");
+
+HeightField::HeightField(uint32_t a_width,
+                         uint32_t a_height,
+                         std::vector<float>&& a_heights)
+  : m_width(a_width), m_height(a_height), m_heights(std::move(a_heights)) {
+  assert(m_heights.size() == size_t(m_width) * m_height);
+  // We need at least a quad to interpolate.
+  assert(m_width > 1 && m_height > 1);
+}
+
+/* static */ HeightField HeightField::fromImage(const sf::Image& a_image,
+                                                float a_scale,
+                                                float a_bias) {
+  auto size = a_image.getSize();
+  const sf::Uint8* pixels = a_image.getPixelsPtr();
+
+  // SFML always gives us RGBA, we only care about the first channel.
+  std::vector<float> heights(size_t(size.x) * size.y);
+  const float factor = a_scale / 255.0f;
+  size_t i = 0;
+
+#if defined(__SSE2__)
+  // Four pixels at a time, the red channel is the low byte of each of them.
+  const __m128i redMask = _mm_set1_epi32(0xff);
+  const __m128 factorVector = _mm_set1_ps(factor);
+  const __m128 biasVector = _mm_set1_ps(a_bias);
+  for (; i + 4 <= heights.size(); i += 4) {
+    __m128i rgba =
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(pixels + i * 4));
+    __m128 red = _mm_cvtepi32_ps(_mm_and_si128(rgba, redMask));
+    _mm_storeu_ps(&heights[i],
+                  _mm_add_ps(_mm_mul_ps(red, factorVector), biasVector));
+  }
+#endif
+
+  for (; i < heights.size(); ++i)
+    heights[i] = pixels[i * 4] * factor + a_bias;
+
+  return HeightField(size.x, size.y, std::move(heights));
+}
+
+/* static */ HeightField HeightField::fromFile(const std::string& a_path,
+                                              float a_scale,
+                                              float a_bias) {
+  const std::string RAW_EXTENSION = ".r16";
+  const bool raw =
+      a_path.size() > RAW_EXTENSION.size() &&
+      a_path.compare(a_path.size() - RAW_EXTENSION.size(),
+                     RAW_EXTENSION.size(), RAW_EXTENSION) == 0;
+
+  if (!raw) {
+    sf::Image image;
+    if (!image.loadFromFile(a_path))
+      return HeightField();
+    return fromImage(image, a_scale, a_bias);
+  }
+
+  std::ifstream file(a_path, std::ios::binary | std::ios::ate);
+  if (!file)
+    return HeightField();
+
+  const size_t bytes = size_t(file.tellg());
+  const uint32_t side = uint32_t(std::sqrt(double(bytes / 2)));
+  if (bytes != size_t(side) * side * 2 || side < 2) {
+    ERROR("%s is not a square 16-bit heightmap", a_path.c_str());
+    return HeightField();
+  }
+
+  std::vector<uint8_t> data(bytes);
+  file.seekg(0);
+  if (!file.read(reinterpret_cast<char*>(data.data()), bytes))
+    return HeightField();
+
+  std::vector<float> heights(size_t(side) * side);
+  const float factor = a_scale / 65535.0f;
+  for (size_t i = 0; i < heights.size(); ++i) {
+    uint16_t value = data[i * 2] | (uint16_t(data[i * 2 + 1]) << 8);
+    heights[i] = value * factor + a_bias;
+  }
+
+  return HeightField(side, side, std::move(heights));
+}
+
+HeightFieldRegion HeightField::regionBetween(const glm::vec2& a_min,
+                                             const glm::vec2& a_max) const {
+  // Sample x is at u = x / width.
+  float left = std::max(0.0f, std::ceil(a_min.x * m_width));
+  float top = std::max(0.0f, std::ceil(a_min.y * m_height));
+  float right = std::min(float(m_width - 1), std::floor(a_max.x * m_width));
+  float bottom = std::min(float(m_height - 1), std::floor(a_max.y * m_height));
+  if (left > right || top > bottom)
+    return HeightFieldRegion();
+
+  return HeightFieldRegion(uint32_t(left), uint32_t(top),
+                           uint32_t(right - left) + 1,
+                           uint32_t(bottom - top) + 1);
+}
+
+float HeightField::sample(float u, float v) const {
+  float fx = glm::clamp(u * m_width, 0.0f, float(m_width - 1));
+  float fy = glm::clamp(v * m_height, 0.0f, float(m_height - 1));
+
+  // Clamp the top-left corner so the quad is always in bounds, at the far
+  // edges this just makes the interpolation factor 1.
+  uint32_t x = std::min(uint32_t(fx), m_width - 2);
+  uint32_t y = std::min(uint32_t(fy), m_height - 2);
+  float tx = fx - x;
+  float ty = fy - y;
+
+  const float* row = &m_heights[size_t(y) * m_width + x];
+  float top = row[0] + (row[1] - row[0]) * tx;
+  float bottom = row[m_width] + (row[m_width + 1] - row[m_width]) * tx;
+  return top + (bottom - top) * ty;
+}
+
+#if defined(__SSE2__)
+// SSE2 doesn't have _mm_min_epi32, that's SSE4.1.
+static inline __m128i minEpi32(__m128i a, __m128i b) {
+  __m128i greater = _mm_cmpgt_epi32(a, b);
+  return _mm_or_si128(_mm_and_si128(greater, b),
+                      _mm_andnot_si128(greater, a));
+}
+#endif
+
+void HeightField::sampleMany(ArrayView<const glm::vec2> a_points,
+                             ArrayView<float> a_out,
+                             float a_pointScale,
+                             float a_heightScale) const {
+  assert(a_out.size() >= a_points.size());
+
+  const size_t count = a_points.size();
+  size_t i = 0;
+
+#if defined(__SSE2__)
+  const float* points = reinterpret_cast<const float*>(a_points.data());
+  float* out = a_out.data();
+
+  const __m128 zero = _mm_setzero_ps();
+  const __m128 scaleX = _mm_set1_ps(a_pointScale * m_width);
+  const __m128 scaleY = _mm_set1_ps(a_pointScale * m_height);
+  const __m128 maxX = _mm_set1_ps(float(m_width - 1));
+  const __m128 maxY = _mm_set1_ps(float(m_height - 1));
+  const __m128i maxCornerX = _mm_set1_epi32(m_width - 2);
+  const __m128i maxCornerY = _mm_set1_epi32(m_height - 2);
+  const __m128 heightScale = _mm_set1_ps(a_heightScale);
+
+  alignas(16) int32_t xs[4];
+  alignas(16) int32_t ys[4];
+  alignas(16) float h00[4], h10[4], h01[4], h11[4];
+
+  for (; i + 4 <= count; i += 4) {
+    // Deinterleave four points: (x0 y0 x1 y1) (x2 y2 x3 y3).
+    __m128 a = _mm_loadu_ps(points + 2 * i);
+    __m128 b = _mm_loadu_ps(points + 2 * i + 4);
+    __m128 u = _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0));
+    __m128 v = _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1));
+
+    __m128 fx = _mm_min_ps(_mm_max_ps(_mm_mul_ps(u, scaleX), zero), maxX);
+    __m128 fy = _mm_min_ps(_mm_max_ps(_mm_mul_ps(v, scaleY), zero), maxY);
+
+    // The coordinates are non-negative, so truncating is flooring.
+    __m128i x = minEpi32(_mm_cvttps_epi32(fx), maxCornerX);
+    __m128i y = minEpi32(_mm_cvttps_epi32(fy), maxCornerY);
+
+    __m128 tx = _mm_sub_ps(fx, _mm_cvtepi32_ps(x));
+    __m128 ty = _mm_sub_ps(fy, _mm_cvtepi32_ps(y));
+
+    // There's no gather until AVX2, so fetch the corners by hand.
+    _mm_store_si128(reinterpret_cast<__m128i*>(xs), x);
+    _mm_store_si128(reinterpret_cast<__m128i*>(ys), y);
+    for (size_t j = 0; j < 4; ++j) {
+      const float* row = &m_heights[size_t(ys[j]) * m_width + xs[j]];
+      h00[j] = row[0];
+      h10[j] = row[1];
+      h01[j] = row[m_width];
+      h11[j] = row[m_width + 1];
+    }
+
+    __m128 top = _mm_load_ps(h00);
+    __m128 bottom = _mm_load_ps(h01);
+    top = _mm_add_ps(top, _mm_mul_ps(_mm_sub_ps(_mm_load_ps(h10), top), tx));
+    bottom =
+        _mm_add_ps(bottom, _mm_mul_ps(_mm_sub_ps(_mm_load_ps(h11), bottom), tx));
+    __m128 result = _mm_add_ps(top, _mm_mul_ps(_mm_sub_ps(bottom, top), ty));
+
+    _mm_storeu_ps(out + i, _mm_mul_ps(result, heightScale));
+  }
+#endif
+
+  for (; i < count; ++i) {
+    const glm::vec2& point = a_points[i];
+    a_out[i] = sample(point.x * a_pointScale, point.y * a_pointScale) *
+               a_heightScale;
+  }
+}
@@ -0,0 +1,145 @@
+#pragma once
+
+#include "glm/glm.hpp"
+#include "tools/ArrayView.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace sf {
+class Image;
+}
+
+/**
+ * A rectangle of samples of a HeightField, from (m_x, m_y) (inclusive) to
+ * (m_x + m_width, m_y + m_height) (exclusive).
+ */
+struct HeightFieldRegion {
+  uint32_t m_x;
+  uint32_t m_y;
+  uint32_t m_width;
+  uint32_t m_height;
+
+  HeightFieldRegion() : m_x(0), m_y(0), m_width(0), m_height(0) {}
+  HeightFieldRegion(uint32_t a_x,
+                    uint32_t a_y,
+                    uint32_t a_width,
+                    uint32_t a_height)
+    : m_x(a_x), m_y(a_y), m_width(a_width), m_height(a_height) {}
+
+  bool empty() const {
+    return !m_width || !m_height;
+  }
+
+  /**
+   * Returns this region grown by a_amount samples on every side, but still
+   * inside a field of the given size.
+   */
+  HeightFieldRegion inflated(uint32_t a_amount,
+                             uint32_t a_fieldWidth,
+                             uint32_t a_fieldHeight) const {
+    uint32_t x = m_x > a_amount ? m_x - a_amount : 0;
+    uint32_t y = m_y > a_amount ? m_y - a_amount : 0;
+    uint32_t right = std::min(a_fieldWidth, m_x + m_width + a_amount);
+    uint32_t bottom = std::min(a_fieldHeight, m_y + m_height + a_amount);
+    return HeightFieldRegion(x, y, right - x, bottom - y);
+  }
+};
+
+/**
+ * A decoded, row-major heightfield.
+ *
+ * The heights are stored already mapped to the terrain's local units, so
+ * queries don't need to know anything about how the source image was encoded.
+ *
+ * The sample at (x, y) corresponds to the pixel at column x, row y of the
+ * source image, and to the normalized coordinates (x / width, y / height),
+ * which is the same convention the terrain meshes use to place their vertices.
+ */
+class HeightField final {
+  uint32_t m_width;
+  uint32_t m_height;
+  std::vector<float> m_heights;
+
+public:
+  HeightField() : m_width(0), m_height(0) {}
+  HeightField(uint32_t a_width,
+              uint32_t a_height,
+              std::vector<float>&& a_heights);
+
+  /**
+   * Decodes the red channel of an image, mapping each byte `b` to
+   * `(b / 255) * a_scale + a_bias`.
+   */
+  static HeightField fromImage(const sf::Image&, float a_scale, float a_bias);
+
+  /**
+   * Loads a heightmap from a file, mapping each value `v` in [0, 1] to
+   * `v * a_scale + a_bias`.
+   *
+   * Files ending in ".r16" are raw, square, 16-bit little-endian heightmaps
+   * without any header, which keep their full precision. Anything else is
+   * loaded as an image with fromImage().
+   *
+   * Returns an empty field if the file couldn't be loaded.
+   */
+  static HeightField fromFile(const std::string& a_path,
+                              float a_scale,
+                              float a_bias);
+
+  uint32_t width() const {
+    return m_width;
+  }
+
+  uint32_t height() const {
+    return m_height;
+  }
+
+  bool empty() const {
+    return m_heights.empty();
+  }
+
+  const float* data() const {
+    return m_heights.data();
+  }
+
+  float at(uint32_t x, uint32_t y) const {
+    assert(x < m_width && y < m_height);
+    return m_heights[y * m_width + x];
+  }
+
+  void set(uint32_t x, uint32_t y, float a_height) {
+    assert(x < m_width && y < m_height);
+    m_heights[y * m_width + x] = a_height;
+  }
+
+  /**
+   * Returns the samples whose normalized coordinates are inside
+   * [a_min, a_max], which may be empty.
+   */
+  HeightFieldRegion regionBetween(const glm::vec2& a_min,
+                                  const glm::vec2& a_max) const;
+
+  /**
+   * Returns the bilinearly-filtered height at the normalized coordinates
+   * (u, v). Coordinates outside of [0, 1] are clamped to the edges.
+   */
+  float sample(float u, float v) const;
+
+  /**
+   * Batched version of sample().
+   *
+   * Each point is multiplied by a_pointScale before sampling, and each result
+   * by a_heightScale, so callers can query in world units without an extra
+   * pass over the data.
+   *
+   * a_out must be at least as long as a_points.
+   */
+  void sampleMany(ArrayView<const glm::vec2> a_points,
+                  ArrayView<float> a_out,
+                  float a_pointScale = 1.0f,
+                  float a_heightScale = 1.0f) const;
+};
@@ -0,0 +1,279 @@
+#include "base/HeightFieldPyramid.h"
+
+#include "base/HeightField.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <limits>
+
+HeightFieldPyramid::HeightFieldPyramid(const HeightField& a_field)
+  : m_field(&a_field) {
+  assert(!a_field.empty());
+
+  Level base;
+  base.m_width = a_field.width();
+  base.m_height = a_field.height();
+  m_levels.push_back(std::move(base));
+
+  while (m_levels.back().m_width > 1 || m_levels.back().m_height > 1) {
+    const Level& previous = m_levels.back();
+    Level level;
+    level.m_width = (previous.m_width + 1) / 2;
+    level.m_height = (previous.m_height + 1) / 2;
+    m_levels.push_back(std::move(level));
+  }
+
+  for (auto& level : m_levels) {
+    level.m_min.resize(size_t(level.m_width) * level.m_height);
+    level.m_max.resize(size_t(level.m_width) * level.m_height);
+  }
+
+  update(HeightFieldRegion(0, 0, a_field.width(), a_field.height()));
+}
+
+void HeightFieldPyramid::updateBase(uint32_t a_x0,
+                                    uint32_t a_y0,
+                                    uint32_t a_x1,
+                                    uint32_t a_y1) {
+  Level& base = m_levels[0];
+  const uint32_t width = base.m_width;
+  const uint32_t height = base.m_height;
+  for (uint32_t y = a_y0; y <= a_y1; ++y) {
+    const float* row = m_field->data() + size_t(y) * width;
+    const float* nextRow =
+        m_field->data() + size_t(std::min(y + 1, height - 1)) * width;
+    for (uint32_t x = a_x0; x <= a_x1; ++x) {
+      uint32_t nextX = std::min(x + 1, width - 1);
+      // A bilinear patch is always between its corners.
+      float a = row[x], b = row[nextX], c = nextRow[x], d = nextRow[nextX];
+      size_t index = size_t(y) * width + x;
+      base.m_min[index] = std::min(std::min(a, b), std::min(c, d));
+      base.m_max[index] = std::max(std::max(a, b), std::max(c, d));
+    }
+  }
+}
+
+void HeightFieldPyramid::updateLevel(size_t a_level,
+                                     uint32_t a_x0,
+                                     uint32_t a_y0,
+                                     uint32_t a_x1,
+                                     uint32_t a_y1) {
+  assert(a_level > 0);
+  const Level& previous = m_levels[a_level - 1];
+  Level& level = m_levels[a_level];
+
+  for (uint32_t y = a_y0; y <= a_y1; ++y) {
+    uint32_t y0 = y * 2;
+    uint32_t y1 = std::min(y0 + 1, previous.m_height - 1);
+    for (uint32_t x = a_x0; x <= a_x1; ++x) {
+      uint32_t x0 = x * 2;
+      uint32_t x1 = std::min(x0 + 1, previous.m_width - 1);
+      size_t children[4] = {
+          size_t(y0) * previous.m_width + x0,
+          size_t(y0) * previous.m_width + x1,
+          size_t(y1) * previous.m_width + x0,
+          size_t(y1) * previous.m_width + x1,
+      };
+
+      float min = previous.m_min[children[0]];
+      float max = previous.m_max[children[0]];
+      for (size_t child : children) {
+        min = std::min(min, previous.m_min[child]);
+        max = std::max(max, previous.m_max[child]);
+      }
+
+      size_t index = size_t(y) * level.m_width + x;
+      level.m_min[index] = min;
+      level.m_max[index] = max;
+    }
+  }
+}
+
+void HeightFieldPyramid::update(const HeightFieldRegion& a_region) {
+  assert(!empty());
+  if (a_region.empty())
+    return;
+
+  assert(a_region.m_x + a_region.m_width <= m_field->width());
+  assert(a_region.m_y + a_region.m_height <= m_field->height());
+
+  // The cells at the left and top of the region reach into it too.
+  uint32_t x0 = a_region.m_x ? a_region.m_x - 1 : 0;
+  uint32_t y0 = a_region.m_y ? a_region.m_y - 1 : 0;
+  uint32_t x1 = a_region.m_x + a_region.m_width - 1;
+  uint32_t y1 = a_region.m_y + a_region.m_height - 1;
+  updateBase(x0, y0, x1, y1);
+
+  for (size_t level = 1; level < m_levels.size(); ++level) {
+    x0 /= 2;
+    y0 /= 2;
+    x1 /= 2;
+    y1 /= 2;
+    updateLevel(level, x0, y0, x1, y1);
+  }
+}
+
+// The cell of a_count cells of a_cellSize a ray at a_position is in, breaking
+// ties towards where it's going, so it always leaves the cell through the far
+// side.
+static uint32_t cellIndex(float a_position,
+                          float a_direction,
+                          float a_cellSize,
+                          uint32_t a_count) {
+  float cell = a_position / a_cellSize;
+  float index = a_direction < 0.0f ? std::ceil(cell) - 1.0f : std::floor(cell);
+  return uint32_t(glm::clamp(index, 0.0f, float(a_count - 1)));
+}
+
+// The distance along a ray at which it leaves the given cell on one axis.
+static float exitDistance(float a_origin,
+                          float a_direction,
+                          uint32_t a_index,
+                          float a_cellSize) {
+  if (a_direction > 0.0f)
+    return ((a_index + 1) * a_cellSize - a_origin) / a_direction;
+  if (a_direction < 0.0f)
+    return (a_index * a_cellSize - a_origin) / a_direction;
+  return std::numeric_limits<float>::max();
+}
+
+// Takes the ray in sample units.
+bool HeightFieldPyramid::intersectCell(const Ray& a_ray,
+                                       uint32_t a_x,
+                                       uint32_t a_y,
+                                       float a_near,
+                                       float a_far,
+                                       float& a_hit) const {
+  const uint32_t width = m_field->width();
+  const uint32_t height = m_field->height();
+  uint32_t nextX = std::min(a_x + 1, width - 1);
+  uint32_t nextY = std::min(a_y + 1, height - 1);
+
+  // The surface is h00 + b * x + c * y + d * x * y in the cell.
+  float h00 = m_field->at(a_x, a_y);
+  float b = m_field->at(nextX, a_y) - h00;
+  float c = m_field->at(a_x, nextY) - h00;
+  float d = m_field->at(nextX, nextY) - h00 - b - c;
+
+  // Parameterize from a_near, so everything is relative to the cell and we
+  // don't lose precision with far-away origins.
+  glm::vec3 start = a_ray.at(a_near);
+  const glm::vec3& direction = a_ray.m_direction;
+  float x = start.x - a_x;
+  float y = start.z - a_y;
+
+  // The height of the ray over the surface, as k2 * s^2 + k1 * s + k0.
+  float k0 = start.y - (h00 + b * x + c * y + d * x * y);
+  if (k0 <= 0.0f) {
+    a_hit = a_near;
+    return true;
+  }
+
+  float k1 = direction.y - b * direction.x - c * direction.z -
+             d * (x * direction.z + y * direction.x);
+  float k2 = -d * direction.x * direction.z;
+
+  float discriminant = k1 * k1 - 4.0f * k2 * k0;
+  if (discriminant < 0.0f)
+    return false;
+
+  // See Numerical Recipes 5.6 for why the roots are computed like this.
+  float q = -0.5f * (k1 + std::copysign(std::sqrt(discriminant), k1));
+  if (q == 0.0f)
+    return false;
+
+  float length = a_far - a_near;
+  float first = std::numeric_limits<float>::max();
+  float roots[2] = {k0 / q, k2 != 0.0f ? q / k2 : -1.0f};
+  for (float root : roots)
+    if (root >= 0.0f && root <= length)
+      first = std::min(first, root);
+
+  if (first > length)
+    return false;
+
+  a_hit = a_near + first;
+  return true;
+}
+
+Optional<float> HeightFieldPyramid::raycast(const Ray& a_ray,
+                                            float a_rayScale) const {
+  assert(!empty());
+
+  // Work in sample units, which doesn't change distances along the ray.
+  const glm::vec3 scale(m_field->width() * a_rayScale, a_rayScale,
+                        m_field->height() * a_rayScale);
+  const Ray ray(a_ray.m_origin * scale, a_ray.m_direction * scale,
+                a_ray.m_maxDistance);
+
+  // Everything under the surface is solid, so there's no bottom to the box.
+  const Level& top = m_levels.back();
+  AABB bounds(glm::vec3(0.0f, -std::numeric_limits<float>::max(), 0.0f),
+              glm::vec3(m_field->width(), top.m_max[0], m_field->height()));
+
+  float distance = 0.0f;
+  float end = ray.m_maxDistance;
+  if (!ray.clip(bounds, distance, end))
+    return None;
+
+  size_t level = m_levels.size() - 1;
+  while (distance <= end) {
+    const Level& current = m_levels[level];
+    const float cellSize = float(1u << level);
+
+    glm::vec3 position = ray.at(distance);
+    uint32_t x =
+        cellIndex(position.x, ray.m_direction.x, cellSize, current.m_width);
+    uint32_t y =
+        cellIndex(position.z, ray.m_direction.z, cellSize, current.m_height);
+    size_t index = size_t(y) * current.m_width + x;
+
+    // The surface is over the ray already.
+    if (position.y <= current.m_min[index])
+      return Some(distance);
+
+    float exitX =
+        exitDistance(ray.m_origin.x, ray.m_direction.x, x, cellSize);
+    float exitY =
+        exitDistance(ray.m_origin.z, ray.m_direction.z, y, cellSize);
+    float exit = std::min(end, std::min(exitX, exitY));
+    // Rounding can put the exit right where we are, make sure we move.
+    if (exit <= distance)
+      exit = std::nextafter(distance, std::numeric_limits<float>::max());
+
+    float exitHeight = ray.m_origin.y + ray.m_direction.y * exit;
+    if (std::min(position.y, exitHeight) > current.m_max[index]) {
+      // The ray goes over the whole cell. If it's leaving the parent cell too,
+      // try a bigger step for the next one.
+      bool alongX = exitX < exitY;
+      uint32_t cell = alongX ? x : y;
+      bool forward = (alongX ? ray.m_direction.x : ray.m_direction.z) > 0.0f;
+      bool leavesParent = forward ? (cell & 1) : !(cell & 1);
+      distance = exit;
+      if (leavesParent && level + 1 < m_levels.size())
+        ++level;
+      continue;
+    }
+
+    if (level > 0) {
+      --level;
+      continue;
+    }
+
+    float hit;
+    if (intersectCell(ray, x, y, distance, std::min(exit, end), hit))
+      return Some(hit);
+    distance = exit;
+  }
+
+  return None;
+}
+
+void HeightFieldPyramid::raycastMany(ArrayView<const Ray> a_rays,
+                                     ArrayView<Optional<float>> a_out,
+                                     float a_rayScale) const {
+  assert(a_out.size() >= a_rays.size());
+  for (size_t i = 0; i < a_rays.size(); ++i)
+    a_out[i] = raycast(a_rays[i], a_rayScale);
+}
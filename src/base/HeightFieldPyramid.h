@@ -0,0 +1,98 @@
+#pragma once
+
+#include "geometry/Ray.h"
+#include "tools/ArrayView.h"
+#include "tools/Optional.h"
+
+#include <cassert>
+#include <cstdint>
+#include <vector>
+
+class HeightField;
+struct HeightFieldRegion;
+
+/**
+ * A min/max mip pyramid over a HeightField, to intersect rays with it.
+ *
+ * Level 0 has a cell per sample of the field, with the bounds of the bilinear
+ * patch that goes from that sample to the next ones (clamped at the far edges,
+ * like HeightField::sample() does), and every level above halves the
+ * resolution of the previous one.
+ *
+ * Rays walk down from the top level, skipping whole cells they pass over, so
+ * only the level 0 cells close to the surface get intersected exactly.
+ *
+ * The field must outlive the pyramid.
+ */
+class HeightFieldPyramid final {
+  struct Level {
+    uint32_t m_width;
+    uint32_t m_height;
+    std::vector<float> m_min;
+    std::vector<float> m_max;
+  };
+
+  const HeightField* m_field;
+  std::vector<Level> m_levels;
+
+  // Recompute the bounds of the cells in [a_x0, a_x1] x [a_y0, a_y1] of the
+  // given level, from the field or the level below.
+  void updateBase(uint32_t a_x0, uint32_t a_y0, uint32_t a_x1, uint32_t a_y1);
+  void updateLevel(size_t a_level,
+                   uint32_t a_x0,
+                   uint32_t a_y0,
+                   uint32_t a_x1,
+                   uint32_t a_y1);
+
+  bool intersectCell(const Ray& a_ray,
+                     uint32_t a_x,
+                     uint32_t a_y,
+                     float a_near,
+                     float a_far,
+                     float& a_hit) const;
+
+public:
+  HeightFieldPyramid() : m_field(nullptr) {}
+  explicit HeightFieldPyramid(const HeightField&);
+
+  bool empty() const {
+    return m_levels.empty();
+  }
+
+  size_t levelCount() const {
+    return m_levels.size();
+  }
+
+  /**
+   * The lowest and highest heights of the whole field, as (min, max).
+   */
+  glm::vec2 heightRange() const {
+    assert(!empty());
+    return glm::vec2(m_levels.back().m_min[0], m_levels.back().m_max[0]);
+  }
+
+  /**
+   * Updates the cells that depend on the given samples of the field, after
+   * they've changed. This is proportional to the size of the region, plus
+   * the height of the pyramid.
+   */
+  void update(const HeightFieldRegion&);
+
+  /**
+   * Returns the distance along the ray to the first point under the surface,
+   * or None if there's none before a_ray.m_maxDistance.
+   *
+   * The ray is in the normalized coordinates of HeightField::sample(), with
+   * (u, height, v) as (x, y, z), after being scaled by a_rayScale. Rays
+   * starting under the surface hit at distance zero, and the surface ends at
+   * the borders of the field, where there's a wall down from the edge.
+   */
+  Optional<float> raycast(const Ray& a_ray, float a_rayScale = 1.0f) const;
+
+  /**
+   * Batched version of raycast(), a_out must be at least as long as a_rays.
+   */
+  void raycastMany(ArrayView<const Ray> a_rays,
+                   ArrayView<Optional<float>> a_out,
+                   float a_rayScale = 1.0f) const;
+};
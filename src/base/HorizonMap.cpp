@@ -0,0 +1,147 @@
+#include "base/HorizonMap.h"
+
+#include "base/HeightField.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <thread>
+
+const float TWO_PI = 6.28318530718f;
+
+// Rays take steps of a sample close to where they start, and then of this
+// fraction of the distance they've gone, since the further a sample is, the
+// less it can change the elevation of the horizon.
+const float STEP_GROWTH = 0.125f;
+
+static uint8_t encodeHorizon(float a_sine) {
+  return uint8_t(std::round(glm::clamp(a_sine, 0.0f, 1.0f) * 255.0f));
+}
+
+HorizonMap::HorizonMap(const HeightField& a_field,
+                       uint32_t a_directions,
+                       uint32_t a_maxDistance)
+  : m_width(a_field.width())
+  , m_height(a_field.height())
+  , m_directions(a_directions)
+  , m_maxDistance(a_maxDistance) {
+  assert(!a_field.empty());
+  assert(a_directions > 0);
+  m_horizons.resize(size_t(m_width) * m_height * m_directions);
+  bake(a_field, HeightFieldRegion(0, 0, m_width, m_height));
+}
+
+void HorizonMap::bake(const HeightField& a_field,
+                      const HeightFieldRegion& a_region) {
+  assert(a_field.width() == m_width && a_field.height() == m_height);
+
+  // Nothing rises over the highest sample, which lets rays stop as soon as
+  // it couldn't raise the horizon anymore.
+  const float* heights = a_field.data();
+  const float highest =
+      *std::max_element(heights, heights + size_t(m_width) * m_height);
+
+  // We march in the normalized coordinates of HeightField::sample(), which
+  // have the same proportions as the terrain local space, and so do the
+  // heights.
+  const float sampleSize = 1.0f / std::max(m_width, m_height);
+  const float maxDistance = m_maxDistance * sampleSize;
+
+  std::vector<glm::vec2> directions;
+  directions.reserve(m_directions);
+  for (uint32_t i = 0; i < m_directions; ++i) {
+    float angle = TWO_PI * i / m_directions;
+    directions.push_back(glm::vec2(std::cos(angle), std::sin(angle)));
+  }
+
+  // Every sample only writes its own horizons, so bands of rows can be baked
+  // in parallel without any synchronization.
+  auto bakeRows = [&](uint32_t a_firstY, uint32_t a_lastY) {
+    for (uint32_t y = a_firstY; y < a_lastY; ++y) {
+      for (uint32_t x = a_region.m_x; x < a_region.m_x + a_region.m_width;
+           ++x) {
+        const glm::vec2 origin(float(x) / m_width, float(y) / m_height);
+        const float base = a_field.at(x, y);
+        uint8_t* horizons =
+            &m_horizons[(size_t(y) * m_width + x) * m_directions];
+
+        for (uint32_t i = 0; i < m_directions; ++i) {
+          // The tangent of the elevation, which is enough to compare them.
+          float best = 0.0f;
+          float distance = sampleSize;
+          while (distance <= maxDistance && highest - base > best * distance) {
+            glm::vec2 position = origin + directions[i] * distance;
+            if (position.x < 0.0f || position.x > 1.0f || position.y < 0.0f ||
+                position.y > 1.0f)
+              break;
+            float rise = a_field.sample(position.x, position.y) - base;
+            best = std::max(best, rise / distance);
+            distance += std::max(sampleSize, distance * STEP_GROWTH);
+          }
+          horizons[i] = encodeHorizon(best / std::sqrt(1.0f + best * best));
+        }
+      }
+    }
+  };
+
+  const uint32_t firstY = a_region.m_y;
+  const uint32_t rows = a_region.m_height;
+  const uint32_t threadCount =
+      std::max(1u, std::min(std::thread::hardware_concurrency(), rows));
+  std::vector<std::thread> workers;
+  for (uint32_t i = 1; i < threadCount; ++i)
+    workers.emplace_back(bakeRows, firstY + rows * i / threadCount,
+                         firstY + rows * (i + 1) / threadCount);
+  bakeRows(firstY, firstY + rows / threadCount);
+  for (auto& worker : workers)
+    worker.join();
+}
+
+float HorizonMap::horizonAt(uint32_t x,
+                            uint32_t y,
+                            uint32_t a_direction) const {
+  assert(x < m_width && y < m_height && a_direction < m_directions);
+  size_t index = (size_t(y) * m_width + x) * m_directions + a_direction;
+  return m_horizons[index] / 255.0f;
+}
+
+HeightFieldRegion HorizonMap::update(const HeightField& a_field,
+                                     const HeightFieldRegion& a_changed) {
+  assert(!empty());
+  if (a_changed.empty())
+    return a_changed;
+
+  // Rays from up to m_maxDistance samples away can see the changed ones, or
+  // interpolate between them and the next one.
+  HeightFieldRegion affected =
+      a_changed.inflated(m_maxDistance + 1, m_width, m_height);
+  bake(a_field, affected);
+  return affected;
+}
+
+std::vector<uint8_t> HorizonMap::slice(
+    float a_azimuth,
+    const HeightFieldRegion& a_region) const {
+  assert(!empty());
+  assert(a_region.m_x + a_region.m_width <= m_width);
+  assert(a_region.m_y + a_region.m_height <= m_height);
+
+  float position = a_azimuth / TWO_PI;
+  position = (position - std::floor(position)) * m_directions;
+  const uint32_t first = uint32_t(position) % m_directions;
+  const uint32_t second = (first + 1) % m_directions;
+  const float weight = position - std::floor(position);
+
+  std::vector<uint8_t> ret;
+  ret.reserve(size_t(a_region.m_width) * a_region.m_height);
+  for (uint32_t y = a_region.m_y; y < a_region.m_y + a_region.m_height; ++y) {
+    for (uint32_t x = a_region.m_x; x < a_region.m_x + a_region.m_width; ++x) {
+      const uint8_t* horizons =
+          &m_horizons[(size_t(y) * m_width + x) * m_directions];
+      float value =
+          horizons[first] * (1.0f - weight) + horizons[second] * weight;
+      ret.push_back(uint8_t(std::round(value)));
+    }
+  }
+  return ret;
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+class HeightField;
+struct HeightFieldRegion;
+
+/**
+ * The elevation of the horizon seen from each sample of a HeightField, in a
+ * fixed number of azimuth directions, for shadowing the terrain without
+ * rendering it from the light.
+ *
+ * Direction i points at an angle of 2 * pi * i / directionCount() from the x
+ * axis of the field towards its y axis (the z axis of the terrain local
+ * space), and the horizon is stored as the sine of its elevation, clamped to
+ * [0, 1] and quantized to a byte.
+ *
+ * Rays only look a_maxDistance samples away, so changing a region of the field
+ * only changes the horizons around it, see update().
+ */
+class HorizonMap final {
+  uint32_t m_width;
+  uint32_t m_height;
+  uint32_t m_directions;
+  uint32_t m_maxDistance;
+  // m_directions values per sample, row-major.
+  std::vector<uint8_t> m_horizons;
+
+  void bake(const HeightField&, const HeightFieldRegion&);
+
+public:
+  HorizonMap() : m_width(0), m_height(0), m_directions(0), m_maxDistance(0) {}
+
+  /**
+   * Bakes the horizons of the whole field, using as many threads as there
+   * are cores.
+   */
+  HorizonMap(const HeightField&, uint32_t a_directions, uint32_t a_maxDistance);
+
+  bool empty() const {
+    return m_horizons.empty();
+  }
+
+  uint32_t width() const {
+    return m_width;
+  }
+
+  uint32_t height() const {
+    return m_height;
+  }
+
+  uint32_t directionCount() const {
+    return m_directions;
+  }
+
+  /**
+   * The sine of the elevation of the horizon from the sample (x, y) in the
+   * given direction.
+   */
+  float horizonAt(uint32_t x, uint32_t y, uint32_t a_direction) const;
+
+  /**
+   * Rebakes the horizons that depend on the given samples of the field, after
+   * they've changed, and returns the samples whose horizons were rebaked.
+   */
+  HeightFieldRegion update(const HeightField&, const HeightFieldRegion&);
+
+  /**
+   * Returns the horizons of the samples in the region towards an arbitrary
+   * azimuth, in radians, interpolated between the two closest directions and
+   * encoded like the baked ones, row-major.
+   */
+  std::vector<uint8_t> slice(float a_azimuth, const HeightFieldRegion&) const;
+};
@@ -1,8 +1,15 @@
 #pragma once
 
+#include "geometry/Ray.h"
 #include "glm/glm.hpp"
+#include "tools/ArrayView.h"
 #include "tools/Optional.h"
 
+#include <algorithm>
+#include <cassert>
+#include <functional>
+#include <limits>
+
 class Scene;
 
 // Can't believe I'm doing this.
@@ -12,6 +19,69 @@ public:
   virtual void drawTerrain(const Scene&) const = 0;
   virtual void recomputeShadowMap(const Scene&){};
   virtual float heightAt(float x, float y) const = 0;
+
+  /**
+   * Batched version of heightAt(), a_out must be at least as long as
+   * a_points.
+   *
+   * Terrains that keep a decoded heightfield around should override this with
+   * something faster than a virtual call per point.
+   */
+  virtual void heightsAt(ArrayView<const glm::vec2> a_points,
+                         ArrayView<float> a_out) const {
+    assert(a_out.size() >= a_points.size());
+    for (size_t i = 0; i < a_points.size(); ++i)
+      a_out[i] = heightAt(a_points[i].x, a_points[i].y);
+  }
+
+  /**
+   * Intersects a ray with the terrain, in the coordinates heightAt() takes,
+   * with the height along the y axis.
+   *
+   * Returns the distance along the ray to the first point under the surface,
+   * or None if there's none before the maximum distance of the ray.
+   */
+  virtual Optional<float> raycast(const Ray&) const = 0;
+
+  /**
+   * Batched version of raycast(), a_out must be at least as long as a_rays.
+   */
+  virtual void raycastMany(ArrayView<const Ray> a_rays,
+                           ArrayView<Optional<float>> a_out) const {
+    assert(a_out.size() >= a_rays.size());
+    for (size_t i = 0; i < a_rays.size(); ++i)
+      a_out[i] = raycast(a_rays[i]);
+  }
+
+  /**
+   * Returns the new height of the terrain at a position, given the current
+   * one, both in the units heightAt() uses.
+   */
+  using HeightOp = std::function<float(const glm::vec2&, float)>;
+
+  /**
+   * Changes the heights of the terrain in the rectangle between the two given
+   * corners, in the coordinates heightAt() takes, by calling the HeightOp on
+   * every sample of the terrain in there.
+   *
+   * Only what depends on those samples gets updated, including the GPU copies
+   * and the cached shadow map, so this costs about the same no matter how big
+   * the terrain is. Like drawing, it needs the GL context.
+   *
+   * a_changedBounds gets the box, in world space, around the surface that
+   * changed, both before and after the change, so the scene can update its
+   * own shadow caches just there.
+   *
+   * Returns false if the terrain can't be modified.
+   */
+  virtual bool modifyRegion(const Scene&,
+                            const glm::vec2&,
+                            const glm::vec2&,
+                            const HeightOp&,
+                            AABB& /* a_changedBounds */) {
+    return false;
+  }
+
   /**
    * The contract with this function is that the FBO is immutable and only used
    * for reading.
@@ -27,5 +97,70 @@ public:
     return false;
   };
 
+  /**
+   * The box the terrain is in, in world space, which the shadow maps are
+   * fitted to. An empty box means it's unknown, and then they cover as much as
+   * they can.
+   */
+  virtual AABB worldBounds() const {
+    return AABB();
+  }
+
   virtual ~ITerrain() {}
+
+protected:
+  /**
+   * A raycast() for terrains without anything better: samples heightAt()
+   * every a_step units over [0, a_extent.x] x [0, a_extent.y], then bisects
+   * the first step that goes under the surface.
+   */
+  Optional<float> marchRay(const Ray& a_ray,
+                           const glm::vec2& a_extent,
+                           float a_step) const {
+    AABB bounds(glm::vec3(0.0f, -std::numeric_limits<float>::max(), 0.0f),
+                glm::vec3(a_extent.x, std::numeric_limits<float>::max(),
+                          a_extent.y));
+    float distance = 0.0f;
+    float end = a_ray.m_maxDistance;
+    if (!a_ray.clip(bounds, distance, end))
+      return None;
+
+    auto heightOverSurface = [&](float a_distance) {
+      glm::vec3 position = a_ray.at(a_distance);
+      return position.y - heightAt(position.x, position.z);
+    };
+
+    if (heightOverSurface(distance) <= 0.0f)
+      return Some(distance);
+
+    glm::vec2 horizontal(a_ray.m_direction.x, a_ray.m_direction.z);
+    float horizontalLength = glm::length(horizontal);
+    if (horizontalLength * (end - distance) <= a_step) {
+      // The ray stays within a step, so just go straight down (or up).
+      if (a_ray.m_direction.y >= 0.0f)
+        return None;
+      float hit = distance + heightOverSurface(distance) / -a_ray.m_direction.y;
+      if (hit > end)
+        return None;
+      return Some(hit);
+    }
+
+    float stepDistance = a_step / horizontalLength;
+    while (distance < end) {
+      float next = std::min(end, distance + stepDistance);
+      if (heightOverSurface(next) <= 0.0f) {
+        for (int i = 0; i < 16; ++i) {
+          float middle = (distance + next) * 0.5f;
+          if (heightOverSurface(middle) <= 0.0f)
+            next = middle;
+          else
+            distance = middle;
+        }
+        return Some(next);
+      }
+      distance = next;
+    }
+
+    return None;
+  }
 };
@@ -14,13 +14,25 @@ void InputUtils::handleText(Scene& a_scene,
       a_scene.toggleWireframeMode();
       return;
     case 'j':
-      a_scene.modifyTessLevel(1);
+      if (a_scene.dynamicTessellationEnabled())
+        a_scene.scaleLodPixelError(0.5f);
+      else
+        a_scene.modifyTessLevel(1);
       return;
     case 'k':
-      a_scene.modifyTessLevel(-1);
+      if (a_scene.dynamicTessellationEnabled())
+        a_scene.scaleLodPixelError(2.0f);
+      else
+        a_scene.modifyTessLevel(-1);
       return;
     case 'p':
       a_scene.toggleDynamicTessellation();
       return;
+    case 'g':
+      a_scene.toggleTerrainNormalsInGeometryShader();
+      return;
+    case 'h':
+      a_scene.toggleTerrainHorizonShadows();
+      return;
   }
 }
@@ -1,6 +1,7 @@
 #include "base/Platform.h"
 #include "base/gl.h"
 
+#include <cstring>
 #include <string>
 
 // FIXME: Detect if SFML will use EGL or not, if it will this is useless.
@@ -27,6 +28,21 @@ int Platform::getGLVersion() {
 
   return sVersion;
 }
+
+bool Platform::isSoftwareRenderer() {
+  static int sSoftware = -1;
+
+  if (sSoftware == -1) {
+    const char* renderer =
+        reinterpret_cast<const char*>(glGetString(GL_RENDERER));
+    sSoftware = renderer && (strstr(renderer, "llvmpipe") ||
+                             strstr(renderer, "softpipe") ||
+                             strstr(renderer, "SwiftShader"));
+  }
+
+  return sSoftware;
+}
+
 const std::string& Platform::getGLSLVersionAsString() {
   static std::string* sGLSLVersion = nullptr;
 
@@ -18,4 +18,12 @@ public:
    */
   static const std::string& getGLSLVersionAsString();
   static int getGLVersion();
+
+  /**
+   * Whether the GL implementation renders on the CPU, like Mesa's llvmpipe.
+   *
+   * Those defer the rasterization until they flush, so timer queries don't
+   * measure it.
+   */
+  static bool isSoftwareRenderer();
 };
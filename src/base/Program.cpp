@@ -195,6 +195,10 @@ static bool createShaderOfKind(ShaderKind a_kind,
     return nullptr;
   }
 
+  GLuint frameUniforms = glGetUniformBlockIndex(id, FRAME_UNIFORMS_BLOCK);
+  if (frameUniforms != GL_INVALID_INDEX)
+    glUniformBlockBinding(id, frameUniforms, FRAME_UNIFORMS_BINDING);
+
   // NB: Not using make_unique because constructor is public.
   return std::unique_ptr<Program>(new Program(
       id, vertexShaderId, fragmentShaderId, std::move(geometryShaderId),
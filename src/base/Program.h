@@ -7,6 +7,11 @@
 #include "base/Platform.h"
 #include "tools/Optional.h"
 
+// The uniform block with the per-frame and per-pass values, and the binding
+// point every program reads it from. See Scene::uploadPassUniforms.
+const char* const FRAME_UNIFORMS_BLOCK = "FrameUniforms";
+const GLuint FRAME_UNIFORMS_BINDING = 0;
+
 struct ShaderSet {
   std::string m_version;
   std::string m_raw_prefix;
@@ -6,8 +6,16 @@
 #include "base/Terrain.h"
 #include "base/DynTerrain.h"
 #include "base/BezierTerrain.h"
+#include "base/CDLODTerrain.h"
+#include "base/StreamedTerrain.h"
 
 #include "geometry/DrawContext.h"
+#include "geometry/InstancedNode.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <limits>
 
 #include "glm/matrix.hpp"
 #include "glm/gtc/type_ptr.hpp"
@@ -16,42 +24,47 @@
 void SceneUniforms::findInProgram(GLuint a_programId) {
 #define FIND(u) u = glGetUniformLocation(a_programId, #u);
 
-  FIND(uViewProjection)
   FIND(uModel)
   FIND(uUsesTexture)
   FIND(uTexture)
   FIND(uShadowMap)
-  FIND(uMaterial.m_diffuse)
-  FIND(uMaterial.m_specular)
-  FIND(uMaterial.m_ambient)
-  FIND(uMaterial.m_emissive)
-  FIND(uMaterial.m_shininess)
-  FIND(uMaterial.m_shininess_percent)
-  FIND(uFrame)
-  FIND(uAmbientLightColor)
-  FIND(uAmbientLightStrength)
-  FIND(uLightSourcePosition)
-  FIND(uLightSourceColor)
-  FIND(uCameraPosition)
-  FIND(uDrawingForShadowMap)
-  FIND(uShadowMapViewProjection)
+  FIND(uMaterials)
+  FIND(uMaterialIndex)
+  FIND(uInstanced)
 
 #undef FIND
 }
 
-Scene::Scene(ShaderSet a_shaderSet, TerrainMode a_terrainMode)
+Scene::Scene(ShaderSet a_shaderSet,
+             TerrainMode a_terrainMode,
+             const ShadowMapSettings& a_shadowMapSettings)
   : m_shaderSet(std::move(a_shaderSet))
   , m_frameCount(0)
   , m_skybox(Skybox::create())
+  , m_projectionScale(1.0f)
+  , m_lodPixelError(2.0f)
+  , m_shadowMapSettings(a_shadowMapSettings)
+  , m_staticShadowsDirty(true)
   , m_tessLevel(1)
   , m_shouldPaint(true)
   , m_cameraPosition(0, 0, 5)
   , m_dimensions(SKYBOX_WIDTH, SKYBOX_HEIGHT, SKYBOX_DEPTH)
   , m_locked(true)
   , m_wireframeMode(false)
-  , m_lodTessellationEnabled(true) {
+  , m_lodTessellationEnabled(true)
+  , m_terrainNormalsInGeometryShader(false)
+  , m_terrainHorizonShadows(false)
+  , m_frameUniformsUploaded(false) {
   assert(m_skybox);
 
+  glGenBuffers(1, &m_frameUniformBuffer);
+  glBindBuffer(GL_UNIFORM_BUFFER, m_frameUniformBuffer);
+  glBufferData(GL_UNIFORM_BUFFER, sizeof(FrameUniforms), nullptr,
+               GL_DYNAMIC_DRAW);
+  glBindBuffer(GL_UNIFORM_BUFFER, 0);
+  glBindBufferBase(GL_UNIFORM_BUFFER, FRAME_UNIFORMS_BINDING,
+                   m_frameUniformBuffer);
+
   reloadShaders();
   assert(m_mainProgram);
 
@@ -61,8 +74,8 @@ Scene::Scene(ShaderSet a_shaderSet, TerrainMode a_terrainMode)
       case DynTerrain:
         WARN(
             "Unsupported GLSL version for terrain kind, falling back to \
-             normal terrain");
-        a_terrainMode = Terrain;
+             CDLOD terrain");
+        a_terrainMode = CDLODTerrain;
         break;
       default:
         break;
@@ -71,43 +84,71 @@ Scene::Scene(ShaderSet a_shaderSet, TerrainMode a_terrainMode)
 
   switch (a_terrainMode) {
     case Terrain: {
-      m_terrain = Terrain::create();
-      assert(m_terrain);
+      auto terrain = Terrain::create();
+      assert(terrain);
+      terrain->registerMaterials(m_materials);
+      m_terrain = std::move(terrain);
       break;
     }
     case BezierTerrain:
-      m_terrain = BezierTerrain::create();
+      m_terrain = BezierTerrain::create(m_shadowMapSettings);
       assert(m_terrain);
       break;
     case DynTerrain:
-      m_terrain = DynTerrain::create();
+      m_terrain = DynTerrain::create(m_shadowMapSettings);
+      assert(m_terrain);
+      break;
+    case CDLODTerrain:
+      m_terrain = CDLODTerrain::create(m_shadowMapSettings);
+      assert(m_terrain);
+      break;
+    case StreamedTerrain:
+      m_terrain = StreamedTerrain::create();
       assert(m_terrain);
       break;
     case NoTerrain:
       break;
   }
 
+  updateShadowMapProjection();
+
   if (m_terrain && m_terrain->wantsShadowMap()) {
-    m_shadowMapFramebufferAndTexture.set(std::make_pair(0, 0));
-    glGenFramebuffers(1, &m_shadowMapFramebufferAndTexture->first);
-    glGenTextures(1, &m_shadowMapFramebufferAndTexture->second);
-    glBindTexture(GL_TEXTURE_2D, m_shadowMapFramebufferAndTexture->second);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT, SHADOW_WIDTH,
-                 SHADOW_HEIGHT, 0, GL_DEPTH_COMPONENT, GL_FLOAT, nullptr);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-
-    glBindFramebuffer(GL_FRAMEBUFFER, m_shadowMapFramebufferAndTexture->first);
-    glReadBuffer(GL_NONE);
-    glDrawBuffer(GL_NONE);
-    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D,
-                           m_shadowMapFramebufferAndTexture->second, 0);
-    assert(glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE);
+    GLuint shadowMap;
+    glGenTextures(1, &shadowMap);
+    m_shadowMap.set(shadowMap);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, *m_shadowMap);
+    glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, m_shadowMapSettings.internalFormat(),
+                 m_shadowMapSettings.m_size, m_shadowMapSettings.m_size,
+                 SHADOW_CASCADES, 0, GL_DEPTH_COMPONENT, GL_FLOAT, nullptr);
+    // The shaders sample it with a sampler2DArrayShadow, so every fetch
+    // compares against the depth of the fragment, and the linear filter
+    // interpolates the results of the four closest texels.
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_COMPARE_MODE,
+                    GL_COMPARE_REF_TO_TEXTURE);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
+
+    glGenFramebuffers(SHADOW_CASCADES, m_shadowCascadeFramebuffers);
+    for (size_t i = 0; i < SHADOW_CASCADES; ++i) {
+      glBindFramebuffer(GL_FRAMEBUFFER, m_shadowCascadeFramebuffers[i]);
+      glReadBuffer(GL_NONE);
+      glDrawBuffer(GL_NONE);
+      glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT,
+                                *m_shadowMap, 0, i);
+      assert(glCheckFramebufferStatus(GL_FRAMEBUFFER) ==
+             GL_FRAMEBUFFER_COMPLETE);
+    }
 
-    glBindFramebuffer(GL_FRAMEBUFFER, 0);
-    glBindTexture(GL_TEXTURE_2D, 0);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+
+    for (size_t i = 0; i < SHADOW_CASCADES; ++i)
+      m_shadowMapSettings.createCache(m_staticShadowMaps[i],
+                                      m_staticShadowMapFramebuffers[i]);
+    LOG("Shadow maps: %ux%u, %s-bit depth", m_shadowMapSettings.m_size,
+        m_shadowMapSettings.m_size, m_shadowMapSettings.depthFormatName());
   }
 
   LOG("New program: %u", m_mainProgram->id());
@@ -117,6 +158,13 @@ Scene::Scene(ShaderSet a_shaderSet, TerrainMode a_terrainMode)
 
 Scene::~Scene() {
   glUseProgram(0);
+  glDeleteBuffers(1, &m_frameUniformBuffer);
+  if (m_shadowMap) {
+    glDeleteFramebuffers(SHADOW_CASCADES, m_shadowCascadeFramebuffers);
+    glDeleteTextures(1, &*m_shadowMap);
+    glDeleteFramebuffers(SHADOW_CASCADES, m_staticShadowMapFramebuffers);
+    glDeleteTextures(SHADOW_CASCADES, m_staticShadowMaps);
+  }
 }
 
 void Scene::setupUniforms() {
@@ -125,6 +173,14 @@ void Scene::setupUniforms() {
 
   m_uniforms.findInProgram(m_mainProgram->id());
 
+  // The samplers always read from the same units, which need to be set before
+  // the first pass, whichever it is, since GL doesn't allow samplers of
+  // different types on the same unit, even if some pass doesn't use them.
+  m_mainProgram->use();
+  glUniform1i(m_uniforms.uTexture, 0);
+  glUniform1i(m_uniforms.uShadowMap, 1);
+  glUniform1i(m_uniforms.uMaterials, 2);
+
   // assert(m_u_frame != -1);
   // assert(m_u_transform != -1);
   recomputeView();
@@ -135,15 +191,36 @@ void Scene::setLightSourcePosition(const glm::vec3& position) {
 
   m_shadowMapView =
       glm::lookAt(m_lightSourcePosition, glm::vec3(0.0, 0.0, 0.0), Y_AXIS);
+  updateShadowMapProjection();
   if (m_terrain)
     m_terrain->recomputeShadowMap(*this);
+  m_staticShadowsDirty = true;
+}
+
+void Scene::toggleTerrainHorizonShadows() {
+  m_terrainHorizonShadows = !m_terrainHorizonShadows;
+  m_terrainTimer.reset();
+  if (m_terrain)
+    m_terrain->recomputeShadowMap(*this);
+  m_staticShadowsDirty = true;
 }
 
 void Scene::addObject(std::unique_ptr<Node>&& a_object) {
   assertLocked();
+  if (a_object->isStatic())
+    m_staticShadowsDirty = true;
+  a_object->registerMaterials(m_materials);
   m_objects.push_back(std::move(a_object));
 }
 
+void Scene::addInstances(std::unique_ptr<Node>&& a_model,
+                         ArrayView<const glm::mat4> a_transforms) {
+  assertLocked();
+  std::vector<glm::mat4> transforms(a_transforms.begin(), a_transforms.end());
+  addObject(std::make_unique<InstancedNode>(std::move(a_model),
+                                            std::move(transforms)));
+}
+
 void Scene::recomputeView() {
   recomputeView(glm::vec3(0, 0, 0), Y_AXIS);
 }
@@ -151,10 +228,6 @@ void Scene::recomputeView() {
 void Scene::recomputeView(const glm::vec3& lookingAt, const glm::vec3& up) {
   assertLocked();
   m_view = glm::lookAt(m_cameraPosition, lookingAt, up);
-  // NB: The view projection matrix from the skybox doesn't contain the camera
-  // translation.
-  m_skyboxView =
-      glm::lookAt(glm::vec3(0, 0, 0), lookingAt - m_cameraPosition, up);
 }
 
 void Scene::resize(uint32_t width, uint32_t height) {
@@ -164,9 +237,16 @@ void Scene::resize(uint32_t width, uint32_t height) {
   m_pendingResize.set(width, height);
 }
 
+// The depth range of the camera, which the shadow map also uses.
+const float NEAR = 0.1f;
+const float FAR = 100.0f;
+
+// How the cascades of the shadow map split the depth range of the camera,
+// from 0 (in equal parts) to 1 (logarithmically, which gives the same
+// resolution to every depth, but tiny cascades close to the camera).
+const float SHADOW_CASCADE_SPLIT_LAMBDA = 0.5f;
+
 void Scene::setupProjection(float width, float height) {
-  const float NEAR = 0.1f;
-  const float FAR = 100.0f;
   const float FIELD_OF_VIEW = glm::radians(44.0f);
 
   const float aspectRatio = width / height;
@@ -174,9 +254,206 @@ void Scene::setupProjection(float width, float height) {
   LOG("Projecting (%fx%f), aspect ratio: %f", width, height, aspectRatio);
   assertLocked();
   m_projection = glm::perspective(FIELD_OF_VIEW, aspectRatio, NEAR, FAR);
-  const float SHADOW_PROJ = TERRAIN_DIMENSIONS / 2;
-  m_shadowMapProjection = glm::ortho<float>(
-      -SHADOW_PROJ, SHADOW_PROJ, -SHADOW_PROJ, SHADOW_PROJ, NEAR, FAR);
+  m_projectionScale = height / (2.0f * std::tan(FIELD_OF_VIEW / 2.0f));
+}
+
+// The corner of a box with the bits of a_index choosing the max or the min in
+// each axis, x being the lowest one.
+static glm::vec3 boxCorner(const AABB& a_box, size_t a_index) {
+  return glm::vec3(a_index & 1 ? a_box.m_max.x : a_box.m_min.x,
+                   a_index & 2 ? a_box.m_max.y : a_box.m_min.y,
+                   a_index & 4 ? a_box.m_max.z : a_box.m_min.z);
+}
+
+// Returns a perspective projection like a_projection, as glm::perspective
+// builds them, with another depth range.
+static glm::mat4 withDepthRange(const glm::mat4& a_projection,
+                                float a_near,
+                                float a_far) {
+  glm::mat4 ret = a_projection;
+  ret[2][2] = -(a_far + a_near) / (a_far - a_near);
+  ret[3][2] = -2.0f * a_far * a_near / (a_far - a_near);
+  return ret;
+}
+
+// Adds the ends of the part of the segment from a_from to a_to in front of all
+// the given planes (as Frustum stores them) to a_points, if any.
+static void clipSegment(const glm::vec3& a_from,
+                        const glm::vec3& a_to,
+                        const glm::vec4* a_planes,
+                        std::vector<glm::vec3>& a_points) {
+  float start = 0.0f;
+  float end = 1.0f;
+  for (size_t i = 0; i < 6; ++i) {
+    float from = glm::dot(a_planes[i], glm::vec4(a_from, 1.0f));
+    float to = glm::dot(a_planes[i], glm::vec4(a_to, 1.0f));
+    if (from < 0.0f && to < 0.0f)
+      return;
+    if (from < 0.0f)
+      start = std::max(start, from / (from - to));
+    else if (to < 0.0f)
+      end = std::min(end, from / (from - to));
+  }
+  if (start > end)
+    return;
+  a_points.push_back(glm::mix(a_from, a_to, start));
+  a_points.push_back(glm::mix(a_from, a_to, end));
+}
+
+// Adds the vertices of the intersection of a frustum, given by its planes and
+// its corners (near ones first, in the order of boxCorner), and a box to
+// a_points, that is, the ends of the parts of the edges of each one inside of
+// the other.
+static void intersectFrustumAndBox(const glm::vec3* a_frustumCorners,
+                                   const Frustum& a_frustum,
+                                   const AABB& a_box,
+                                   std::vector<glm::vec3>& a_points) {
+  const glm::vec4 boxPlanes[6] = {
+      glm::vec4(1.0f, 0.0f, 0.0f, -a_box.m_min.x),
+      glm::vec4(-1.0f, 0.0f, 0.0f, a_box.m_max.x),
+      glm::vec4(0.0f, 1.0f, 0.0f, -a_box.m_min.y),
+      glm::vec4(0.0f, -1.0f, 0.0f, a_box.m_max.y),
+      glm::vec4(0.0f, 0.0f, 1.0f, -a_box.m_min.z),
+      glm::vec4(0.0f, 0.0f, -1.0f, a_box.m_max.z),
+  };
+
+  for (size_t i = 0; i < 8; ++i) {
+    for (size_t axis : {1, 2, 4}) {
+      if (i & axis)
+        continue;
+      clipSegment(a_frustumCorners[i], a_frustumCorners[i | axis], boxPlanes,
+                  a_points);
+      clipSegment(boxCorner(a_box, i), boxCorner(a_box, i | axis),
+                  a_frustum.planes(), a_points);
+    }
+  }
+}
+
+void Scene::updateShadowMapProjection() {
+  // The light doesn't have any perspective, so it's an ortho projection
+  // around the terrain seen from the light. Anything between the light and
+  // the terrain can cast shadows onto it, so the depth range starts at the
+  // light.
+  AABB terrainBounds = m_terrain ? m_terrain->worldBounds() : AABB();
+  if (terrainBounds.isEmpty()) {
+    const float extent = TERRAIN_DIMENSIONS / 2;
+    m_shadowMapBounds = AABB(glm::vec3(-extent, -extent, NEAR),
+                             glm::vec3(extent, extent, FAR));
+  } else {
+    m_shadowMapBounds = AABB();
+    for (size_t i = 0; i < 8; ++i) {
+      glm::vec3 corner = boxCorner(terrainBounds, i);
+      glm::vec3 light(m_shadowMapView * glm::vec4(corner, 1.0f));
+      m_shadowMapBounds.extend(glm::vec3(light.x, light.y, -light.z));
+    }
+    m_shadowMapBounds.m_min.z = std::min(m_shadowMapBounds.m_min.z, NEAR);
+  }
+
+  const AABB& bounds = m_shadowMapBounds;
+  m_shadowMapProjection =
+      glm::ortho(bounds.m_min.x, bounds.m_max.x, bounds.m_min.y,
+                 bounds.m_max.y, bounds.m_min.z, bounds.m_max.z);
+}
+
+void Scene::updateShadowCascades() {
+  const AABB& mapBounds = m_shadowMapBounds;
+  const glm::vec2 mapMin(mapBounds.m_min);
+  const glm::vec2 mapMax(mapBounds.m_max);
+  const glm::vec2 size(float(m_shadowMapSettings.m_size));
+  const glm::vec2 texelSize = (mapMax - mapMin) / size;
+
+  // The corners of the near and far planes of the camera, in world space.
+  glm::mat4 inverseViewProjection = glm::inverse(viewProjection());
+  glm::vec3 nearCorners[4];
+  glm::vec3 farCorners[4];
+  for (size_t i = 0; i < 4; ++i) {
+    glm::vec2 ndc(i & 1 ? 1.0f : -1.0f, i & 2 ? 1.0f : -1.0f);
+    glm::vec4 nearCorner = inverseViewProjection * glm::vec4(ndc, -1.0f, 1.0f);
+    glm::vec4 farCorner = inverseViewProjection * glm::vec4(ndc, 1.0f, 1.0f);
+    nearCorners[i] = glm::vec3(nearCorner) / nearCorner.w;
+    farCorners[i] = glm::vec3(farCorner) / farCorner.w;
+  }
+
+  // Only the part of the camera frustum inside of the terrain can receive
+  // shadows, so we split just up to the furthest point of it.
+  AABB terrainBounds = m_terrain ? m_terrain->worldBounds() : AABB();
+  float shadowFar = FAR;
+  std::vector<glm::vec3> points;
+  if (!terrainBounds.isEmpty()) {
+    glm::vec3 corners[8];
+    for (size_t i = 0; i < 4; ++i) {
+      corners[i] = nearCorners[i];
+      corners[i + 4] = farCorners[i];
+    }
+    intersectFrustumAndBox(corners, Frustum::fromMatrix(viewProjection()),
+                           terrainBounds, points);
+    float furthest = NEAR;
+    for (const auto& point : points)
+      furthest = std::max(furthest, -(m_view * glm::vec4(point, 1.0f)).z);
+    shadowFar = std::min(furthest, FAR);
+  }
+
+  float splitNear = NEAR;
+  for (size_t cascade = 0; cascade < SHADOW_CASCADES; ++cascade) {
+    float ratio = float(cascade + 1) / SHADOW_CASCADES;
+    float uniformSplit = NEAR + (shadowFar - NEAR) * ratio;
+    float logarithmicSplit = NEAR * std::pow(shadowFar / NEAR, ratio);
+    float splitFar =
+        glm::mix(uniformSplit, logarithmicSplit, SHADOW_CASCADE_SPLIT_LAMBDA);
+
+    glm::vec3 corners[8];
+    for (size_t i = 0; i < 4; ++i) {
+      corners[i] = glm::mix(nearCorners[i], farCorners[i],
+                            (splitNear - NEAR) / (FAR - NEAR));
+      corners[i + 4] = glm::mix(nearCorners[i], farCorners[i],
+                                (splitFar - NEAR) / (FAR - NEAR));
+    }
+
+    // The part of that slice of the camera frustum inside of the terrain, if
+    // we know where it is.
+    points.clear();
+    if (terrainBounds.isEmpty()) {
+      points.assign(corners, corners + 8);
+    } else {
+      glm::mat4 sliceProjection =
+          withDepthRange(m_projection, splitNear, splitFar);
+      intersectFrustumAndBox(corners,
+                             Frustum::fromMatrix(sliceProjection * m_view),
+                             terrainBounds, points);
+    }
+
+    // Its bounds seen from the light. If it's empty, nothing of the cascade
+    // will be seen, so any rectangle does.
+    glm::vec2 min(std::numeric_limits<float>::max());
+    glm::vec2 max(-std::numeric_limits<float>::max());
+    for (const auto& point : points) {
+      glm::vec2 light(m_shadowMapView * glm::vec4(point, 1.0f));
+      min = glm::min(min, light);
+      max = glm::max(max, light);
+    }
+    if (points.empty())
+      min = max = mapMin;
+
+    // Keep the cascades inside of, and aligned to the pixels of, the shadow
+    // map the terrains cache, which uses the same light view and depth range,
+    // so their shadows can be copied into each cascade. This also keeps the
+    // edges of the shadows from shimmering as the camera moves.
+    glm::vec2 pixelMin =
+        glm::floor((glm::clamp(min, mapMin, mapMax) - mapMin) / texelSize);
+    glm::vec2 pixelMax =
+        glm::ceil((glm::clamp(max, mapMin, mapMax) - mapMin) / texelSize);
+    pixelMin = glm::min(pixelMin, size - 1.0f);
+    pixelMax = glm::max(pixelMax, pixelMin + 1.0f);
+    min = mapMin + pixelMin * texelSize;
+    max = mapMin + pixelMax * texelSize;
+
+    m_shadowCascadeViewProjections[cascade] =
+        glm::ortho(min.x, max.x, min.y, max.y, mapBounds.m_min.z,
+                   mapBounds.m_max.z) *
+        m_shadowMapView;
+    m_shadowCascadeRects[cascade] = glm::ivec4(pixelMin, pixelMax);
+    splitNear = splitFar;
+  }
 }
 
 void Scene::reloadShaders() {
@@ -198,6 +475,31 @@ void Scene::setPhysicsCallback(PhysicsCallback callback) {
   m_physicsCallback.set(callback);
 }
 
+// The number of frames we average the terrain drawing time over.
+const uint32_t TERRAIN_TIME_FRAMES = 300;
+
+void Scene::reportTerrainTime() {
+  if (m_terrainTimer.sampleCount() < TERRAIN_TIME_FRAMES)
+    return;
+
+  LOG("Terrain: %.3f ms per frame, normals in the %s shader, %s shadows",
+      *m_terrainTimer.averageMilliseconds(),
+      m_terrainNormalsInGeometryShader ? "geometry" : "evaluation",
+      m_terrainHorizonShadows ? "horizon" : "shadow map");
+  m_terrainTimer.reset();
+}
+
+void Scene::reportShadowCasters() {
+  // It'd be too much to log every frame, so just when something changes.
+  const ShadowCasterStats& last = m_lastFrameShadowCasters;
+  if (m_shadowCasters.m_drawn != last.m_drawn ||
+      m_shadowCasters.m_culled != last.m_culled) {
+    LOG("Shadow casters: %u drawn, %u culled", m_shadowCasters.m_drawn,
+        m_shadowCasters.m_culled);
+  }
+  m_lastFrameShadowCasters = m_shadowCasters;
+}
+
 #undef LOG
 #define LOG(...)
 void Scene::draw() {
@@ -210,9 +512,6 @@ void Scene::draw() {
     glViewport(0, 0, m_size.x, m_size.y);
     setupProjection(m_size.x, m_size.y);
     m_pendingResize.clear();
-
-    if (m_terrain)
-      m_terrain->recomputeShadowMap(*this);
   }
 
   // TODO: Probably we may want to run more/less physics than once per frame,
@@ -220,21 +519,33 @@ void Scene::draw() {
   if (m_physicsCallback)
     (*m_physicsCallback)(*this);
 
-  if (m_shadowMapFramebufferAndTexture) {
-    Optional<GLuint> terrainShadowMap =
-        m_terrain ? m_terrain->shadowMapFBO() : None;
-
-    glBindFramebuffer(GL_DRAW_FRAMEBUFFER,
-                      m_shadowMapFramebufferAndTexture->first);
-    glClear(GL_DEPTH_BUFFER_BIT);
-    if (terrainShadowMap) {
-      // We copy the cached terrain FBO.
-      glBindFramebuffer(GL_READ_FRAMEBUFFER, *terrainShadowMap);
-      glBlitFramebuffer(0, 0, SHADOW_WIDTH, SHADOW_HEIGHT, 0, 0, SHADOW_WIDTH,
-                        SHADOW_HEIGHT, GL_DEPTH_BUFFER_BIT, GL_NEAREST);
+  m_frameCount++;
+  m_materials.upload();
+
+  if (m_shadowMap) {
+    m_shadowCasters = ShadowCasterStats();
+    updateShadowCascades();
+
+    AutoShadowMapViewport viewport(m_shadowMapSettings);
+
+    // We copy the static shadows of each cascade, so only the objects that
+    // move need to be drawn again, unless the cascade moved too.
+    const GLint size = m_shadowMapSettings.m_size;
+    for (size_t i = 0; i < SHADOW_CASCADES; ++i) {
+      if (m_staticShadowsDirty ||
+          m_staticCascadeRects[i] != m_shadowCascadeRects[i])
+        redrawStaticShadows(i);
+
+      glBindFramebuffer(GL_READ_FRAMEBUFFER, m_staticShadowMapFramebuffers[i]);
+      glBindFramebuffer(GL_DRAW_FRAMEBUFFER, m_shadowCascadeFramebuffers[i]);
+      glBlitFramebuffer(0, 0, size, size, 0, 0, size, size,
+                        GL_DEPTH_BUFFER_BIT, GL_NEAREST);
+      drawObjects(m_shadowCascadeViewProjections[i], true,
+                  ObjectFilter::Dynamic);
     }
-    drawObjects(true);
+    m_staticShadowsDirty = false;
     glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    reportShadowCasters();
   }
 
   glPolygonMode(GL_FRONT_AND_BACK, m_wireframeMode ? GL_LINE : GL_FILL);
@@ -244,65 +555,162 @@ void Scene::draw() {
   glClearColor(1, 1, 1, 1);
   glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
+  // The skybox, the terrain and the objects are all drawn with the camera
+  // uniforms, so this is the only upload of the pass.
+  uploadPassUniforms(viewProjection(), false);
+
   // First draw the Skybox.
-  {
-    glm::mat4 viewProjection = m_projection * m_skyboxView;
-    //
-    // TODO: We can make it faster if we draw the skybox last using the depth
-    // buffer. Not a big deal for now I guess.
-    m_skybox->draw(viewProjection);
-  }
+  //
+  // TODO: We can make it faster if we draw the skybox last using the depth
+  // buffer. Not a big deal for now I guess.
+  m_skybox->draw();
 
   // Now the terrain, if it uses a custom program, otherwise draw it with the
   // rest of our objects.
-  if (m_terrain && m_terrain->hasCustomProgram())
+  if (m_terrain && m_terrain->hasCustomProgram()) {
+    m_terrainTimer.begin();
     m_terrain->drawTerrain(*this);
+    m_terrainTimer.end();
+    reportTerrainTime();
+  }
 
-  drawObjects(false);
+  drawObjects(viewProjection(), false);
 }
 
-void Scene::drawObjects(bool forShadowMap) {
-  glm::mat4 viewProjection =
-      forShadowMap ? shadowMapViewProjection() : this->viewProjection();
-  const glm::vec3& cameraPos =
-      forShadowMap ? lightSourcePosition() : cameraPosition();
-
-  glCullFace(forShadowMap ? GL_FRONT : GL_BACK);
+void Scene::redrawStaticShadows(size_t a_cascade,
+                                const Optional<glm::ivec4>& a_pixels) {
+  AutoGLErrorChecker checker;
 
-  m_mainProgram->use();
+  glBindFramebuffer(GL_DRAW_FRAMEBUFFER,
+                    m_staticShadowMapFramebuffers[a_cascade]);
+
+  // With a region, the scissor test keeps the clear, the blit and the draws in
+  // it, and we only draw the casters that can be drawn to it.
+  const glm::mat4& viewProjection = m_shadowCascadeViewProjections[a_cascade];
+  const GLint size = m_shadowMapSettings.m_size;
+  Optional<glm::mat4> cullingViewProjection;
+  if (a_pixels) {
+    const glm::ivec4& pixels = *a_pixels;
+    glEnable(GL_SCISSOR_TEST);
+    glScissor(pixels.x, pixels.y, pixels.z - pixels.x, pixels.w - pixels.y);
+
+    glm::vec2 ndcMin(float(pixels.x) / size * 2.0f - 1.0f,
+                     float(pixels.y) / size * 2.0f - 1.0f);
+    glm::vec2 ndcMax(float(pixels.z) / size * 2.0f - 1.0f,
+                     float(pixels.w) / size * 2.0f - 1.0f);
+    glm::mat4 crop(1.0f);
+    crop[0][0] = 2.0f / (ndcMax.x - ndcMin.x);
+    crop[1][1] = 2.0f / (ndcMax.y - ndcMin.y);
+    crop[3][0] = -(ndcMax.x + ndcMin.x) / (ndcMax.x - ndcMin.x);
+    crop[3][1] = -(ndcMax.y + ndcMin.y) / (ndcMax.y - ndcMin.y);
+    cullingViewProjection.set(crop * viewProjection);
+  }
 
-  // FIXME(emilio): We can avoid most of the traffic here the second time, but
-  // oh well.
-  glUniform1i(m_uniforms.uDrawingForShadowMap, forShadowMap);
+  glClear(GL_DEPTH_BUFFER_BIT);
+
+  const glm::ivec4& rect = m_shadowCascadeRects[a_cascade];
+  Optional<GLuint> terrainShadowMap =
+      m_terrain ? m_terrain->shadowMapFBO() : None;
+  if (terrainShadowMap) {
+    // We scale the part of the cached terrain FBO the cascade covers, which
+    // uses the same light view and depth range.
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, *terrainShadowMap);
+    glBlitFramebuffer(rect.x, rect.y, rect.z, rect.w, 0, 0, size, size,
+                      GL_DEPTH_BUFFER_BIT, GL_NEAREST);
+  }
 
-  glUniform1f(m_uniforms.uFrame,
-              glm::radians(static_cast<float>(m_frameCount++)));
-  glUniformMatrix4fv(m_uniforms.uViewProjection, 1, GL_FALSE,
-                     glm::value_ptr(viewProjection));
+  // The static objects, on the other hand, get the whole resolution of the
+  // cascade.
+  drawObjects(viewProjection, true, ObjectFilter::Static,
+              cullingViewProjection);
 
-  glUniform3fv(m_uniforms.uLightSourcePosition, 1,
-               glm::value_ptr(lightSourcePosition()));
+  if (a_pixels)
+    glDisable(GL_SCISSOR_TEST);
+  glBindFramebuffer(GL_FRAMEBUFFER, 0);
+  m_staticCascadeRects[a_cascade] = rect;
+}
 
-  glm::vec3 lightColor = glm::vec3(1.0, 1.0, 1.0);
-  glUniform3fv(m_uniforms.uLightSourceColor, 1, glm::value_ptr(lightColor));
+void Scene::redrawStaticShadowsAround(const AABB& a_bounds) {
+  // Everything is going to be redrawn anyway.
+  if (!m_shadowMap || m_staticShadowsDirty || a_bounds.isEmpty())
+    return;
 
-  glm::vec3 ambientColor = glm::vec3(1.0, 1.0, 1.0);
-  glUniform3fv(m_uniforms.uAmbientLightColor, 1, glm::value_ptr(ambientColor));
+  AutoShadowMapViewport viewport(m_shadowMapSettings);
+  const float size = m_shadowMapSettings.m_size;
+  for (size_t i = 0; i < SHADOW_CASCADES; ++i) {
+    // The cascade moved since its cache was drawn, so it'll be redrawn as a
+    // whole next frame.
+    if (m_staticCascadeRects[i] != m_shadowCascadeRects[i])
+      continue;
+
+    // The projection is orthographic, so the box of the projected box is
+    // exactly what it can be drawn to.
+    AABB ndc = a_bounds.transformed(m_shadowCascadeViewProjections[i]);
+    glm::vec2 pixelMin =
+        glm::floor((glm::vec2(ndc.m_min) * 0.5f + 0.5f) * size);
+    glm::vec2 pixelMax =
+        glm::ceil((glm::vec2(ndc.m_max) * 0.5f + 0.5f) * size);
+    pixelMin = glm::max(pixelMin, glm::vec2(0.0f));
+    pixelMax = glm::min(pixelMax, glm::vec2(size));
+    if (pixelMin.x >= pixelMax.x || pixelMin.y >= pixelMax.y)
+      continue;
+
+    redrawStaticShadows(i, Some(glm::ivec4(pixelMin, pixelMax)));
+  }
+}
 
+void Scene::uploadPassUniforms(const glm::mat4& a_viewProjection,
+                               bool a_forShadowMap) const {
+  FrameUniforms uniforms;
+  uniforms.m_viewProjection = a_viewProjection;
+  std::copy(m_shadowCascadeViewProjections,
+            m_shadowCascadeViewProjections + SHADOW_CASCADES,
+            uniforms.m_shadowCascadeViewProjections);
+  uniforms.m_cameraPosition =
+      a_forShadowMap ? lightSourcePosition() : cameraPosition();
+  uniforms.m_frame = glm::radians(static_cast<float>(m_frameCount));
+  uniforms.m_lightSourcePosition = lightSourcePosition();
   // FIXME: Not hardcode this? Maybe make it depend on the frame, or the time...
-  float ambientStrength = 1;
-  glUniform1f(m_uniforms.uAmbientLightStrength, ambientStrength);
+  uniforms.m_ambientLightStrength = 1.0f;
+  uniforms.m_lightSourceColor = glm::vec3(1.0, 1.0, 1.0);
+  uniforms.m_drawingForShadowMap = a_forShadowMap;
+  uniforms.m_ambientLightColor = glm::vec3(1.0, 1.0, 1.0);
+  uniforms.m_padding = 0.0f;
+
+  if (m_frameUniformsUploaded &&
+      !memcmp(&uniforms, &m_frameUniforms, sizeof(FrameUniforms)))
+    return;
+
+  AutoGLErrorChecker checker;
+  glBindBuffer(GL_UNIFORM_BUFFER, m_frameUniformBuffer);
+  glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(FrameUniforms), &uniforms);
+  glBindBuffer(GL_UNIFORM_BUFFER, 0);
+  m_frameUniforms = uniforms;
+  m_frameUniformsUploaded = true;
+}
 
-  glUniform3fv(m_uniforms.uCameraPosition, 1, glm::value_ptr(cameraPos));
+void Scene::drawObjects(const glm::mat4& viewProjection,
+                        bool forShadowMap,
+                        ObjectFilter a_filter,
+                        const Optional<glm::mat4>& a_cullingViewProjection) {
+  glCullFace(forShadowMap ? GL_FRONT : GL_BACK);
+
+  m_cullingFrustum = Frustum::fromMatrix(
+      a_cullingViewProjection ? *a_cullingViewProjection : viewProjection);
+
+  m_mainProgram->use();
+  uploadPassUniforms(viewProjection, forShadowMap);
 
-  // Use slot number 1 for the shadow map.
+  // Use slot number 1 for the shadow map, see setupUniforms.
   if (shadowMap()) {
-    glUniformMatrix4fv(m_uniforms.uShadowMapViewProjection, 1, GL_FALSE,
-                       glm::value_ptr(shadowMapViewProjection()));
-    if (forShadowMap)
-      glUniform1i(m_uniforms.uShadowMap, 1);
     glActiveTexture(GL_TEXTURE1);
-    glBindTexture(GL_TEXTURE_2D, forShadowMap ? 0 : *shadowMap());
+    glBindTexture(GL_TEXTURE_2D_ARRAY, forShadowMap ? 0 : *shadowMap());
+  }
+
+  // And number 2 for the materials, which the shadow maps don't need.
+  if (!forShadowMap) {
+    glActiveTexture(GL_TEXTURE2);
+    glBindTexture(GL_TEXTURE_BUFFER, m_materials.texture());
   }
 
   LOG("camera: (%f %f %f)", m_cameraPosition[0], m_cameraPosition[1],
@@ -311,14 +719,35 @@ void Scene::drawObjects(bool forShadowMap) {
   LOG_MATRIX("view", m_view);
   LOG_MATRIX("viewProjection", viewProjection);
 
-  if (m_terrain && !m_terrain->hasCustomProgram())
+  if (m_terrain && !m_terrain->hasCustomProgram() &&
+      a_filter != ObjectFilter::Dynamic)
     m_terrain->drawTerrain(*this);
 
   DrawContext context(rootDrawContext());
+  m_renderQueue.begin(forShadowMap ? RenderQueue::Pass::ShadowMap
+                                   : RenderQueue::Pass::Opaque,
+                      viewProjection);
+  context.setQueue(&m_renderQueue);
 
   // size_t i = 0;
   for (auto& object : m_objects) {
     assert(object);
+    if ((a_filter == ObjectFilter::Static && !object->isStatic()) ||
+        (a_filter == ObjectFilter::Dynamic && object->isStatic()))
+      continue;
+
+    // Skip the objects entirely out of the frustum of the pass. For the
+    // shadow passes, that's the box around what the camera sees from the
+    // light, stretched back to the light, so whatever is left out can't cast
+    // a shadow onto anything in view.
+    AABB bounds = object->bounds();
+    if (!bounds.isEmpty() && !m_cullingFrustum.intersects(bounds)) {
+      if (forShadowMap)
+        m_shadowCasters.m_culled++;
+      continue;
+    }
+    if (forShadowMap)
+      m_shadowCasters.m_drawn++;
 
     // if (i++ % 2 == 0)
     //   object->rotateY(glm::radians(2.5f));
@@ -327,15 +756,19 @@ void Scene::drawObjects(bool forShadowMap) {
     // LOG("Object %zu", i);
     object->draw(context);
   }
+
+  // Draw everything at once, sorted to share as much state as possible.
+  m_renderQueue.submit(context);
 }
 
 DrawContext Scene::rootDrawContext() const {
   return DrawContext(*m_mainProgram,
                      DrawContext::Uniforms{
                          m_uniforms.uModel, m_uniforms.uUsesTexture,
-                         m_uniforms.uTexture, m_uniforms.uMaterial,
+                         m_uniforms.uTexture, m_uniforms.uMaterialIndex,
+                         m_uniforms.uInstanced,
                      },
-                     glm::mat4());
+                     glm::mat4(), m_cullingFrustum);
 }
 
 void Scene::stopPainting() {
@@ -353,3 +786,35 @@ float Scene::terrainHeightAt(float x, float y) {
   assert(m_terrain);
   return m_terrain->heightAt(x, y);
 }
+
+void Scene::terrainHeightsAt(ArrayView<const glm::vec2> a_points,
+                             ArrayView<float> a_out) {
+  assertLocked();
+  assert(m_terrain);
+  m_terrain->heightsAt(a_points, a_out);
+}
+
+Optional<float> Scene::terrainRaycast(const Ray& a_ray) {
+  assertLocked();
+  assert(m_terrain);
+  return m_terrain->raycast(a_ray);
+}
+
+void Scene::terrainRaycastMany(ArrayView<const Ray> a_rays,
+                               ArrayView<Optional<float>> a_out) {
+  assertLocked();
+  assert(m_terrain);
+  m_terrain->raycastMany(a_rays, a_out);
+}
+
+bool Scene::modifyTerrain(const glm::vec2& a_min,
+                          const glm::vec2& a_max,
+                          const ITerrain::HeightOp& a_op) {
+  assertLocked();
+  assert(m_terrain);
+  AABB changed;
+  if (!m_terrain->modifyRegion(*this, a_min, a_max, a_op, changed))
+    return false;
+  redrawStaticShadowsAround(changed);
+  return true;
+}
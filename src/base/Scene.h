@@ -7,44 +7,77 @@
 #include <string>
 #include <vector>
 
-#include "geometry/Material.h"
+#include "geometry/Frustum.h"
+#include "geometry/MaterialTable.h"
 #include "geometry/Node.h"
+#include "geometry/Ray.h"
+#include "geometry/RenderQueue.h"
+#include "base/GPUTimer.h"
 #include "base/Program.h"
+#include "base/ITerrain.h"
+#include "base/ShadowMapSettings.h"
+#include "tools/ArrayView.h"
 
 const glm::vec3 X_AXIS = glm::vec3(1, 0, 0);
 const glm::vec3 Y_AXIS = glm::vec3(0, 1, 0);
 const glm::vec3 Z_AXIS = glm::vec3(0, 0, 1);
 
-const float SHADOW_WIDTH = 1000.0f;
-const float SHADOW_HEIGHT = 1000.0f;
+// The number of cascades the shadow map has, see Scene::updateShadowCascades.
+// Keep in sync with the shaders.
+const size_t SHADOW_CASCADES = 3;
 
 const float CAMERA_DISTANCE = 20.0f;
 
 class AutoSceneLocker;
 class Skybox;
-class ITerrain;
 
 class SceneUniforms {
   friend class Scene;
 
-  GLint uViewProjection;
   GLint uModel;
   GLint uUsesTexture;
   GLint uTexture;
   GLint uShadowMap;
-  MaterialUniforms uMaterial;
-  GLint uFrame;
-  GLint uAmbientLightColor;
-  GLint uAmbientLightStrength;
-  GLint uLightSourcePosition;
-  GLint uLightSourceColor;
-  GLint uCameraPosition;
-  GLint uDrawingForShadowMap;
-  GLint uShadowMapViewProjection;
+  GLint uMaterials;
+  GLint uMaterialIndex;
+  GLint uInstanced;
 
   void findInProgram(GLuint a_programId);
 };
 
+/**
+ * The contents of the FrameUniforms block of the shaders, with the std140
+ * layout, that is, vec3s padded to 16 bytes, which we fill with the scalars
+ * following them. Keep in sync with res/common.glsl and the other shaders
+ * declaring it.
+ */
+struct FrameUniforms {
+  glm::mat4 m_viewProjection;
+  glm::mat4 m_shadowCascadeViewProjections[SHADOW_CASCADES];
+  // The camera, or the light when drawing to a shadow map.
+  glm::vec3 m_cameraPosition;
+  float m_frame;
+  glm::vec3 m_lightSourcePosition;
+  float m_ambientLightStrength;
+  glm::vec3 m_lightSourceColor;
+  // A bool, which std140 stores in four bytes.
+  uint32_t m_drawingForShadowMap;
+  glm::vec3 m_ambientLightColor;
+  float m_padding;
+};
+
+/**
+ * How many objects were drawn into the shadow maps in a frame, and how many
+ * were skipped because they couldn't cast a shadow onto anything in view.
+ * Objects drawn into several cascades count once per cascade.
+ */
+struct ShadowCasterStats {
+  uint32_t m_drawn;
+  uint32_t m_culled;
+
+  ShadowCasterStats() : m_drawn(0), m_culled(0) {}
+};
+
 class Scene {
   friend class AutoSceneLocker;
 
@@ -53,12 +86,14 @@ public:
     Terrain,
     DynTerrain,
     BezierTerrain,
+    CDLODTerrain,
+    StreamedTerrain,
     NoTerrain,
   };
 
   using PhysicsCallback = std::function<void(Scene&)>;
 
-  Scene(ShaderSet, TerrainMode);
+  Scene(ShaderSet, TerrainMode, const ShadowMapSettings& = ShadowMapSettings());
   Scene(ShaderSet a_set) : Scene(std::move(a_set), Terrain){};
   ~Scene();
 
@@ -70,13 +105,45 @@ private:
   std::unique_ptr<Skybox> m_skybox;
   std::unique_ptr<ITerrain> m_terrain;
   SceneUniforms m_uniforms;
+  // The materials of the objects and the terrain, registered when added.
+  MaterialTable m_materials;
   glm::mat4 m_projection;
+  // The size in pixels of something one unit long at one unit of distance
+  // from the camera, for screen-space error computations.
+  float m_projectionScale;
+  // The error in pixels the terrain LOD aims for.
+  float m_lodPixelError;
   glm::mat4 m_view;
-  glm::mat4 m_skyboxView;
   glm::mat4 m_shadowMapView;
-  Optional<std::pair<GLuint, GLuint>> m_shadowMapFramebufferAndTexture;
-  // An ortho projection since the light doesn't have any perspective.
+  // An ortho projection since the light doesn't have any perspective. This
+  // covers the whole terrain, which is what the terrains cache their shadows
+  // with.
   glm::mat4 m_shadowMapProjection;
+  // The box that projection covers, in the light view space, with the depth
+  // along z, so positive.
+  AABB m_shadowMapBounds;
+  ShadowMapSettings m_shadowMapSettings;
+  // The shadow map cascades, as layers of an array texture, with a
+  // framebuffer to draw to each one.
+  Optional<GLuint> m_shadowMap;
+  GLuint m_shadowCascadeFramebuffers[SHADOW_CASCADES];
+  glm::mat4 m_shadowCascadeViewProjections[SHADOW_CASCADES];
+  // The rectangle of the whole-terrain shadow map each cascade covers, in
+  // pixels, as (x0, y0, x1, y1).
+  glm::ivec4 m_shadowCascadeRects[SHADOW_CASCADES];
+  // The shadows of the terrain and the static objects in each cascade, which
+  // get copied into it before drawing the rest of the objects. Each one is
+  // redrawn only when m_staticShadowsDirty, or when its cascade covers a
+  // different rectangle than the one it was drawn for (m_staticCascadeRects).
+  GLuint m_staticShadowMapFramebuffers[SHADOW_CASCADES];
+  GLuint m_staticShadowMaps[SHADOW_CASCADES];
+  glm::ivec4 m_staticCascadeRects[SHADOW_CASCADES];
+  bool m_staticShadowsDirty;
+  // The frustum of the pass being drawn, handed to the draw contexts.
+  Frustum m_cullingFrustum;
+  // Where drawObjects collects the draws of the meshes, kept around so its
+  // storage is reused across passes.
+  RenderQueue m_renderQueue;
   Optional<glm::u32vec2> m_pendingResize;
   Optional<PhysicsCallback> m_physicsCallback;
   int32_t m_tessLevel;
@@ -89,6 +156,25 @@ private:
   bool m_locked;
   bool m_wireframeMode;
   bool m_lodTessellationEnabled;
+  // Whether the tessellated terrains compute their normals in a geometry
+  // shader, like they used to, instead of in the evaluation shader. Only
+  // useful to compare both.
+  bool m_terrainNormalsInGeometryShader;
+  // Whether the terrains that support it shadow themselves with a baked
+  // horizon map instead of drawing themselves into the shadow map. Off by
+  // default, since then they don't cast shadows onto the objects.
+  bool m_terrainHorizonShadows;
+  // How long drawing the terrain takes on the GPU, logged every few frames.
+  GPUTimer m_terrainTimer;
+  // The buffer backing the FrameUniforms block of every program, and what we
+  // last uploaded to it, so passes drawn with the same values don't upload
+  // them again.
+  GLuint m_frameUniformBuffer;
+  mutable FrameUniforms m_frameUniforms;
+  mutable bool m_frameUniformsUploaded;
+  // The shadow casters of the frame being drawn, and of the last one.
+  ShadowCasterStats m_shadowCasters;
+  ShadowCasterStats m_lastFrameShadowCasters;
   glm::u32vec2 m_size;
 
   void assertLocked() {
@@ -97,11 +183,52 @@ private:
 
   void setupUniforms();
   void setupProjection(float width, float height);
-  void drawObjects(bool forShadowMap);
+  void updateShadowMapProjection();
+  void updateShadowCascades();
+  // Which of the objects drawObjects draws. The terrain, if it doesn't have
+  // a custom program, counts as static.
+  enum class ObjectFilter {
+    All,
+    Static,
+    Dynamic,
+  };
+
+  // Redraws the static shadows of a cascade, or only the pixels in a_pixels,
+  // as (x0, y0, x1, y1), if given.
+  void redrawStaticShadows(size_t a_cascade,
+                           const Optional<glm::ivec4>& a_pixels = None);
+  // Redraws the pixels a box (in world space) covers in the static shadows of
+  // every cascade, for when something static changes just there.
+  void redrawStaticShadowsAround(const AABB& a_bounds);
+  // a_cullingViewProjection allows to only draw the objects in a part of the
+  // frustum we're drawing to.
+  void drawObjects(
+      const glm::mat4& a_viewProjection,
+      bool forShadowMap,
+      ObjectFilter a_filter = ObjectFilter::All,
+      const Optional<glm::mat4>& a_cullingViewProjection = None);
+  void reportTerrainTime();
+  void reportShadowCasters();
 
 public:
   DrawContext rootDrawContext() const;
   void addObject(std::unique_ptr<Node>&& a_object);
+
+  /**
+   * Adds a copy of the model at each of the given transforms, sharing its
+   * geometry and drawing all of them with a single instanced call per mesh,
+   * see InstancedNode. The copies are static if the model is.
+   */
+  void addInstances(std::unique_ptr<Node>&& a_model,
+                    ArrayView<const glm::mat4> a_transforms);
+
+  /**
+   * Makes the shadows of the static objects get redrawn, for when one of them
+   * changes after all.
+   */
+  void invalidateStaticShadows() {
+    m_staticShadowsDirty = true;
+  }
   void recomputeView();
   void recomputeView(const glm::vec3& lookingAt, const glm::vec3& up);
   void resize(uint32_t width, uint32_t height);
@@ -115,10 +242,12 @@ public:
     return m_view;
   }
 
+  /**
+   * The GL_TEXTURE_2D_ARRAY with the depth of each shadow map cascade, see
+   * shadowCascadeViewProjections().
+   */
   Optional<GLuint> shadowMap() const {
-    return m_shadowMapFramebufferAndTexture
-               ? Some(m_shadowMapFramebufferAndTexture->second)
-               : None;
+    return m_shadowMap ? Some(*m_shadowMap) : None;
   }
 
   const glm::mat4& projectionMatrix() const {
@@ -129,10 +258,39 @@ public:
     return m_projection * m_view;
   }
 
+  const ShadowMapSettings& shadowMapSettings() const {
+    return m_shadowMapSettings;
+  }
+
+  /**
+   * The light view-projection covering the whole terrain, which the terrains
+   * draw their cached shadow maps with.
+   */
   glm::mat4 shadowMapViewProjection() const {
     return m_shadowMapProjection * m_shadowMapView;
   }
 
+  /**
+   * The light view-projection of each of the SHADOW_CASCADES cascades of the
+   * shadow map, from the closest to the camera to the furthest.
+   */
+  const glm::mat4* shadowCascadeViewProjections() const {
+    return m_shadowCascadeViewProjections;
+  }
+
+  /**
+   * Uploads the values of the FrameUniforms block for a pass drawn with the
+   * given view-projection, from the camera, or from the light if it's for a
+   * shadow map. Anything drawing with one of our programs must call this
+   * before, though it only touches the buffer if the values changed.
+   */
+  void uploadPassUniforms(const glm::mat4& a_viewProjection,
+                          bool a_forShadowMap) const;
+
+  const ShadowCasterStats& lastFrameShadowCasters() const {
+    return m_lastFrameShadowCasters;
+  }
+
   void setLightSourcePosition(const glm::vec3&);
   const glm::vec3& lightSourcePosition() const {
     return m_lightSourcePosition;
@@ -167,11 +325,46 @@ public:
     return m_lodTessellationEnabled;
   }
 
+  float projectionScale() const {
+    return m_projectionScale;
+  }
+
+  float lodPixelError() const {
+    return m_lodPixelError;
+  }
+
+  void scaleLodPixelError(float a_factor) {
+    m_lodPixelError = glm::clamp(m_lodPixelError * a_factor, 0.25f, 64.0f);
+  }
+
   void toggleDynamicTessellation() {
     m_lodTessellationEnabled = !m_lodTessellationEnabled;
   }
 
+  bool terrainNormalsInGeometryShader() const {
+    return m_terrainNormalsInGeometryShader;
+  }
+
+  void toggleTerrainNormalsInGeometryShader() {
+    m_terrainNormalsInGeometryShader = !m_terrainNormalsInGeometryShader;
+    m_terrainTimer.reset();
+  }
+
+  bool terrainHorizonShadows() const {
+    return m_terrainHorizonShadows;
+  }
+
+  void toggleTerrainHorizonShadows();
+
   float terrainHeightAt(float x, float y);
+  void terrainHeightsAt(ArrayView<const glm::vec2> a_points,
+                        ArrayView<float> a_out);
+  Optional<float> terrainRaycast(const Ray& a_ray);
+  void terrainRaycastMany(ArrayView<const Ray> a_rays,
+                          ArrayView<Optional<float>> a_out);
+  bool modifyTerrain(const glm::vec2& a_min,
+                     const glm::vec2& a_max,
+                     const ITerrain::HeightOp& a_op);
 };
 
 class AutoSceneLocker {
@@ -0,0 +1,62 @@
+#include "base/ShadowMapSettings.h"
+
+#include <cassert>
+#include <cstring>
+
+GLenum ShadowMapSettings::internalFormat() const {
+  switch (m_depthFormat) {
+    case Depth16:
+      return GL_DEPTH_COMPONENT16;
+    case Depth24:
+      return GL_DEPTH_COMPONENT24;
+    case Depth32F:
+      return GL_DEPTH_COMPONENT32F;
+  }
+  assert(false && "Unknown depth format");
+  return GL_DEPTH_COMPONENT24;
+}
+
+const char* ShadowMapSettings::depthFormatName() const {
+  switch (m_depthFormat) {
+    case Depth16:
+      return "16";
+    case Depth24:
+      return "24";
+    case Depth32F:
+      return "32f";
+  }
+  assert(false && "Unknown depth format");
+  return "?";
+}
+
+/* static */ Optional<ShadowMapSettings::DepthFormat>
+ShadowMapSettings::parseDepthFormat(const char* a_name) {
+  if (!strcmp(a_name, "16"))
+    return Some(Depth16);
+  if (!strcmp(a_name, "24"))
+    return Some(Depth24);
+  if (!strcmp(a_name, "32f"))
+    return Some(Depth32F);
+  return None;
+}
+
+void ShadowMapSettings::createCache(GLuint& a_texture,
+                                    GLuint& a_framebuffer) const {
+  glGenTextures(1, &a_texture);
+  glBindTexture(GL_TEXTURE_2D, a_texture);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+  glTexImage2D(GL_TEXTURE_2D, 0, internalFormat(), m_size, m_size, 0,
+               GL_DEPTH_COMPONENT, GL_FLOAT, nullptr);
+
+  glGenFramebuffers(1, &a_framebuffer);
+  glBindFramebuffer(GL_FRAMEBUFFER, a_framebuffer);
+  glReadBuffer(GL_NONE);
+  glDrawBuffer(GL_NONE);
+  glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D,
+                         a_texture, 0);
+  assert(glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE);
+
+  glBindFramebuffer(GL_FRAMEBUFFER, 0);
+  glBindTexture(GL_TEXTURE_2D, 0);
+}
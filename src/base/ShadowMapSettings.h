@@ -0,0 +1,60 @@
+#pragma once
+
+#include "base/gl.h"
+#include "tools/Optional.h"
+
+#include <cstdint>
+
+/**
+ * The resolution and depth format of the shadow maps.
+ *
+ * Every shadow map uses the same ones: the cascades, and the caches the scene
+ * and the terrains copy into them, since glBlitFramebuffer can only copy depth
+ * between framebuffers with the same format.
+ */
+struct ShadowMapSettings {
+  enum DepthFormat {
+    Depth16,
+    Depth24,
+    Depth32F,
+  };
+
+  // The width and height of every shadow map, in pixels.
+  uint32_t m_size;
+  DepthFormat m_depthFormat;
+
+  ShadowMapSettings() : m_size(1024), m_depthFormat(Depth24) {}
+
+  GLenum internalFormat() const;
+  const char* depthFormatName() const;
+
+  /**
+   * Parses a depth format as depthFormatName() prints it, that is, "16", "24"
+   * or "32f".
+   */
+  static Optional<DepthFormat> parseDepthFormat(const char*);
+
+  /**
+   * Creates a depth texture with these settings, for drawing and copying, not
+   * for sampling, and a framebuffer to draw to it.
+   */
+  void createCache(GLuint& a_texture, GLuint& a_framebuffer) const;
+};
+
+/**
+ * Sets the viewport to the size of the shadow maps while alive, and restores
+ * the previous one afterwards.
+ */
+class AutoShadowMapViewport {
+  GLint m_previous[4];
+
+public:
+  explicit AutoShadowMapViewport(const ShadowMapSettings& a_settings) {
+    glGetIntegerv(GL_VIEWPORT, m_previous);
+    glViewport(0, 0, a_settings.m_size, a_settings.m_size);
+  }
+
+  ~AutoShadowMapViewport() {
+    glViewport(m_previous[0], m_previous[1], m_previous[2], m_previous[3]);
+  }
+};
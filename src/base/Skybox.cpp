@@ -2,8 +2,6 @@
 #include "base/gl.h"
 #include "base/ErrorChecker.h"
 
-#include "glm/gtc/type_ptr.hpp"
-
 #include <vector>
 #include <SFML/Graphics.hpp>
 
@@ -80,8 +78,6 @@ Skybox::Skybox(std::unique_ptr<Program> a_program)
   glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(GLfloat), nullptr);
 
   // Set up uniform.
-  m_uniforms.uViewProjection =
-      glGetUniformLocation(m_program->id(), "uViewProjection");
   m_uniforms.uSkybox = glGetUniformLocation(m_program->id(), "uSkybox");
   glBindVertexArray(0);
 }
@@ -92,7 +88,7 @@ Skybox::~Skybox() {
   glDeleteTextures(1, &m_cubeMapTexture);
 }
 
-void Skybox::draw(const glm::mat4& a_viewProjection) const {
+void Skybox::draw() const {
   AutoGLErrorChecker checker;
   assert(glIsVertexArray(m_vao));
 
@@ -104,9 +100,6 @@ void Skybox::draw(const glm::mat4& a_viewProjection) const {
 
   glBindTexture(GL_TEXTURE_CUBE_MAP, m_cubeMapTexture);
 
-  glUniformMatrix4fv(m_uniforms.uViewProjection, 1, GL_FALSE,
-                     glm::value_ptr(a_viewProjection));
-
   static_assert((sizeof(gSkyboxVertices) / sizeof(GLfloat)) == 36 * 3, "wat");
   glDrawArrays(GL_TRIANGLES, 0, 36);
   glBindVertexArray(0);
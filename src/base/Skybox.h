@@ -20,14 +20,15 @@ class Skybox final {
   GLuint m_vao;
 
   struct {
-    GLint uViewProjection;
     GLint uSkybox;
   } m_uniforms;
 
 public:
   ~Skybox();
 
-  void draw(const glm::mat4& a_viewProjection) const;
+  // Draws the skybox around the camera of the pass, see
+  // Scene::uploadPassUniforms.
+  void draw() const;
 
   // Could be useful if I decide to do reflection of stuff.
   GLuint texture() const {
@@ -0,0 +1,368 @@
+#include "base/StreamedTerrain.h"
+#include "base/DynTerrain.h"
+#include "base/ErrorChecker.h"
+#include "base/HeightField.h"
+#include "base/Logging.h"
+#include "base/Scene.h"
+#include "base/Terrain.h"
+#include "geometry/AABB.h"
+#include "geometry/Frustum.h"
+#include "geometry/PatchGrid.h"
+
+#include "glm/gtc/type_ptr.hpp"
+
+#include <algorithm>
+#include <limits>
+#include <SFML/Graphics.hpp>
+
+// Baked from res/terrain/heightmap.png the first time it's needed.
+const char* TILED_HEIGHTMAP_PATH = "res/terrain/heightmap.tiles";
+
+static_assert((2 * StreamedTerrain::RESIDENCY_RADIUS + 1) *
+                      (2 * StreamedTerrain::RESIDENCY_RADIUS + 1) <=
+                  StreamedTerrain::MAX_RESIDENT_TILES,
+              "The tile cache must be able to hold the whole residency area");
+
+StreamedTerrain::StreamedTerrain(std::unique_ptr<TiledHeightMap> a_map,
+                                 std::unique_ptr<Program> a_program,
+                                 GLuint a_cover)
+  : m_map(std::move(a_map))
+  , m_program(std::move(a_program))
+  , m_coverTexture(a_cover)
+  , m_grid(PatchGrid::get(TILE_QUADS))
+  , m_slots(MAX_RESIDENT_TILES, Slot{false, 0, 0, glm::vec2()}) {
+  AutoGLErrorChecker checker;
+  assert(m_map->tileQuads() == TILE_QUADS);
+
+  const GLsizei samples = m_map->tileSamples();
+  glGenTextures(1, &m_tileCache);
+  glBindTexture(GL_TEXTURE_2D_ARRAY, m_tileCache);
+  glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_R32F, samples, samples,
+               MAX_RESIDENT_TILES, 0, GL_RED, GL_FLOAT, nullptr);
+  glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+  glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+  glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+  glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+  glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+
+  glGenVertexArrays(1, &m_vao);
+  glBindVertexArray(m_vao);
+
+  m_grid->setupVertexArray(0);
+
+  glGenBuffers(1, &m_instancesVBO);
+  glBindBuffer(GL_ARRAY_BUFFER, m_instancesVBO);
+  glEnableVertexAttribArray(1);
+  glVertexAttribPointer(1, 4, GL_FLOAT, GL_FALSE, sizeof(TileInstance), 0);
+  glVertexAttribDivisor(1, 1);
+
+  glBindVertexArray(0);
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+  m_uniforms.query(*m_program);
+}
+
+StreamedTerrain::~StreamedTerrain() {
+  glDeleteTextures(1, &m_coverTexture);
+  glDeleteTextures(1, &m_tileCache);
+
+  glDeleteBuffers(1, &m_instancesVBO);
+  glDeleteVertexArrays(1, &m_vao);
+}
+
+/* static */ std::unique_ptr<StreamedTerrain> StreamedTerrain::create() {
+  ShaderSet shaders("res/streamed-terrain/common.glsl",
+                    "res/streamed-terrain/vertex.glsl",
+                    "res/dyn-terrain/fragment.glsl");
+
+  auto program = Program::fromShaders(shaders);
+  if (!program) {
+    ERROR("Failed to create StreamedTerrain program");
+    return nullptr;
+  }
+
+  auto map = TiledHeightMap::open(TILED_HEIGHTMAP_PATH);
+  if (!map) {
+    LOG("Baking %s", TILED_HEIGHTMAP_PATH);
+
+    sf::Image heightMapImporter;
+    if (!heightMapImporter.loadFromFile("res/terrain/heightmap.png")) {
+      ERROR("Error loading heightmap");
+      return nullptr;
+    }
+
+    // Same scale as the other terrains, so they're interchangeable.
+    HeightField heightField =
+        HeightField::fromImage(heightMapImporter, 1.0f / 3.0f, -0.5f / 3.0f);
+    float spacing = float(TERRAIN_DIMENSIONS) / heightField.width();
+    if (!TiledHeightMap::write(TILED_HEIGHTMAP_PATH, heightField, TILE_QUADS,
+                               spacing, TERRAIN_DIMENSIONS))
+      return nullptr;
+
+    map = TiledHeightMap::open(TILED_HEIGHTMAP_PATH);
+    if (!map)
+      return nullptr;
+  }
+
+  if (map->tileQuads() != TILE_QUADS) {
+    ERROR("Unexpected tile size in %s: %u", TILED_HEIGHTMAP_PATH,
+          map->tileQuads());
+    return nullptr;
+  }
+
+  sf::Image coverImporter;
+  if (!coverImporter.loadFromFile("res/terrain/cover.png")) {
+    ERROR("Error loading cover");
+    return nullptr;
+  }
+
+  GLuint cover = DynTerrain::textureFromImage(coverImporter, true);
+
+  // Heights are queried from the corner of the map, but we want it centered
+  // like the other terrains, which put sample i at i / width - 0.5 of their
+  // size, that is, half a sample off the center of worldSize().
+  glm::vec2 offset =
+      glm::vec2(map->width(), map->height()) * map->sampleSpacing() * 0.5f;
+  auto ret = std::unique_ptr<StreamedTerrain>(
+      new StreamedTerrain(std::move(map), std::move(program), cover));
+  ret->translate(glm::vec3(-offset.x, 0, -offset.y));
+  return ret;
+}
+
+void StreamedTerrain::Uniforms::query(const Program& program) {
+#define QUERY(u)                                                               \
+  do {                                                                         \
+    u = glGetUniformLocation(program.id(), #u);                                \
+    /* assert(u != -1); */                                                     \
+  } while (0)
+
+  QUERY(uModel);
+  QUERY(uCover);
+  QUERY(uHeightTiles);
+  QUERY(uShadowMap);
+  QUERY(uTileQuads);
+  QUERY(uCoverScale);
+
+#undef QUERY
+}
+
+float StreamedTerrain::tileDistanceSquared(uint32_t a_tileX,
+                                           uint32_t a_tileY,
+                                           const glm::vec2& a_position) const {
+  const float size = m_map->tileWorldSize();
+  glm::vec2 center = (glm::vec2(a_tileX, a_tileY) + 0.5f) * size;
+  glm::vec2 delta = center - a_position;
+  return glm::dot(delta, delta);
+}
+
+void StreamedTerrain::upload(uint32_t a_slot,
+                             uint32_t a_tileX,
+                             uint32_t a_tileY) const {
+  AutoGLErrorChecker checker;
+
+  const float* samples = m_map->tile(a_tileX, a_tileY);
+  const uint32_t side = m_map->tileSamples();
+
+  glBindTexture(GL_TEXTURE_2D_ARRAY, m_tileCache);
+  glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, a_slot, side, side, 1, GL_RED,
+                  GL_FLOAT, samples);
+  glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+
+  auto bounds = std::minmax_element(samples, samples + side * side);
+
+  Slot& slot = m_slots[a_slot];
+  slot.m_used = true;
+  slot.m_tileX = a_tileX;
+  slot.m_tileY = a_tileY;
+  slot.m_heightBounds = glm::vec2(*bounds.first, *bounds.second);
+  m_residentTiles[tileKey(a_tileX, a_tileY)] = a_slot;
+}
+
+void StreamedTerrain::updateResidency(const glm::vec2& a_cameraPosition) const {
+  struct Candidate {
+    uint32_t m_tileX;
+    uint32_t m_tileY;
+    float m_distance;
+  };
+
+  const int32_t radius = RESIDENCY_RADIUS;
+  const float size = m_map->tileWorldSize();
+  const int32_t cameraX = glm::clamp(int32_t(a_cameraPosition.x / size), 0,
+                                     int32_t(m_map->tilesX()) - 1);
+  const int32_t cameraY = glm::clamp(int32_t(a_cameraPosition.y / size), 0,
+                                     int32_t(m_map->tilesY()) - 1);
+
+  std::vector<Candidate> candidates;
+  for (int32_t y = std::max(0, cameraY - radius);
+       y <= std::min(int32_t(m_map->tilesY()) - 1, cameraY + radius); ++y) {
+    for (int32_t x = std::max(0, cameraX - radius);
+         x <= std::min(int32_t(m_map->tilesX()) - 1, cameraX + radius); ++x) {
+      candidates.push_back(
+          Candidate{uint32_t(x), uint32_t(y),
+                    tileDistanceSquared(x, y, a_cameraPosition)});
+    }
+  }
+
+  std::sort(candidates.begin(), candidates.end(),
+            [](const Candidate& a, const Candidate& b) {
+              return a.m_distance < b.m_distance;
+            });
+
+  uint32_t uploads = 0;
+  for (const auto& candidate : candidates) {
+    if (m_residentTiles.count(tileKey(candidate.m_tileX, candidate.m_tileY)))
+      continue;
+
+    // Out of budget for this frame, but let the kernel start reading it.
+    if (uploads == MAX_UPLOADS_PER_FRAME) {
+      m_map->prefetch(candidate.m_tileX, candidate.m_tileY);
+      continue;
+    }
+
+    // Take a free slot, or evict the farthest tile.
+    uint32_t victim = 0;
+    float victimDistance = -1.0f;
+    for (uint32_t i = 0; i < m_slots.size(); ++i) {
+      const Slot& slot = m_slots[i];
+      if (!slot.m_used) {
+        victim = i;
+        victimDistance = std::numeric_limits<float>::infinity();
+        break;
+      }
+
+      float distance =
+          tileDistanceSquared(slot.m_tileX, slot.m_tileY, a_cameraPosition);
+      if (distance > victimDistance) {
+        victim = i;
+        victimDistance = distance;
+      }
+    }
+
+    // Everything resident is closer than this, and candidates are sorted, so
+    // we're done.
+    if (victimDistance <= candidate.m_distance)
+      break;
+
+    Slot& slot = m_slots[victim];
+    if (slot.m_used) {
+      m_residentTiles.erase(tileKey(slot.m_tileX, slot.m_tileY));
+      m_map->release(slot.m_tileX, slot.m_tileY);
+    }
+
+    upload(victim, candidate.m_tileX, candidate.m_tileY);
+    ++uploads;
+  }
+
+  if (uploads)
+    LOG("StreamedTerrain: %u tiles uploaded, %zu resident", uploads,
+        m_residentTiles.size());
+}
+
+void StreamedTerrain::drawTerrain(const Scene& scene) const {
+  AutoGLErrorChecker checker;
+
+  glm::vec4 camera =
+      glm::inverse(transform()) * glm::vec4(scene.cameraPosition(), 1.0f);
+  updateResidency(glm::vec2(camera.x, camera.z));
+
+  Frustum frustum =
+      Frustum::fromMatrix(scene.viewProjection()).inLocalSpace(transform());
+
+  const float size = m_map->tileWorldSize();
+  m_instances.clear();
+  for (uint32_t i = 0; i < m_slots.size(); ++i) {
+    const Slot& slot = m_slots[i];
+    if (!slot.m_used)
+      continue;
+
+    glm::vec2 offset = glm::vec2(slot.m_tileX, slot.m_tileY) * size;
+    AABB bounds(glm::vec3(offset.x, slot.m_heightBounds.x, offset.y),
+                glm::vec3(offset.x + size, slot.m_heightBounds.y,
+                          offset.y + size));
+    if (!frustum.intersects(bounds))
+      continue;
+
+    TileInstance instance;
+    instance.m_tile = glm::vec4(offset, size, i);
+    m_instances.push_back(instance);
+  }
+
+  if (m_instances.empty())
+    return;
+
+  // Orphan the previous contents so we don't stall on the previous frame.
+  glBindBuffer(GL_ARRAY_BUFFER, m_instancesVBO);
+  glBufferData(GL_ARRAY_BUFFER, sizeof(TileInstance) * m_instances.size(),
+               nullptr, GL_STREAM_DRAW);
+  glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(TileInstance) * m_instances.size(),
+                  m_instances.data());
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+  m_program->use();
+  scene.uploadPassUniforms(scene.viewProjection(), false);
+  glCullFace(GL_BACK);
+  glBindVertexArray(m_vao);
+
+  glUniformMatrix4fv(m_uniforms.uModel, 1, GL_FALSE,
+                     glm::value_ptr(transform()));
+  glUniform1i(m_uniforms.uTileQuads, TILE_QUADS);
+  // Repeat the cover every TERRAIN_DIMENSIONS units, like the other terrains.
+  glUniform1f(m_uniforms.uCoverScale, 2.0f / TERRAIN_DIMENSIONS);
+
+  glActiveTexture(GL_TEXTURE0);
+  glBindTexture(GL_TEXTURE_2D, m_coverTexture);
+
+  glActiveTexture(GL_TEXTURE0 + 1);
+  glBindTexture(GL_TEXTURE_2D_ARRAY, m_tileCache);
+
+  if (scene.shadowMap()) {
+    glActiveTexture(GL_TEXTURE0 + 2);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, *scene.shadowMap());
+  }
+
+  glUniform1i(m_uniforms.uCover, 0);
+  glUniform1i(m_uniforms.uHeightTiles, 1);
+  glUniform1i(m_uniforms.uShadowMap, 2);
+
+  glDrawElementsInstanced(GL_TRIANGLES, m_grid->indexCount(),
+                          m_grid->indexType(), m_grid->indexOffset(),
+                          m_instances.size());
+
+  glBindVertexArray(0);
+  glUseProgram(0);
+  glEnable(GL_CULL_FACE);
+}
+
+void StreamedTerrain::touchForQuery(float x, float y) const {
+  uint32_t tileX, tileY;
+  m_map->tileAt(x, y, tileX, tileY);
+  const uint64_t key = tileKey(tileX, tileY);
+  if (m_residentTiles.count(key))
+    return;
+
+  auto existing = std::find(m_queryTiles.begin(), m_queryTiles.end(), key);
+  if (existing != m_queryTiles.end()) {
+    std::rotate(m_queryTiles.begin(), existing, existing + 1);
+    return;
+  }
+
+  if (m_queryTiles.size() == MAX_QUERY_TILES) {
+    uint64_t oldest = m_queryTiles.back();
+    m_queryTiles.pop_back();
+    // It may have become resident since, in which case we still need it.
+    if (!m_residentTiles.count(oldest))
+      m_map->release(uint32_t(oldest), uint32_t(oldest >> 32));
+  }
+  m_queryTiles.insert(m_queryTiles.begin(), key);
+}
+
+float StreamedTerrain::heightAt(float x, float y) const {
+  touchForQuery(x, y);
+  return m_map->heightAt(x, y);
+}
+
+Optional<float> StreamedTerrain::raycast(const Ray& a_ray) const {
+  // TODO: A pyramid per tile would let us skip most of the samples, but rays
+  // over this terrain are rare enough for now.
+  return marchRay(a_ray, m_map->worldSize(), m_map->sampleSpacing());
+}
@@ -0,0 +1,138 @@
+#pragma once
+
+#include "base/gl.h"
+#include "base/ITerrain.h"
+#include "base/Program.h"
+#include "base/TiledHeightMap.h"
+#include "geometry/Node.h"
+
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+class PatchGrid;
+class Scene;
+
+/**
+ * A terrain streamed from a TiledHeightMap, for maps that don't fit in memory.
+ *
+ * Only the tiles around the camera are resident: their samples are uploaded
+ * to a fixed-size texture array (the GPU tile cache), and their pages are
+ * kept in memory for heightAt(). When a closer tile is needed and the cache
+ * is full, the resident tile farthest from the camera is evicted, and its
+ * pages are handed back to the kernel.
+ *
+ * Height queries out of the resident tiles read the map too, but only keep
+ * the last MAX_QUERY_TILES tiles they touched mapped in, so the CPU memory
+ * stays bounded by MAX_RESIDENT_TILES + MAX_QUERY_TILES, and the GPU memory by
+ * MAX_RESIDENT_TILES, regardless of the size of the map.
+ *
+ * Each resident tile is drawn as an instance of a shared PatchGrid, and heights
+ * are fetched in the vertex shader.
+ */
+class StreamedTerrain final : public Node, public ITerrain {
+public:
+  // The number of quads on each side of a tile.
+  static const uint32_t TILE_QUADS = 64;
+
+  // The size of the GPU tile cache.
+  static const uint32_t MAX_RESIDENT_TILES = 64;
+
+  // How many tiles around the camera we want resident, in each direction.
+  static const uint32_t RESIDENCY_RADIUS = 3;
+
+  // Caps the work done in a single frame, the rest waits for the next ones.
+  static const uint32_t MAX_UPLOADS_PER_FRAME = 4;
+
+  // How many non-resident tiles height queries keep paged in.
+  static const uint32_t MAX_QUERY_TILES = 4;
+
+private:
+  struct Uniforms {
+    GLint uModel;
+    GLint uCover;
+    GLint uHeightTiles;
+    GLint uShadowMap;
+    GLint uTileQuads;
+    GLint uCoverScale;
+
+    void query(const Program&);
+  };
+
+  // A layer of the tile cache.
+  struct Slot {
+    bool m_used;
+    uint32_t m_tileX;
+    uint32_t m_tileY;
+    // The min and max heights of the tile, for culling.
+    glm::vec2 m_heightBounds;
+  };
+
+  // The per-instance attributes of a drawn tile, see
+  // res/streamed-terrain/vertex.glsl.
+  struct TileInstance {
+    // Offset (xy) and size (z) in the terrain local space, and cache layer
+    // (w).
+    glm::vec4 m_tile;
+  };
+
+  std::unique_ptr<TiledHeightMap> m_map;
+  std::unique_ptr<Program> m_program;
+  Uniforms m_uniforms;
+
+  GLuint m_coverTexture;
+  // A GL_TEXTURE_2D_ARRAY with a layer per slot.
+  GLuint m_tileCache;
+
+  std::shared_ptr<PatchGrid> m_grid;
+  GLuint m_vao;
+  // Streamed every frame with the visible tiles.
+  GLuint m_instancesVBO;
+
+  // The residency state only changes when drawing, which is const.
+  mutable std::vector<Slot> m_slots;
+  // Maps a tile (see tileKey) to its slot.
+  mutable std::unordered_map<uint64_t, uint32_t> m_residentTiles;
+  mutable std::vector<TileInstance> m_instances;
+  // The non-resident tiles height queries touched (see tileKey), the most
+  // recent first.
+  mutable std::vector<uint64_t> m_queryTiles;
+
+  StreamedTerrain(std::unique_ptr<TiledHeightMap>,
+                  std::unique_ptr<Program>,
+                  GLuint a_cover);
+
+  static uint64_t tileKey(uint32_t a_tileX, uint32_t a_tileY) {
+    return (uint64_t(a_tileY) << 32) | a_tileX;
+  }
+
+  float tileDistanceSquared(uint32_t a_tileX,
+                            uint32_t a_tileY,
+                            const glm::vec2& a_position) const;
+  void updateResidency(const glm::vec2& a_cameraPosition) const;
+  void upload(uint32_t a_slot, uint32_t a_tileX, uint32_t a_tileY) const;
+
+  // Called before reading the tile with (x, y) for a height query, to page
+  // out the least recently queried one if there are too many.
+  void touchForQuery(float x, float y) const;
+
+public:
+  virtual ~StreamedTerrain();
+  static std::unique_ptr<StreamedTerrain> create();
+
+  virtual void drawTerrain(const Scene&) const override;
+  // The terrain doesn't cast shadows, but receives the ones of the objects.
+  virtual bool wantsShadowMap() const override {
+    return true;
+  }
+  virtual float heightAt(float x, float y) const override;
+  virtual Optional<float> raycast(const Ray&) const override;
+
+  size_t residentTileCount() const {
+    return m_residentTiles.size();
+  }
+
+  void draw(DrawContext&) const override {
+    assert(false && "not implemented! use drawTerrain instead!");
+  }
+};
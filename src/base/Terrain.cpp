@@ -1,35 +1,264 @@
 #include "base/Terrain.h"
+#include "base/ErrorChecker.h"
 #include "base/Logging.h"
 #include "base/Scene.h"
+#include "base/TerrainCache.h"
 #include "geometry/DrawContext.h"
+#include "geometry/MaterialTable.h"
 #include "tools/Optional.h"
 
-static inline float mapToHeight(uint8_t byte) {
-  // Map byte from 255 to 0, to +0.25/-0.25
-  float portion = ((float)byte) / 255;
-  return (portion - 0.5) / 3;
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <thread>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// FIXME: Stop hardcoding, the usual stuff.
+static const char* HEIGHTMAP_PATH = "res/terrain/heightmap.png";
+static const char* COVER_PATH = "res/terrain/cover.png";
+static const char* CACHE_PATH = "res/terrain/terrain.cache";
+
+// Maps the [0..1] heightmap value to [-1/6..1/6], this needs to be kept in
+// sync with getHeight in res/dyn-terrain/common.glsl.
+static HeightField decodeHeightMap(const sf::Image& heightMap) {
+  return HeightField::fromImage(heightMap, 1.0f / 3.0f, -0.5f / 3.0f);
 }
 
-Terrain::Terrain(std::vector<Vertex>&& vertices,
-                 std::vector<GLuint>&& indices,
-                 sf::Image&& heightMap,
+Terrain::Terrain(ArrayView<const Vertex> vertices,
+                 ArrayView<const GLushort> chunkIndices,
+                 std::vector<TerrainChunk>&& chunks,
+                 HeightField&& heightField,
                  Material material,
                  Optional<GLuint> texture)
-  : Mesh(std::move(vertices), std::move(indices), material, std::move(texture))
-  , m_heightMap(std::move(heightMap)) {}
+  : m_heightField(std::move(heightField))
+  , m_pyramid(m_heightField)
+  , m_chunks(std::move(chunks))
+  , m_material(material)
+  , m_materialIndex(MaterialTable::DEFAULT_MATERIAL)
+  , m_texture(std::move(texture))
+  , m_vertexCount(vertices.size())
+  , m_chunkIndexCount(chunkIndices.size()) {
+  AutoGLErrorChecker checker;
+  glGenVertexArrays(1, &m_vao);
+  glBindVertexArray(m_vao);
+
+  glGenBuffers(1, &m_vbo);
+  glGenBuffers(1, &m_ebo);
+
+  glBindBuffer(GL_ARRAY_BUFFER, m_vbo);
+  glBufferData(GL_ARRAY_BUFFER, sizeof(Vertex) * vertices.size(),
+               vertices.data(), GL_STATIC_DRAW);
+
+  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_ebo);
+  glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(GLushort) * chunkIndices.size(),
+               chunkIndices.data(), GL_STATIC_DRAW);
+
+#define INT_TO_GLVOID(i) ((GLvoid*)i)
+  glEnableVertexAttribArray(0);
+  glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex),
+                        INT_TO_GLVOID(offsetof(Vertex, m_position)));
+  glEnableVertexAttribArray(1);
+  glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex),
+                        INT_TO_GLVOID(offsetof(Vertex, m_normal)));
+  glEnableVertexAttribArray(2);
+  glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex),
+                        INT_TO_GLVOID(offsetof(Vertex, m_uv)));
+#undef INT_TO_GLVOID
+
+  glBindVertexArray(0);
+}
+
+Terrain::~Terrain() {
+  AutoGLErrorChecker checker;
+  if (m_texture)
+    glDeleteTextures(1, &*m_texture);
+  glDeleteVertexArrays(1, &m_vao);
+  glDeleteBuffers(1, &m_vbo);
+  glDeleteBuffers(1, &m_ebo);
+}
+
+// The index buffer shared by all the chunks, two triangles per quad, using
+// something similar to:
+// http://www.3dgep.com/multi-textured-terrain-in-opengl/
+static std::vector<GLushort> makeChunkIndices() {
+  const uint32_t stride = TERRAIN_CHUNK_QUADS + 1;
+
+  std::vector<GLushort> indices;
+  indices.reserve(TERRAIN_CHUNK_QUADS * TERRAIN_CHUNK_QUADS * 6);
+  for (uint32_t z = 0; z < TERRAIN_CHUNK_QUADS; ++z) {
+    for (uint32_t x = 0; x < TERRAIN_CHUNK_QUADS; ++x) {
+      GLushort i = z * stride + x;
+      indices.push_back(i);
+      indices.push_back(i + stride);
+      indices.push_back(i + stride + 1);
+
+      indices.push_back(i);
+      indices.push_back(i + stride + 1);
+      indices.push_back(i + 1);
+    }
+  }
+  return indices;
+}
+
+// Writes one row of a chunk, that is, TERRAIN_CHUNK_QUADS + 1 vertices
+// starting at column a_x0 of row a_y of the heightfield, clamped to its edges.
+//
+// Normals are computed with central differences over the heightfield (or
+// one-sided ones at its edges), so they're smooth and consistent across
+// chunks.
+static void buildVertexRow(const HeightField& a_field,
+                           uint32_t a_y,
+                           uint32_t a_x0,
+                           Vertex* a_out,
+                           AABB& a_bounds) {
+  const uint32_t count = TERRAIN_CHUNK_QUADS + 1;
+  const uint32_t width = a_field.width();
+  const uint32_t height = a_field.height();
+
+  const uint32_t up = a_y > 0 ? a_y - 1 : a_y;
+  const uint32_t down = a_y < height - 1 ? a_y + 1 : a_y;
+  const float* row = a_field.data() + size_t(a_y) * width;
+  const float* rowUp = a_field.data() + size_t(up) * width;
+  const float* rowDown = a_field.data() + size_t(down) * width;
+
+  // Derivatives are in the terrain's local space, where the whole heightfield
+  // is one unit wide.
+  const float scaleZ = float(height) / (down - up);
+
+  float heights[count];
+  float normalsX[count];
+  float normalsY[count];
+  float normalsZ[count];
+
+#if defined(__SSE2__)
+  const __m128 one = _mm_set1_ps(1.0f);
+  const __m128 zero = _mm_setzero_ps();
+  const __m128 centralScaleX = _mm_set1_ps(width * 0.5f);
+  const __m128 scaleZVector = _mm_set1_ps(scaleZ);
+#endif
+
+  uint32_t column = 0;
+  while (column < count) {
+    const uint32_t x = a_x0 + column;
+#if defined(__SSE2__)
+    // Four vertices at once, as long as all their neighbours are in bounds.
+    if (column + 4 <= count && x >= 1 && x + 4 <= width - 1) {
+      __m128 left = _mm_loadu_ps(row + x - 1);
+      __m128 right = _mm_loadu_ps(row + x + 1);
+      __m128 gradientX = _mm_mul_ps(_mm_sub_ps(right, left), centralScaleX);
+      __m128 gradientZ = _mm_mul_ps(
+          _mm_sub_ps(_mm_loadu_ps(rowDown + x), _mm_loadu_ps(rowUp + x)),
+          scaleZVector);
+
+      __m128 lengthSquared =
+          _mm_add_ps(_mm_add_ps(_mm_mul_ps(gradientX, gradientX), one),
+                     _mm_mul_ps(gradientZ, gradientZ));
+      __m128 inverseLength = _mm_div_ps(one, _mm_sqrt_ps(lengthSquared));
+
+      _mm_storeu_ps(heights + column, _mm_loadu_ps(row + x));
+      _mm_storeu_ps(normalsX + column,
+                   _mm_sub_ps(zero, _mm_mul_ps(gradientX, inverseLength)));
+      _mm_storeu_ps(normalsY + column, inverseLength);
+      _mm_storeu_ps(normalsZ + column,
+                   _mm_sub_ps(zero, _mm_mul_ps(gradientZ, inverseLength)));
+      column += 4;
+      continue;
+    }
+#endif
+    const uint32_t clampedX = std::min(x, width - 1);
+    const uint32_t left = clampedX > 0 ? clampedX - 1 : clampedX;
+    const uint32_t right = clampedX < width - 1 ? clampedX + 1 : clampedX;
+
+    float gradientX = (row[right] - row[left]) * width / (right - left);
+    float gradientZ = (rowDown[clampedX] - rowUp[clampedX]) * scaleZ;
+    float inverseLength =
+        1.0f / std::sqrt(gradientX * gradientX + 1.0f + gradientZ * gradientZ);
+
+    heights[column] = row[clampedX];
+    normalsX[column] = -gradientX * inverseLength;
+    normalsY[column] = inverseLength;
+    normalsZ[column] = -gradientZ * inverseLength;
+    ++column;
+  }
+
+  const float posY = float(a_y) / height;
+  for (column = 0; column < count; ++column) {
+    const uint32_t x = std::min(a_x0 + column, width - 1);
+    const float posX = float(x) / width;
+
+    Vertex& vertex = a_out[column];
+    vertex.m_position = glm::vec3(posX - 0.5f, heights[column], posY - 0.5f);
+    vertex.m_normal =
+        glm::vec3(normalsX[column], normalsY[column], normalsZ[column]);
+    vertex.m_uv = glm::vec2(posY, posX);
+    a_bounds.extend(vertex.m_position);
+  }
+}
+
+// FIXME: Nor this!
+static Material terrainMaterial() {
+  Material mat;
+  mat.m_diffuse = glm::vec4(140.0, 96.0, 43.0, 255.0f) / glm::vec4(255.0f);
+  mat.m_ambient = glm::vec4(1.0, 1.0, 1.0, 1.0);
+  mat.m_shininess_percent = 0.1;
+  return mat;
+}
+
+/* static */ std::unique_ptr<Terrain> Terrain::fromCache(
+    const TerrainCache& cache) {
+  auto vertices = cache.view<Vertex>("vertices");
+  auto chunkIndices = cache.view<GLushort>("indices");
+  auto chunks = cache.view<TerrainChunk>("chunks");
+  auto heights = cache.view<float>("heights");
+  const TerrainCache::Section* heightsSection = cache.find("heights");
+  if (vertices.empty() || chunkIndices.empty() || chunks.empty() ||
+      heights.empty() ||
+      heights.size() != size_t(heightsSection->m_params[0]) *
+                            heightsSection->m_params[1])
+    return nullptr;
+
+  GLuint texture = cache.texture("cover");
+  if (!texture)
+    return nullptr;
+
+  HeightField heightField(
+      heightsSection->m_params[0], heightsSection->m_params[1],
+      std::vector<float>(heights.begin(), heights.end()));
+
+  LOG("Loaded terrain from cache: %zu vertices, %zu chunks", vertices.size(),
+      chunks.size());
+
+  auto terrain = std::unique_ptr<Terrain>(new Terrain(
+      vertices, chunkIndices,
+      std::vector<TerrainChunk>(chunks.begin(), chunks.end()),
+      std::move(heightField), terrainMaterial(), Some(texture)));
+  terrain->scale(TERRAIN_DIMENSIONS);
+  return terrain;
+}
 
 /* static */ std::unique_ptr<Terrain> Terrain::create() {
+  // Anything that changes the cooked data needs to be part of the key.
+  const uint64_t cacheKey = TerrainCache::hashFiles(
+      {HEIGHTMAP_PATH, COVER_PATH}, TERRAIN_CHUNK_QUADS);
+  if (auto cache = TerrainCache::open(CACHE_PATH, cacheKey)) {
+    if (auto terrain = fromCache(*cache))
+      return terrain;
+    WARN("Incomplete terrain cache, rebuilding it");
+  }
+
   sf::Image heightMap;
   sf::Image textureImporter;
 
-  // FIXME: Stop hardcoding, the usual stuff.
-  if (!heightMap.loadFromFile("res/terrain/heightmap.png")) {
+  if (!heightMap.loadFromFile(HEIGHTMAP_PATH)) {
     // if (!heightMap.loadFromFile("res/terrain/maribor.png")) {
     ERROR("Error loading heightmap");
     return nullptr;
   }
 
-  if (!textureImporter.loadFromFile("res/terrain/cover.png")) {
+  if (!textureImporter.loadFromFile(COVER_PATH)) {
     ERROR("Error loading terrain texture");
     return nullptr;
   }
@@ -52,67 +281,78 @@ Terrain::Terrain(std::vector<Vertex>&& vertices,
     glBindTexture(GL_TEXTURE_2D, 0);
   }
 
-  auto size = heightMap.getSize();
-  std::vector<Vertex> vertices;
-  vertices.reserve(size.x * size.y);
-
-  LOG("Loading terrain from file: %ux%u pixels", size.x, size.y);
+  auto start = std::chrono::steady_clock::now();
 
-  for (uint32_t x = 0; x < size.x; ++x) {
-    for (uint32_t y = 0; y < size.y; ++y) {
-      float posX = ((float)x) / size.x;
-      float posY = ((float)y) / size.y;
+  HeightField heightField = decodeHeightMap(heightMap);
 
-      auto pixel = heightMap.getPixel(x, y);
-      float height = mapToHeight(pixel.r);
+  auto size = heightMap.getSize();
+  const uint32_t stride = TERRAIN_CHUNK_QUADS + 1;
+  const uint32_t chunksX =
+      (size.x - 1 + TERRAIN_CHUNK_QUADS - 1) / TERRAIN_CHUNK_QUADS;
+  const uint32_t chunksY =
+      (size.y - 1 + TERRAIN_CHUNK_QUADS - 1) / TERRAIN_CHUNK_QUADS;
 
-      Vertex vertex;
-      vertex.m_position = glm::vec3(posX - 0.5, height, posY - 0.5);
-      vertex.m_uv = glm::vec2(posY, posX);
-      vertices.push_back(vertex);
-    }
-  }
+  LOG("Loading terrain from file: %ux%u pixels, %ux%u chunks", size.x, size.y,
+      chunksX, chunksY);
 
-  // Two triangles per quad.
-  std::vector<GLuint> indices;
-  uint32_t triangleCount = (size.x - 1) * (size.y - 1) * 2;
-  indices.reserve(triangleCount * 3);
+  std::vector<GLushort> chunkIndices = makeChunkIndices();
+  std::vector<TerrainChunk> chunks(chunksX * chunksY);
+  std::vector<Vertex> vertices(chunks.size() * stride * stride);
 
-  // Now we generate triangles, two per quad, using something similar to:
-  // http://www.3dgep.com/multi-textured-terrain-in-opengl/
-  for (uint32_t x = 0; x < size.x - 1; ++x) {
-    for (uint32_t y = 0; y < size.y - 1; ++y) {
-      uint32_t i = (y * size.x) + x;
-      indices.push_back(i);
-      indices.push_back(i + 1);
-      indices.push_back(i + size.x + 1);
+  // Chunks at the right and bottom edges may be smaller than the rest, we
+  // clamp them to the last pixel, which makes their trailing triangles
+  // degenerate, in order to keep sharing the index buffer.
+  //
+  // Every chunk owns a fixed range of the vertex buffer, so bands of chunk
+  // rows can be built in parallel without any synchronization.
+  auto buildBand = [&](uint32_t a_firstChunkY, uint32_t a_lastChunkY) {
+    for (uint32_t chunkY = a_firstChunkY; chunkY < a_lastChunkY; ++chunkY) {
+      for (uint32_t chunkX = 0; chunkX < chunksX; ++chunkX) {
+        TerrainChunk& chunk = chunks[chunkY * chunksX + chunkX];
+        chunk.m_baseVertex = (chunkY * chunksX + chunkX) * stride * stride;
 
-      indices.push_back(i);
-      indices.push_back(i + size.x + 1);
-      indices.push_back(i + size.x);
+        for (uint32_t row = 0; row < stride; ++row) {
+          uint32_t y =
+              std::min(chunkY * TERRAIN_CHUNK_QUADS + row, size.y - 1);
+          buildVertexRow(heightField, y, chunkX * TERRAIN_CHUNK_QUADS,
+                         &vertices[chunk.m_baseVertex + row * stride],
+                         chunk.m_bounds);
+        }
+      }
     }
-  }
+  };
 
-  // FIXME: Don't duplicate this code with the importer!
-  for (size_t i = 0; i < indices.size(); i += 3) {
-    GLuint i_1 = indices[i];
-    GLuint i_2 = indices[i + 1];
-    GLuint i_3 = indices[i + 2];
-    vertices[i_1].m_normal = vertices[i_2].m_normal = vertices[i_3].m_normal =
-        glm::normalize(
-            glm::cross(vertices[i_2].m_position - vertices[i_1].m_position,
-                       vertices[i_3].m_position - vertices[i_1].m_position));
-  }
+  const uint32_t threadCount =
+      std::max(1u, std::min(std::thread::hardware_concurrency(), chunksY));
+  std::vector<std::thread> workers;
+  for (uint32_t i = 1; i < threadCount; ++i)
+    workers.emplace_back(buildBand, chunksY * i / threadCount,
+                         chunksY * (i + 1) / threadCount);
+  buildBand(0, chunksY / threadCount);
+  for (auto& worker : workers)
+    worker.join();
 
-  // FIXME: Nor this!
-  Material mat;
-  mat.m_diffuse = glm::vec4(140.0, 96.0, 43.0, 255.0f) / glm::vec4(255.0f);
-  mat.m_ambient = glm::vec4(1.0, 1.0, 1.0, 1.0);
-  mat.m_shininess_percent = 0.1;
+  auto end = std::chrono::steady_clock::now();
+  LOG("Built terrain mesh of %zu vertices in %.2fms using %u threads",
+      vertices.size(),
+      std::chrono::duration<double, std::milli>(end - start).count(),
+      threadCount);
+
+  TerrainCache::Writer cacheWriter;
+  cacheWriter.add("vertices", View(vertices.data(), vertices.size()));
+  cacheWriter.add("indices", View(chunkIndices.data(), chunkIndices.size()));
+  cacheWriter.add("chunks", View(chunks.data(), chunks.size()));
+  cacheWriter.add("heights",
+                  View(heightField.data(),
+                       size_t(heightField.width()) * heightField.height()),
+                  {heightField.width(), heightField.height()});
+  cacheWriter.addTexture("cover", texture);
+  cacheWriter.write(CACHE_PATH, cacheKey);
 
-  auto terrain = std::unique_ptr<Terrain>(
-      new Terrain(std::move(vertices), std::move(indices), std::move(heightMap),
-                  mat, Some(texture)));
+  auto terrain = std::unique_ptr<Terrain>(new Terrain(
+      View(vertices.data(), vertices.size()),
+      View(chunkIndices.data(), chunkIndices.size()), std::move(chunks),
+      std::move(heightField), terrainMaterial(), Some(texture)));
 
   // TODO: Add collision detection boxes, shouldn't be hard.
   terrain->scale(TERRAIN_DIMENSIONS);
@@ -125,15 +365,67 @@ void Terrain::drawTerrain(const Scene& scene) const {
   draw(context);
 }
 
+void Terrain::draw(DrawContext& context) const {
+  AutoGLErrorChecker checker;
+  context.push(*this);
+
+  glUniform1i(context.uniforms().m_materialIndex, m_materialIndex);
+  glUniform1i(context.uniforms().m_instanced, false);
+  glUniform1i(context.uniforms().m_usesTexture, m_texture.isSome());
+  if (m_texture) {
+    glUniform1i(context.uniforms().m_texture, 0);
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, *m_texture);
+  }
+
+  // Test the chunks in our local space, so we don't need to transform their
+  // bounds.
+  Frustum frustum = context.frustum().inLocalSpace(context.transform());
+  GLenum mode =
+      context.program().tessControlShader() ? GL_PATCHES : GL_TRIANGLES;
+  if (mode == GL_PATCHES)
+    glPatchParameteri(GL_PATCH_VERTICES, 3);
+
+  glBindVertexArray(m_vao);
+  for (const auto& chunk : m_chunks) {
+    if (!frustum.intersects(chunk.m_bounds))
+      continue;
+    glDrawElementsBaseVertex(mode, m_chunkIndexCount, GL_UNSIGNED_SHORT,
+                             nullptr, chunk.m_baseVertex);
+  }
+  glBindVertexArray(0);
+
+  context.pop();
+}
+
+void Terrain::registerMaterials(MaterialTable& a_table) {
+  m_materialIndex = a_table.add(m_material);
+  Node::registerMaterials(a_table);
+}
+
+AABB Terrain::worldBounds() const {
+  glm::vec2 heights = m_pyramid.heightRange();
+  return AABB(glm::vec3(-0.5f, heights.x, -0.5f),
+              glm::vec3(0.5f, heights.y, 0.5f))
+      .transformed(transform());
+}
+
 float Terrain::heightAt(float x, float y) const {
-  assert(x < TERRAIN_DIMENSIONS);
-  assert(y < TERRAIN_DIMENSIONS);
-  float x_ = x / TERRAIN_DIMENSIONS;
-  float y_ = y / TERRAIN_DIMENSIONS;
-  auto size = m_heightMap.getSize();
-
-  // This is kind of fiddly, because we're duplicating the stuff that is in the
-  // fragment shader, but oh well.
-  float v = m_heightMap.getPixel(x_ * size.x, y_ * size.y).g / 255.0f;
-  return (v - 0.5) / 3.0 * TERRAIN_DIMENSIONS;
+  return m_heightField.sample(x / TERRAIN_DIMENSIONS, y / TERRAIN_DIMENSIONS) *
+         TERRAIN_DIMENSIONS;
+}
+
+void Terrain::heightsAt(ArrayView<const glm::vec2> a_points,
+                        ArrayView<float> a_out) const {
+  m_heightField.sampleMany(a_points, a_out, 1.0f / TERRAIN_DIMENSIONS,
+                           TERRAIN_DIMENSIONS);
+}
+
+Optional<float> Terrain::raycast(const Ray& a_ray) const {
+  return m_pyramid.raycast(a_ray, 1.0f / TERRAIN_DIMENSIONS);
+}
+
+void Terrain::raycastMany(ArrayView<const Ray> a_rays,
+                          ArrayView<Optional<float>> a_out) const {
+  m_pyramid.raycastMany(a_rays, a_out, 1.0f / TERRAIN_DIMENSIONS);
 }
@@ -1,29 +1,86 @@
 #pragma once
 
 #include "base/Program.h"
+#include "base/HeightField.h"
+#include "base/HeightFieldPyramid.h"
 #include "base/ITerrain.h"
-#include "geometry/Mesh.h"
+#include "geometry/AABB.h"
+#include "geometry/Material.h"
+#include "geometry/Node.h"
+#include "geometry/Vertex.h"
 
+#include <memory>
+#include <vector>
 #include <SFML/Graphics.hpp>
 
 const size_t TERRAIN_DIMENSIONS = 100;
 
-class Terrain final : public ITerrain, public Mesh {
-  Terrain(std::vector<Vertex>&& vertices,
-          std::vector<GLuint>&& indices,
-          sf::Image&& heightMap,
+/**
+ * The number of quads in each side of a terrain chunk.
+ *
+ * A chunk has (TERRAIN_CHUNK_QUADS + 1)^2 vertices, which must be addressable
+ * with 16-bit indices.
+ */
+const uint32_t TERRAIN_CHUNK_QUADS = 64;
+static_assert((TERRAIN_CHUNK_QUADS + 1) * (TERRAIN_CHUNK_QUADS + 1) <= 65536,
+              "Chunk vertices must be addressable with GLushort");
+
+/**
+ * A piece of the terrain mesh.
+ *
+ * All chunks have the same topology, so they share the index buffer, and just
+ * point to their own range of the vertex buffer.
+ */
+struct TerrainChunk {
+  // The bounds of the chunk, in the terrain's local space.
+  AABB m_bounds;
+  // The first vertex of this chunk in the terrain vertex buffer.
+  GLint m_baseVertex;
+};
+
+class TerrainCache;
+
+class Terrain final : public ITerrain, public Node {
+  Terrain(ArrayView<const Vertex> vertices,
+          ArrayView<const GLushort> chunkIndices,
+          std::vector<TerrainChunk>&& chunks,
+          HeightField&& heightField,
           Material material,
           Optional<GLuint> texture);
 
-  sf::Image m_heightMap;
+  HeightField m_heightField;
+  HeightFieldPyramid m_pyramid;
+  std::vector<TerrainChunk> m_chunks;
+  Material m_material;
+  // See Mesh::m_materialIndex.
+  uint32_t m_materialIndex;
+  Optional<GLuint> m_texture;
+
+  size_t m_vertexCount;
+  size_t m_chunkIndexCount;
+
+  GLuint m_vao;
+  GLuint m_vbo;
+  GLuint m_ebo;
+
+  static std::unique_ptr<Terrain> fromCache(const TerrainCache&);
 
 public:
-  virtual ~Terrain() {}
+  virtual ~Terrain();
   static std::unique_ptr<Terrain> create();
 
   virtual bool hasCustomProgram() const override { return false; }
   virtual bool wantsShadowMap() const override { return true; }
   virtual void drawTerrain(const Scene&) const override;
   virtual void recomputeShadowMap(const Scene&) override {}
+  virtual AABB worldBounds() const override;
   virtual float heightAt(float x, float y) const override;
+  virtual void heightsAt(ArrayView<const glm::vec2>,
+                         ArrayView<float>) const override;
+  virtual Optional<float> raycast(const Ray&) const override;
+  virtual void raycastMany(ArrayView<const Ray>,
+                           ArrayView<Optional<float>>) const override;
+
+  void draw(DrawContext&) const override;
+  void registerMaterials(MaterialTable&) override;
 };
@@ -0,0 +1,302 @@
+#include "base/TerrainCache.h"
+
+#include "base/ErrorChecker.h"
+#include "base/Logging.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static const char MAGIC[4] = {'T', 'C', 'C', 'H'};
+
+namespace {
+struct Header {
+  char m_magic[4];
+  uint32_t m_version;
+  uint64_t m_key;
+  uint32_t m_sectionCount;
+  uint32_t m_padding;
+};
+}
+
+static size_t alignUp(size_t a_value) {
+  const size_t alignment = TerrainCache::SECTION_ALIGNMENT;
+  return (a_value + alignment - 1) / alignment * alignment;
+}
+
+// Maps a whole file read-only, returning null on failure.
+static const uint8_t* mapFile(const char* a_path, size_t& a_size) {
+  int fd = ::open(a_path, O_RDONLY);
+  if (fd < 0)
+    return nullptr;
+
+  struct stat info;
+  if (fstat(fd, &info) != 0 || info.st_size == 0) {
+    close(fd);
+    return nullptr;
+  }
+
+  a_size = info.st_size;
+  void* mapping = mmap(nullptr, a_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  return mapping == MAP_FAILED ? nullptr : static_cast<uint8_t*>(mapping);
+}
+
+// 64-bit FNV-1a.
+static const uint64_t FNV_OFFSET_BASIS = 0xcbf29ce484222325ull;
+static const uint64_t FNV_PRIME = 0x100000001b3ull;
+
+static uint64_t hashBytes(uint64_t a_hash,
+                          const uint8_t* a_data,
+                          size_t a_size) {
+  for (size_t i = 0; i < a_size; ++i) {
+    a_hash ^= a_data[i];
+    a_hash *= FNV_PRIME;
+  }
+  return a_hash;
+}
+
+void TerrainCache::Writer::add(const char* a_name,
+                               const void* a_data,
+                               size_t a_size,
+                               std::initializer_list<uint32_t> a_params) {
+  assert(strlen(a_name) < sizeof(Section::m_name));
+  assert(a_params.size() <= 4);
+
+  PendingSection pending;
+  memset(&pending.m_section, 0, sizeof(Section));
+  strncpy(pending.m_section.m_name, a_name, sizeof(Section::m_name) - 1);
+  pending.m_section.m_size = a_size;
+  std::copy(a_params.begin(), a_params.end(), pending.m_section.m_params);
+  pending.m_data = a_data;
+  m_sections.push_back(std::move(pending));
+}
+
+void TerrainCache::Writer::addTexture(const char* a_name, GLuint a_texture) {
+  AutoGLErrorChecker checker;
+  glBindTexture(GL_TEXTURE_2D, a_texture);
+
+  GLint width = 0;
+  GLint height = 0;
+  glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_WIDTH, &width);
+  glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_HEIGHT, &height);
+
+  // Levels that were never specified report a zero width.
+  std::vector<uint8_t> data;
+  uint32_t levels = 0;
+  while (true) {
+    GLint levelWidth = 0;
+    GLint levelHeight = 0;
+    glGetTexLevelParameteriv(GL_TEXTURE_2D, levels, GL_TEXTURE_WIDTH,
+                             &levelWidth);
+    glGetTexLevelParameteriv(GL_TEXTURE_2D, levels, GL_TEXTURE_HEIGHT,
+                             &levelHeight);
+    if (!levelWidth || !levelHeight)
+      break;
+
+    size_t offset = data.size();
+    data.resize(offset + size_t(levelWidth) * levelHeight * 4);
+    glGetTexImage(GL_TEXTURE_2D, levels, GL_RGBA, GL_UNSIGNED_BYTE,
+                  &data[offset]);
+    ++levels;
+
+    if (levelWidth == 1 && levelHeight == 1)
+      break;
+  }
+
+  glBindTexture(GL_TEXTURE_2D, 0);
+
+  add(a_name, nullptr, data.size(),
+      {uint32_t(width), uint32_t(height), levels});
+  m_sections.back().m_ownedData = std::move(data);
+  m_sections.back().m_data = m_sections.back().m_ownedData.data();
+}
+
+bool TerrainCache::Writer::write(const std::string& a_path,
+                                 uint64_t a_key) const {
+  Header header;
+  memset(&header, 0, sizeof(Header));
+  memcpy(header.m_magic, MAGIC, sizeof(MAGIC));
+  header.m_version = VERSION;
+  header.m_key = a_key;
+  header.m_sectionCount = m_sections.size();
+
+  std::vector<Section> table;
+  size_t offset =
+      alignUp(sizeof(Header) + sizeof(Section) * m_sections.size());
+  for (const auto& pending : m_sections) {
+    table.push_back(pending.m_section);
+    table.back().m_offset = offset;
+    offset = alignUp(offset + pending.m_section.m_size);
+  }
+
+  // Write to a temporary file first, so we never leave a truncated cache
+  // behind.
+  std::string temporaryPath = a_path + ".tmp";
+  {
+    std::ofstream out(temporaryPath, std::ios::binary | std::ios::trunc);
+    if (!out) {
+      WARN("Couldn't create terrain cache %s", a_path.c_str());
+      return false;
+    }
+
+    const char padding[SECTION_ALIGNMENT] = {0};
+    auto pad = [&]() {
+      size_t position = out.tellp();
+      out.write(padding, alignUp(position) - position);
+    };
+
+    out.write(reinterpret_cast<const char*>(&header), sizeof(Header));
+    out.write(reinterpret_cast<const char*>(table.data()),
+              sizeof(Section) * table.size());
+    pad();
+    for (const auto& pending : m_sections) {
+      out.write(static_cast<const char*>(pending.m_data),
+                pending.m_section.m_size);
+      pad();
+    }
+
+    if (!out) {
+      WARN("Failed to write terrain cache %s", a_path.c_str());
+      return false;
+    }
+  }
+
+  if (rename(temporaryPath.c_str(), a_path.c_str()) != 0) {
+    WARN("Failed to write terrain cache %s", a_path.c_str());
+    return false;
+  }
+
+  LOG("Wrote terrain cache %s (%zu bytes)", a_path.c_str(), offset);
+  return true;
+}
+
+TerrainCache::~TerrainCache() {
+  munmap(const_cast<uint8_t*>(m_mapping), m_mappingSize);
+}
+
+/* static */ uint64_t TerrainCache::hashFiles(
+    std::initializer_list<const char*> a_paths,
+    uint64_t a_salt) {
+  uint64_t hash = hashBytes(FNV_OFFSET_BASIS,
+                            reinterpret_cast<const uint8_t*>(&a_salt),
+                            sizeof(a_salt));
+  for (const char* path : a_paths) {
+    size_t size = 0;
+    const uint8_t* contents = mapFile(path, size);
+    // A missing file still needs to change the hash.
+    hash = hashBytes(hash, reinterpret_cast<const uint8_t*>(&size),
+                     sizeof(size));
+    if (!contents)
+      continue;
+    hash = hashBytes(hash, contents, size);
+    munmap(const_cast<uint8_t*>(contents), size);
+  }
+  return hash;
+}
+
+/* static */ std::unique_ptr<TerrainCache> TerrainCache::open(
+    const std::string& a_path,
+    uint64_t a_key) {
+  size_t size = 0;
+  const uint8_t* mapping = mapFile(a_path.c_str(), size);
+  if (!mapping) {
+    LOG("No terrain cache at %s", a_path.c_str());
+    return nullptr;
+  }
+
+  Header header;
+  bool valid = size >= sizeof(Header);
+  if (valid) {
+    memcpy(&header, mapping, sizeof(Header));
+    valid = !memcmp(header.m_magic, MAGIC, sizeof(MAGIC)) &&
+            header.m_version == VERSION && header.m_key == a_key &&
+            sizeof(Header) + sizeof(Section) * size_t(header.m_sectionCount) <=
+                size;
+  }
+
+  const Section* sections =
+      reinterpret_cast<const Section*>(mapping + sizeof(Header));
+  for (uint32_t i = 0; valid && i < header.m_sectionCount; ++i) {
+    valid = sections[i].m_offset <= size &&
+            sections[i].m_size <= size - sections[i].m_offset &&
+            memchr(sections[i].m_name, 0, sizeof(Section::m_name));
+  }
+
+  if (!valid) {
+    LOG("Stale or invalid terrain cache at %s", a_path.c_str());
+    munmap(const_cast<uint8_t*>(mapping), size);
+    return nullptr;
+  }
+
+  return std::unique_ptr<TerrainCache>(
+      new TerrainCache(mapping, size, sections, header.m_sectionCount));
+}
+
+const TerrainCache::Section* TerrainCache::find(const char* a_name) const {
+  for (uint32_t i = 0; i < m_sectionCount; ++i)
+    if (!strcmp(m_sections[i].m_name, a_name))
+      return &m_sections[i];
+  return nullptr;
+}
+
+GLuint TerrainCache::texture(const char* a_name) const {
+  const Section* section = find(a_name);
+  if (!section)
+    return 0;
+
+  const uint32_t width = section->m_params[0];
+  const uint32_t height = section->m_params[1];
+  const uint32_t levels = section->m_params[2];
+
+  // Make sure all the levels are there before touching GL.
+  size_t expectedSize = 0;
+  for (uint32_t level = 0; level < levels; ++level)
+    expectedSize += size_t(std::max(1u, width >> level)) *
+                    std::max(1u, height >> level) * 4;
+  if (!levels || expectedSize != section->m_size) {
+    WARN("Invalid texture %s in terrain cache", a_name);
+    return 0;
+  }
+
+  AutoGLErrorChecker checker;
+  GLuint ret;
+  glGenTextures(1, &ret);
+  glBindTexture(GL_TEXTURE_2D, ret);
+
+  const uint8_t* data = m_mapping + section->m_offset;
+  for (uint32_t level = 0; level < levels; ++level) {
+    uint32_t levelWidth = std::max(1u, width >> level);
+    uint32_t levelHeight = std::max(1u, height >> level);
+    glTexImage2D(GL_TEXTURE_2D, level, GL_RGBA, levelWidth, levelHeight, 0,
+                 GL_RGBA, GL_UNSIGNED_BYTE, data);
+    data += size_t(levelWidth) * levelHeight * 4;
+  }
+
+  const bool mipmaps = levels > 1;
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, levels - 1);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER,
+                  mipmaps ? GL_LINEAR_MIPMAP_LINEAR : GL_LINEAR);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+
+  if (mipmaps) {
+    glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_LOD_BIAS, -1.0f);
+
+    float maxAnisotropy;
+    glGetFloatv(GL_MAX_TEXTURE_MAX_ANISOTROPY_EXT, &maxAnisotropy);
+    float val = std::max(4.0f, maxAnisotropy);
+    glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAX_ANISOTROPY_EXT, val);
+  }
+
+  glBindTexture(GL_TEXTURE_2D, 0);
+  return ret;
+}
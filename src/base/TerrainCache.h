@@ -0,0 +1,131 @@
+#pragma once
+
+#include "base/gl.h"
+#include "tools/ArrayView.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <initializer_list>
+#include <memory>
+#include <string>
+#include <vector>
+
+/**
+ * A binary file with the already-processed data of a terrain (vertex and index
+ * buffers, decoded heights, textures with all their mip levels...), so
+ * subsequent launches don't need to decode images nor build meshes.
+ *
+ * The file is a header, a table of named sections, and the section contents,
+ * each aligned to SECTION_ALIGNMENT. It's memory-mapped, so the contents can
+ * go straight to glBufferData or glTexImage2D.
+ *
+ * The cache is keyed by a hash of its source files (see hashFiles()), and a
+ * cache with a different key or version is just ignored, so there's no need
+ * to invalidate it by hand.
+ */
+class TerrainCache final {
+public:
+  static const uint32_t VERSION = 1;
+  static const size_t SECTION_ALIGNMENT = 64;
+
+  struct Section {
+    char m_name[16];
+    uint64_t m_offset;
+    uint64_t m_size;
+    // Free-form metadata about the section, like the size of a texture.
+    uint32_t m_params[4];
+  };
+
+  /**
+   * Collects sections and writes them to disk.
+   *
+   * Data added with add() is not copied, so it must be alive until write() is
+   * called.
+   */
+  class Writer {
+    struct PendingSection {
+      Section m_section;
+      const void* m_data;
+      std::vector<uint8_t> m_ownedData;
+    };
+
+    std::vector<PendingSection> m_sections;
+
+  public:
+    void add(const char* a_name,
+             const void* a_data,
+             size_t a_size,
+             std::initializer_list<uint32_t> a_params = {});
+
+    template <typename T>
+    void add(const char* a_name,
+             const ArrayView<T>& a_data,
+             std::initializer_list<uint32_t> a_params = {}) {
+      add(a_name, a_data.data(), a_data.size() * sizeof(T), a_params);
+    }
+
+    /**
+     * Reads back all the levels of an RGBA texture, so it can be recreated
+     * with TerrainCache::texture().
+     */
+    void addTexture(const char* a_name, GLuint a_texture);
+
+    bool write(const std::string& a_path, uint64_t a_key) const;
+  };
+
+private:
+  const uint8_t* m_mapping;
+  size_t m_mappingSize;
+  const Section* m_sections;
+  uint32_t m_sectionCount;
+
+  TerrainCache(const uint8_t* a_mapping,
+               size_t a_mappingSize,
+               const Section* a_sections,
+               uint32_t a_sectionCount)
+    : m_mapping(a_mapping)
+    , m_mappingSize(a_mappingSize)
+    , m_sections(a_sections)
+    , m_sectionCount(a_sectionCount) {}
+
+public:
+  TerrainCache(const TerrainCache&) = delete;
+  ~TerrainCache();
+
+  /**
+   * Hashes the contents of the given files, along with a_salt, which callers
+   * should use for anything else that affects the cached data.
+   */
+  static uint64_t hashFiles(std::initializer_list<const char*> a_paths,
+                            uint64_t a_salt);
+
+  /**
+   * Maps the cache at a_path, returning null if it doesn't exist, or if it was
+   * generated with a different key or version.
+   */
+  static std::unique_ptr<TerrainCache> open(const std::string& a_path,
+                                            uint64_t a_key);
+
+  const Section* find(const char* a_name) const;
+
+  /**
+   * The contents of a section as an array of T, or an empty view if it
+   * doesn't exist.
+   */
+  template <typename T>
+  ArrayView<const T> view(const char* a_name) const {
+    const Section* section = find(a_name);
+    if (!section || section->m_size % sizeof(T))
+      return ArrayView<const T>(nullptr, 0);
+    return ArrayView<const T>(
+        reinterpret_cast<const T*>(m_mapping + section->m_offset),
+        section->m_size / sizeof(T));
+  }
+
+  /**
+   * Creates a texture from a section written with Writer::addTexture, with
+   * the same parameters as DynTerrain::textureFromImage. Returns zero if the
+   * section doesn't exist.
+   */
+  GLuint texture(const char* a_name) const;
+};
@@ -0,0 +1,215 @@
+#include "base/TiledHeightMap.h"
+
+#include "base/HeightField.h"
+#include "base/Logging.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <fstream>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static const char MAGIC[4] = {'H', 'T', 'I', 'L'};
+
+// The header lives alone in the first block, so every tile starts at a
+// multiple of TILE_ALIGNMENT.
+static const size_t TILES_OFFSET = TiledHeightMap::TILE_ALIGNMENT;
+
+static_assert(sizeof(TiledHeightMap::Header) <= TILES_OFFSET,
+              "The header must fit before the first tile");
+
+static size_t tileStrideFor(uint32_t a_tileQuads) {
+  const size_t samples = a_tileQuads + 1 + 2 * TiledHeightMap::TILE_APRON;
+  size_t bytes = samples * samples * sizeof(float);
+  const size_t alignment = TiledHeightMap::TILE_ALIGNMENT;
+  return (bytes + alignment - 1) / alignment * alignment;
+}
+
+TiledHeightMap::~TiledHeightMap() {
+  munmap(const_cast<uint8_t*>(m_mapping), m_mappingSize);
+}
+
+/* static */ std::unique_ptr<TiledHeightMap> TiledHeightMap::open(
+    const std::string& a_path) {
+  int fd = ::open(a_path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    LOG("Couldn't open tiled heightmap %s", a_path.c_str());
+    return nullptr;
+  }
+
+  struct stat info;
+  if (fstat(fd, &info) != 0 || size_t(info.st_size) < TILES_OFFSET) {
+    ERROR("Invalid tiled heightmap %s", a_path.c_str());
+    close(fd);
+    return nullptr;
+  }
+
+  size_t size = info.st_size;
+  void* mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  // The mapping keeps its own reference to the file.
+  close(fd);
+
+  if (mapping == MAP_FAILED) {
+    ERROR("Failed to map tiled heightmap %s", a_path.c_str());
+    return nullptr;
+  }
+
+  Header header;
+  memcpy(&header, mapping, sizeof(Header));
+
+  bool valid = !memcmp(header.m_magic, MAGIC, sizeof(MAGIC)) &&
+               header.m_version == VERSION && header.m_width > 1 &&
+               header.m_height > 1 && header.m_tileQuads > 0 &&
+               header.m_tileStride == tileStrideFor(header.m_tileQuads) &&
+               header.m_sampleSpacing > 0.0f &&
+               TILES_OFFSET + size_t(header.m_tilesX) * header.m_tilesY *
+                                      header.m_tileStride <=
+                   size;
+  if (!valid) {
+    ERROR("Invalid or outdated tiled heightmap %s", a_path.c_str());
+    munmap(mapping, size);
+    return nullptr;
+  }
+
+  // We read tiles in whatever order the camera wants them.
+  madvise(mapping, size, MADV_RANDOM);
+
+  LOG("Mapped tiled heightmap %s: %ux%u samples, %ux%u tiles", a_path.c_str(),
+      header.m_width, header.m_height, header.m_tilesX, header.m_tilesY);
+
+  return std::unique_ptr<TiledHeightMap>(new TiledHeightMap(
+      static_cast<const uint8_t*>(mapping), size, header));
+}
+
+/* static */ bool TiledHeightMap::write(const std::string& a_path,
+                                        const HeightField& a_heightField,
+                                        uint32_t a_tileQuads,
+                                        float a_sampleSpacing,
+                                        float a_heightScale) {
+  assert(a_tileQuads > 0);
+  assert(!a_heightField.empty());
+
+  Header header;
+  memcpy(header.m_magic, MAGIC, sizeof(MAGIC));
+  header.m_version = VERSION;
+  header.m_width = a_heightField.width();
+  header.m_height = a_heightField.height();
+  header.m_tileQuads = a_tileQuads;
+  header.m_tilesX = (header.m_width - 1 + a_tileQuads - 1) / a_tileQuads;
+  header.m_tilesY = (header.m_height - 1 + a_tileQuads - 1) / a_tileQuads;
+  header.m_tileStride = tileStrideFor(a_tileQuads);
+  header.m_sampleSpacing = a_sampleSpacing;
+
+  std::ofstream out(a_path, std::ios::binary | std::ios::trunc);
+  if (!out) {
+    ERROR("Couldn't create tiled heightmap %s", a_path.c_str());
+    return false;
+  }
+
+  std::vector<uint8_t> block(TILES_OFFSET, 0);
+  memcpy(block.data(), &header, sizeof(Header));
+  out.write(reinterpret_cast<const char*>(block.data()), block.size());
+
+  const uint32_t samples = a_tileQuads + 1 + 2 * TILE_APRON;
+  block.assign(header.m_tileStride, 0);
+  float* tile = reinterpret_cast<float*>(block.data());
+  for (uint32_t tileY = 0; tileY < header.m_tilesY; ++tileY) {
+    for (uint32_t tileX = 0; tileX < header.m_tilesX; ++tileX) {
+      // The apron and the tiles past the edges of the map just repeat the
+      // edge samples.
+      for (uint32_t y = 0; y < samples; ++y) {
+        int64_t sourceY = int64_t(tileY) * a_tileQuads + y - TILE_APRON;
+        sourceY = std::max<int64_t>(
+            0, std::min<int64_t>(sourceY, header.m_height - 1));
+        for (uint32_t x = 0; x < samples; ++x) {
+          int64_t sourceX = int64_t(tileX) * a_tileQuads + x - TILE_APRON;
+          sourceX = std::max<int64_t>(
+              0, std::min<int64_t>(sourceX, header.m_width - 1));
+          tile[y * samples + x] =
+              a_heightField.at(sourceX, sourceY) * a_heightScale;
+        }
+      }
+      out.write(reinterpret_cast<const char*>(block.data()), block.size());
+    }
+  }
+
+  if (!out) {
+    ERROR("Failed to write tiled heightmap %s", a_path.c_str());
+    return false;
+  }
+
+  return true;
+}
+
+const float* TiledHeightMap::tile(uint32_t a_tileX, uint32_t a_tileY) const {
+  assert(a_tileX < tilesX() && a_tileY < tilesY());
+  size_t index = size_t(a_tileY) * tilesX() + a_tileX;
+  return reinterpret_cast<const float*>(m_mapping + TILES_OFFSET +
+                                        index * m_header.m_tileStride);
+}
+
+void TiledHeightMap::advise(uint32_t a_tileX,
+                            uint32_t a_tileY,
+                            int a_advice) const {
+  static const size_t sPageSize = sysconf(_SC_PAGESIZE);
+
+  // Tiles are aligned to TILE_ALIGNMENT, but the page size may be bigger, so
+  // round to whole pages. Advising on a bit of a neighbour is harmless.
+  uintptr_t start = reinterpret_cast<uintptr_t>(tile(a_tileX, a_tileY));
+  uintptr_t end = start + m_header.m_tileStride;
+  start = start / sPageSize * sPageSize;
+  end = (end + sPageSize - 1) / sPageSize * sPageSize;
+  end = std::min(end, reinterpret_cast<uintptr_t>(m_mapping) + m_mappingSize);
+
+  madvise(reinterpret_cast<void*>(start), end - start, a_advice);
+}
+
+void TiledHeightMap::prefetch(uint32_t a_tileX, uint32_t a_tileY) const {
+  advise(a_tileX, a_tileY, MADV_WILLNEED);
+}
+
+void TiledHeightMap::release(uint32_t a_tileX, uint32_t a_tileY) const {
+  advise(a_tileX, a_tileY, MADV_DONTNEED);
+}
+
+void TiledHeightMap::tileAt(float x,
+                            float y,
+                            uint32_t& a_tileX,
+                            uint32_t& a_tileY) const {
+  const float spacing = m_header.m_sampleSpacing;
+  float fx = glm::clamp(x / spacing, 0.0f, float(m_header.m_width - 1));
+  float fy = glm::clamp(y / spacing, 0.0f, float(m_header.m_height - 1));
+  a_tileX = std::min(uint32_t(fx) / m_header.m_tileQuads, tilesX() - 1);
+  a_tileY = std::min(uint32_t(fy) / m_header.m_tileQuads, tilesY() - 1);
+}
+
+float TiledHeightMap::heightAt(float x, float y) const {
+  const float spacing = m_header.m_sampleSpacing;
+  const uint32_t quads = m_header.m_tileQuads;
+
+  float fx = glm::clamp(x / spacing, 0.0f, float(m_header.m_width - 1));
+  float fy = glm::clamp(y / spacing, 0.0f, float(m_header.m_height - 1));
+
+  uint32_t tileX, tileY;
+  tileAt(x, y, tileX, tileY);
+
+  // Local coordinates inside the tile, at most `quads` at the far edge.
+  fx -= tileX * quads;
+  fy -= tileY * quads;
+  uint32_t localX = std::min(uint32_t(fx), quads - 1);
+  uint32_t localY = std::min(uint32_t(fy), quads - 1);
+  float tx = fx - localX;
+  float ty = fy - localY;
+
+  const uint32_t stride = tileSamples();
+  const float* row = tile(tileX, tileY) + (localY + TILE_APRON) * stride +
+                     localX + TILE_APRON;
+  float top = row[0] + (row[1] - row[0]) * tx;
+  float bottom = row[stride] + (row[stride + 1] - row[stride]) * tx;
+  return top + (bottom - top) * ty;
+}
@@ -0,0 +1,151 @@
+#pragma once
+
+#include "glm/glm.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+class HeightField;
+
+/**
+ * A heightmap stored on disk as square tiles of floats, read through a
+ * read-only memory mapping, so maps much bigger than the available memory can
+ * be used.
+ *
+ * The file starts with a Header, followed by the tiles in row-major order,
+ * each one starting at a multiple of TILE_ALIGNMENT bytes, so tiles map to
+ * whole pages and can be paged in and out independently.
+ *
+ * Each tile covers (tileQuads() + 1)^2 samples, so neighbouring tiles share
+ * their border samples and can be drawn without cracks. Around them, tiles
+ * also store an apron of TILE_APRON samples of their neighbours, so the
+ * normals at their borders can be computed from the tile alone, and match the
+ * ones of the neighbour. That's tileSamples()^2 samples in total, row-major.
+ * Heights are stored in world units.
+ *
+ * Nothing is read until it's accessed, and the kernel is free to drop clean
+ * pages, so the amount of memory in use is determined by the tiles we
+ * actually touch. Users are expected to call prefetch() and release() as
+ * tiles enter and leave their working set.
+ */
+class TiledHeightMap final {
+public:
+  static const uint32_t VERSION = 2;
+  static const size_t TILE_ALIGNMENT = 4096;
+  // Keep in sync with res/streamed-terrain/common.glsl.
+  static const uint32_t TILE_APRON = 1;
+
+  struct Header {
+    char m_magic[4];
+    uint32_t m_version;
+    // The size of the source heightmap, in samples.
+    uint32_t m_width;
+    uint32_t m_height;
+    uint32_t m_tileQuads;
+    uint32_t m_tilesX;
+    uint32_t m_tilesY;
+    // The distance between tile starts, in bytes.
+    uint32_t m_tileStride;
+    // The distance between two samples, in world units.
+    float m_sampleSpacing;
+  };
+
+private:
+  const uint8_t* m_mapping;
+  size_t m_mappingSize;
+  Header m_header;
+
+  TiledHeightMap(const uint8_t* a_mapping,
+                 size_t a_mappingSize,
+                 const Header& a_header)
+    : m_mapping(a_mapping), m_mappingSize(a_mappingSize), m_header(a_header) {}
+
+  void advise(uint32_t a_tileX, uint32_t a_tileY, int a_advice) const;
+
+public:
+  TiledHeightMap(const TiledHeightMap&) = delete;
+  ~TiledHeightMap();
+
+  /**
+   * Maps the given file, returning null if it doesn't exist or it isn't a
+   * valid tiled heightmap.
+   */
+  static std::unique_ptr<TiledHeightMap> open(const std::string& a_path);
+
+  /**
+   * Writes a heightfield to disk in this format, so it can be opened with
+   * open().
+   *
+   * Heights are multiplied by a_heightScale.
+   */
+  static bool write(const std::string& a_path,
+                    const HeightField& a_heightField,
+                    uint32_t a_tileQuads,
+                    float a_sampleSpacing,
+                    float a_heightScale);
+
+  /** The size of the source heightmap, in samples. */
+  uint32_t width() const {
+    return m_header.m_width;
+  }
+
+  uint32_t height() const {
+    return m_header.m_height;
+  }
+
+  uint32_t tilesX() const {
+    return m_header.m_tilesX;
+  }
+
+  uint32_t tilesY() const {
+    return m_header.m_tilesY;
+  }
+
+  uint32_t tileQuads() const {
+    return m_header.m_tileQuads;
+  }
+
+  /** The samples in each side of a tile, apron included. */
+  uint32_t tileSamples() const {
+    return m_header.m_tileQuads + 1 + 2 * TILE_APRON;
+  }
+
+  float sampleSpacing() const {
+    return m_header.m_sampleSpacing;
+  }
+
+  float tileWorldSize() const {
+    return m_header.m_tileQuads * m_header.m_sampleSpacing;
+  }
+
+  /** The size of the area covered by the heightmap, in world units. */
+  glm::vec2 worldSize() const {
+    return glm::vec2(m_header.m_width - 1, m_header.m_height - 1) *
+           m_header.m_sampleSpacing;
+  }
+
+  /** The samples of a tile, see the class comment for the layout. */
+  const float* tile(uint32_t a_tileX, uint32_t a_tileY) const;
+
+  /** Hints the kernel that a tile will be needed soon. */
+  void prefetch(uint32_t a_tileX, uint32_t a_tileY) const;
+
+  /**
+   * Lets the kernel drop the pages of a tile. It's still fine to read it
+   * afterwards, it'll just be read from disk again.
+   */
+  void release(uint32_t a_tileX, uint32_t a_tileY) const;
+
+  /**
+   * The bilinearly-filtered height at (x, y), in world units from the corner
+   * of the map. Coordinates outside of the map are clamped to its edges.
+   *
+   * Only reads the samples of the tile tileAt() returns.
+   */
+  float heightAt(float x, float y) const;
+
+  /** The tile heightAt() reads to answer for (x, y). */
+  void tileAt(float x, float y, uint32_t& a_tileX, uint32_t& a_tileY) const;
+};
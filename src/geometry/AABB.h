@@ -0,0 +1,67 @@
+#pragma once
+
+#include "glm/glm.hpp"
+
+#include <limits>
+
+/**
+ * An axis-aligned bounding box.
+ *
+ * A default-constructed box is empty, and grows as points are added to it.
+ */
+struct AABB {
+  glm::vec3 m_min = glm::vec3(std::numeric_limits<float>::max());
+  glm::vec3 m_max = glm::vec3(-std::numeric_limits<float>::max());
+
+  AABB() {}
+  AABB(const glm::vec3& a_min, const glm::vec3& a_max)
+    : m_min(a_min), m_max(a_max) {}
+
+  bool isEmpty() const {
+    return m_min.x > m_max.x || m_min.y > m_max.y || m_min.z > m_max.z;
+  }
+
+  void extend(const glm::vec3& a_point) {
+    m_min = glm::min(m_min, a_point);
+    m_max = glm::max(m_max, a_point);
+  }
+
+  void extend(const AABB& a_other) {
+    m_min = glm::min(m_min, a_other.m_min);
+    m_max = glm::max(m_max, a_other.m_max);
+  }
+
+  glm::vec3 center() const {
+    return (m_min + m_max) * 0.5f;
+  }
+
+  glm::vec3 extents() const {
+    return (m_max - m_min) * 0.5f;
+  }
+
+  /** The squared distance from a point to the box, zero if it's inside. */
+  float distanceSquaredTo(const glm::vec3& a_point) const {
+    glm::vec3 delta = glm::clamp(a_point, m_min, m_max) - a_point;
+    return glm::dot(delta, delta);
+  }
+
+  /**
+   * Returns the box enclosing this one after being transformed by a_transform.
+   *
+   * See Jim Arvo, "Transforming Axis-Aligned Bounding Boxes", Graphics Gems.
+   */
+  AABB transformed(const glm::mat4& a_transform) const {
+    if (isEmpty())
+      return *this;
+
+    glm::vec3 translation(a_transform[3]);
+    AABB ret(translation, translation);
+    for (int column = 0; column < 3; ++column) {
+      glm::vec3 a = glm::vec3(a_transform[column]) * m_min[column];
+      glm::vec3 b = glm::vec3(a_transform[column]) * m_max[column];
+      ret.m_min += glm::min(a, b);
+      ret.m_max += glm::max(a, b);
+    }
+    return ret;
+  }
+};
@@ -6,27 +6,47 @@
 #include "glm/glm.hpp"
 #include "glm/gtc/type_ptr.hpp"
 
-#include "geometry/Material.h"
+#include "geometry/Frustum.h"
 #include "geometry/Node.h"
 
 #include <stack>
 
+class InstancedNode;
+class RenderQueue;
+
 class DrawContext final {
   const Program& m_program;
   std::stack<glm::mat4> m_stack;
 
+  // The world-space frustum of the pass we're drawing, used for culling.
+  Frustum m_frustum;
+
+  // Where the meshes push their draws to, if any. The queue uploads their
+  // transforms when submitting them, so we don't while it's set.
+  RenderQueue* m_queue;
+
+  // The node whose instances the meshes being drawn are part of, if any.
+  const InstancedNode* m_instances;
+
 public:
   struct Uniforms {
     GLint m_transform;
     GLint m_usesTexture;
     GLint m_texture;
-    MaterialUniforms m_material;
+    // The index of the material in the MaterialTable of the scene.
+    GLint m_materialIndex;
+    GLint m_instanced;
   } m_uniforms;
 
   explicit DrawContext(const Program& a_program,
                        const Uniforms& a_uniforms,
-                       glm::mat4 a_initialTransform)
-    : m_program(a_program), m_uniforms(a_uniforms) {
+                       glm::mat4 a_initialTransform,
+                       const Frustum& a_frustum = Frustum())
+    : m_program(a_program)
+    , m_frustum(a_frustum)
+    , m_queue(nullptr)
+    , m_instances(nullptr)
+    , m_uniforms(a_uniforms) {
     m_stack.push(a_initialTransform);
   }
 
@@ -36,6 +56,8 @@ public:
 
   void push(const Node& a_node) {
     m_stack.push(m_stack.top() * a_node.transform());
+    if (m_queue)
+      return;
 
     glUniformMatrix4fv(uniforms().m_transform, 1, GL_FALSE,
                        glm::value_ptr(m_stack.top()));
@@ -50,6 +72,44 @@ public:
     return m_program;
   }
 
+  /** The transform of the node on top of the stack. */
+  const glm::mat4& transform() const {
+    return m_stack.top();
+  }
+
+  const Frustum& frustum() const {
+    return m_frustum;
+  }
+
+  RenderQueue* queue() const {
+    return m_queue;
+  }
+
+  void setQueue(RenderQueue* a_queue) {
+    m_queue = a_queue;
+  }
+
+  const InstancedNode* instances() const {
+    return m_instances;
+  }
+
+  /**
+   * Makes the meshes drawn until endInstances() be drawn once per instance of
+   * the node. Their transforms are relative to the model of the node from now
+   * on, since the ones of the instances already include everything above.
+   */
+  void beginInstances(const InstancedNode& a_node) {
+    assert(!m_instances && "Nested instancing isn't supported");
+    m_instances = &a_node;
+    m_stack.push(glm::mat4());
+  }
+
+  void endInstances() {
+    assert(m_instances);
+    m_instances = nullptr;
+    pop();
+  }
+
 #ifdef DEBUG
   ~DrawContext() {
     assert(m_stack.size() == 1 && "Unbalanced!");
@@ -0,0 +1,88 @@
+#pragma once
+
+#include "geometry/AABB.h"
+
+#include "glm/glm.hpp"
+
+#include <cassert>
+
+/**
+ * A view frustum, represented by its six planes.
+ *
+ * Planes are stored as (normal, distance) with the normals pointing inwards,
+ * and aren't normalized, since we only care about the sign of the distances.
+ *
+ * A default-constructed frustum contains everything.
+ */
+class Frustum final {
+  glm::vec4 m_planes[6];
+
+public:
+  Frustum() {
+    for (auto& plane : m_planes)
+      plane = glm::vec4(0.0f, 0.0f, 0.0f, 1.0f);
+  }
+
+  /**
+   * Extracts the planes from a (view-)projection matrix, so the frustum is in
+   * the space the matrix transforms from.
+   *
+   * See Gribb & Hartmann, "Fast Extraction of Viewing Frustum Planes from the
+   * World-View-Projection Matrix".
+   */
+  static Frustum fromMatrix(const glm::mat4& a_matrix) {
+    // glm matrices are column-major, we want the rows.
+    glm::mat4 rows = glm::transpose(a_matrix);
+
+    Frustum ret;
+    ret.m_planes[0] = rows[3] + rows[0];  // Left
+    ret.m_planes[1] = rows[3] - rows[0];  // Right
+    ret.m_planes[2] = rows[3] + rows[1];  // Bottom
+    ret.m_planes[3] = rows[3] - rows[1];  // Top
+    ret.m_planes[4] = rows[3] + rows[2];  // Near
+    ret.m_planes[5] = rows[3] - rows[2];  // Far
+    return ret;
+  }
+
+  /**
+   * Returns this frustum in the local space of an object with the given model
+   * transform, so boxes in that space can be tested without transforming them.
+   */
+  Frustum inLocalSpace(const glm::mat4& a_model) const {
+    glm::mat4 transposed = glm::transpose(a_model);
+    Frustum ret;
+    for (size_t i = 0; i < 6; ++i)
+      ret.m_planes[i] = transposed * m_planes[i];
+    return ret;
+  }
+
+  const glm::vec4& plane(size_t a_index) const {
+    assert(a_index < 6);
+    return m_planes[a_index];
+  }
+
+  /**
+   * The six planes one after the other, to upload them as a uniform array.
+   */
+  const glm::vec4* planes() const {
+    return m_planes;
+  }
+
+  /**
+   * Returns false if the box is known to be fully outside of the frustum.
+   *
+   * This is conservative: Some boxes near the corners will be reported as
+   * intersecting even if they're not.
+   */
+  bool intersects(const AABB& a_box) const {
+    for (const auto& plane : m_planes) {
+      // The corner furthest along the plane normal.
+      glm::vec3 positive(plane.x >= 0 ? a_box.m_max.x : a_box.m_min.x,
+                         plane.y >= 0 ? a_box.m_max.y : a_box.m_min.y,
+                         plane.z >= 0 ? a_box.m_max.z : a_box.m_min.z);
+      if (glm::dot(glm::vec3(plane), positive) + plane.w < 0.0f)
+        return false;
+    }
+    return true;
+  }
+};
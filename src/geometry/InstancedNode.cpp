@@ -0,0 +1,104 @@
+#include "geometry/InstancedNode.h"
+
+#include "base/ErrorChecker.h"
+#include "geometry/DrawContext.h"
+#include "geometry/Mesh.h"
+
+#include <cassert>
+
+// The first of the four attributes (one per column) of the instance
+// transform, after the ones of the mesh, see Mesh::bindBuffers.
+const GLuint INSTANCE_TRANSFORM_ATTRIBUTE = 3;
+
+InstancedNode::InstancedNode(std::unique_ptr<Node> a_model,
+                             std::vector<glm::mat4> a_instances)
+  : m_model(std::move(a_model))
+  , m_instances(std::move(a_instances))
+  , m_uploaded(false) {
+  assert(m_model);
+  AutoGLErrorChecker checker;
+  setStatic(m_model->isStatic());
+
+  glGenBuffers(1, &m_instanceBuffer);
+
+  std::vector<const Mesh*> meshes;
+  m_model->collectMeshes(meshes);
+  for (const Mesh* mesh : meshes) {
+    GLuint vao;
+    glGenVertexArrays(1, &vao);
+    glBindVertexArray(vao);
+    mesh->bindBuffers();
+
+    glBindBuffer(GL_ARRAY_BUFFER, m_instanceBuffer);
+    for (GLuint i = 0; i < 4; ++i) {
+      GLuint attribute = INSTANCE_TRANSFORM_ATTRIBUTE + i;
+      glEnableVertexAttribArray(attribute);
+      glVertexAttribPointer(attribute, 4, GL_FLOAT, GL_FALSE,
+                            sizeof(glm::mat4),
+                            (GLvoid*)(sizeof(glm::vec4) * i));
+      glVertexAttribDivisor(attribute, 1);
+    }
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glBindVertexArray(0);
+
+    m_vaos.push_back(std::make_pair(mesh, vao));
+  }
+}
+
+InstancedNode::~InstancedNode() {
+  for (auto& vao : m_vaos)
+    glDeleteVertexArrays(1, &vao.second);
+  glDeleteBuffers(1, &m_instanceBuffer);
+}
+
+GLuint InstancedNode::vaoFor(const Mesh& a_mesh) const {
+  // Models have just a few meshes.
+  for (const auto& vao : m_vaos)
+    if (vao.first == &a_mesh)
+      return vao.second;
+  assert(false && "Not a mesh of our model");
+  return 0;
+}
+
+void InstancedNode::uploadInstances(const glm::mat4& a_transform) const {
+  AutoGLErrorChecker checker;
+  std::vector<glm::mat4> transforms;
+  transforms.reserve(m_instances.size());
+  for (const auto& instance : m_instances)
+    transforms.push_back(a_transform * instance);
+
+  glBindBuffer(GL_ARRAY_BUFFER, m_instanceBuffer);
+  glBufferData(GL_ARRAY_BUFFER, sizeof(glm::mat4) * transforms.size(),
+               transforms.data(), GL_STATIC_DRAW);
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+  m_uploadedTransform = a_transform;
+  m_uploaded = true;
+}
+
+AABB InstancedNode::localBounds() const {
+  AABB model = m_model->bounds();
+  AABB ret;
+  for (const auto& instance : m_instances)
+    ret.extend(model.transformed(instance));
+  return ret;
+}
+
+void InstancedNode::draw(DrawContext& context) const {
+  if (m_instances.empty())
+    return;
+
+  context.push(*this);
+  if (!m_uploaded || m_uploadedTransform != context.transform())
+    uploadInstances(context.transform());
+
+  context.beginInstances(*this);
+  m_model->draw(context);
+  context.endInstances();
+
+  context.pop();
+}
+
+void InstancedNode::registerMaterials(MaterialTable& a_table) {
+  m_model->registerMaterials(a_table);
+}
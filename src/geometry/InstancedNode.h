@@ -0,0 +1,54 @@
+#pragma once
+
+#include "base/gl.h"
+#include "geometry/Node.h"
+
+#include "glm/glm.hpp"
+
+#include <memory>
+#include <utility>
+#include <vector>
+
+/**
+ * Many copies of a model, each with its own transform, that keeps a single
+ * copy of the geometry and draws every mesh of the model once for all the
+ * copies, with glDrawElementsInstanced.
+ *
+ * The transforms of the instances are relative to this node, and go into an
+ * instanced vertex attribute (see vInstanceTransform in res/vertex.glsl). We
+ * need a vertex array object per mesh of the model to put that attribute next
+ * to the ones of the mesh.
+ */
+class InstancedNode final : public Node {
+  std::unique_ptr<Node> m_model;
+  std::vector<glm::mat4> m_instances;
+
+  // The world transforms of the instances, that is, m_instances with the
+  // transform of this node on top, which we upload again whenever the latter
+  // changes.
+  GLuint m_instanceBuffer;
+  mutable glm::mat4 m_uploadedTransform;
+  mutable bool m_uploaded;
+
+  // The vertex array of each mesh of the model.
+  std::vector<std::pair<const Mesh*, GLuint>> m_vaos;
+
+  void uploadInstances(const glm::mat4& a_transform) const;
+
+public:
+  InstancedNode(std::unique_ptr<Node> a_model,
+                std::vector<glm::mat4> a_instances);
+  InstancedNode(const InstancedNode&) = delete;
+  virtual ~InstancedNode();
+
+  size_t instanceCount() const {
+    return m_instances.size();
+  }
+
+  /** The vertex array to draw the instances of a mesh of the model with. */
+  GLuint vaoFor(const Mesh&) const;
+
+  virtual AABB localBounds() const override;
+  virtual void draw(DrawContext&) const override;
+  virtual void registerMaterials(MaterialTable&) override;
+};
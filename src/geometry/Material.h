@@ -1,8 +1,10 @@
 #pragma once
 
 #include "glm/glm.hpp"
-#include "base/gl.h"
 
+/**
+ * The colors of a mesh, which the shaders read from a MaterialTable.
+ */
 struct Material {
   glm::vec4 m_diffuse = glm::vec4(0.5, 0.5, 0.5, 1.0);
   glm::vec4 m_specular = glm::vec4(1.0, 1.0, 1.0, 1.0);
@@ -10,13 +12,17 @@ struct Material {
   glm::vec4 m_emissive = glm::vec4(1.0, 1.0, 1.0, 1.0);
   float m_shininess = 2;
   float m_shininess_percent = 0.5;
-};
 
-struct MaterialUniforms {
-  GLint m_diffuse;
-  GLint m_specular;
-  GLint m_ambient;
-  GLint m_emissive;
-  GLint m_shininess;
-  GLint m_shininess_percent;
+  bool operator==(const Material& a_other) const {
+    return m_diffuse == a_other.m_diffuse &&
+           m_specular == a_other.m_specular &&
+           m_ambient == a_other.m_ambient &&
+           m_emissive == a_other.m_emissive &&
+           m_shininess == a_other.m_shininess &&
+           m_shininess_percent == a_other.m_shininess_percent;
+  }
+
+  bool operator!=(const Material& a_other) const {
+    return !(*this == a_other);
+  }
 };
@@ -0,0 +1,57 @@
+#include "geometry/MaterialTable.h"
+
+#include "base/ErrorChecker.h"
+
+#include <algorithm>
+
+MaterialTable::MaterialTable() : m_dirty(true) {
+  AutoGLErrorChecker checker;
+  m_materials.push_back(Material());
+
+  glGenBuffers(1, &m_buffer);
+  glGenTextures(1, &m_texture);
+}
+
+MaterialTable::~MaterialTable() {
+  glDeleteTextures(1, &m_texture);
+  glDeleteBuffers(1, &m_buffer);
+}
+
+uint32_t MaterialTable::add(const Material& a_material) {
+  // There are just a handful of them, and they're only added when loading.
+  auto existing =
+      std::find(m_materials.begin(), m_materials.end(), a_material);
+  if (existing != m_materials.end())
+    return existing - m_materials.begin();
+
+  m_materials.push_back(a_material);
+  m_dirty = true;
+  return m_materials.size() - 1;
+}
+
+void MaterialTable::upload() {
+  if (!m_dirty)
+    return;
+
+  AutoGLErrorChecker checker;
+  std::vector<glm::vec4> texels;
+  texels.reserve(m_materials.size() * TEXELS_PER_MATERIAL);
+  for (const auto& material : m_materials) {
+    texels.push_back(material.m_diffuse);
+    texels.push_back(material.m_specular);
+    texels.push_back(material.m_ambient);
+    texels.push_back(material.m_emissive);
+    texels.push_back(glm::vec4(material.m_shininess,
+                               material.m_shininess_percent, 0.0f, 0.0f));
+  }
+
+  // The whole table is reallocated, since it only grows while loading.
+  glBindBuffer(GL_TEXTURE_BUFFER, m_buffer);
+  glBufferData(GL_TEXTURE_BUFFER, sizeof(glm::vec4) * texels.size(),
+               texels.data(), GL_STATIC_DRAW);
+  glBindTexture(GL_TEXTURE_BUFFER, m_texture);
+  glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, m_buffer);
+  glBindTexture(GL_TEXTURE_BUFFER, 0);
+  glBindBuffer(GL_TEXTURE_BUFFER, 0);
+  m_dirty = false;
+}
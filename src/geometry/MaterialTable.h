@@ -0,0 +1,53 @@
+#pragma once
+
+#include "base/gl.h"
+#include "geometry/Material.h"
+
+#include <cstdint>
+#include <vector>
+
+/**
+ * Every material the meshes of a scene use, in a texture buffer the shaders
+ * fetch them from (see getMaterial in res/common.glsl), so drawing a mesh only
+ * needs to set the index of its material.
+ *
+ * Each material takes MaterialTable::TEXELS_PER_MATERIAL RGBA texels: the
+ * diffuse, specular, ambient and emissive colors, and then the shininess and
+ * its percentage.
+ */
+class MaterialTable final {
+  std::vector<Material> m_materials;
+  GLuint m_buffer;
+  GLuint m_texture;
+  // Whether there are materials the buffer doesn't have yet.
+  bool m_dirty;
+
+public:
+  static const uint32_t TEXELS_PER_MATERIAL = 5;
+
+  // The index of the default material, which the meshes that haven't been
+  // added to a scene use.
+  static const uint32_t DEFAULT_MATERIAL = 0;
+
+  MaterialTable();
+  MaterialTable(const MaterialTable&) = delete;
+  ~MaterialTable();
+
+  /**
+   * Returns the index of the material, adding it if there isn't an equal one
+   * already, so meshes with the same material share it.
+   */
+  uint32_t add(const Material&);
+
+  /** Uploads the table if there are new materials since the last time. */
+  void upload();
+
+  /** The GL_TEXTURE_BUFFER the shaders read the materials from. */
+  GLuint texture() const {
+    return m_texture;
+  }
+
+  size_t size() const {
+    return m_materials.size();
+  }
+};
@@ -1,23 +1,24 @@
 #include "geometry/Mesh.h"
 #include "geometry/DrawContext.h"
-
-Mesh::Mesh(std::vector<Vertex>&& a_vertices,
-           std::vector<GLuint>&& a_indices,
-           Material a_material,
-           Optional<GLuint>&& a_texture)
-  : m_vertices(std::move(a_vertices))
-  , m_indices(std::move(a_indices))
+#include "geometry/MaterialTable.h"
+#include "geometry/RenderQueue.h"
+
+MeshData::MeshData(const std::vector<Vertex>& a_vertices,
+                   const std::vector<GLuint>& a_indices,
+                   Material a_material,
+                   Optional<GLuint>&& a_texture)
+  : m_indexCount(a_indices.size())
   , m_material(a_material)
-  , m_texture(std::move(a_texture))
-  , m_vao(UNINITIALIZED)
-  , m_vbo(UNINITIALIZED)
-  , m_ebo(UNINITIALIZED) {
+  , m_texture(std::move(a_texture)) {
 #ifdef DEBUG
-  for (auto index : m_indices) {
-    assert(index < m_vertices.size() || !"Index out of bounds");
+  for (auto index : a_indices) {
+    assert(index < a_vertices.size() || !"Index out of bounds");
   }
 #endif
 
+  for (const auto& vertex : a_vertices)
+    m_localBounds.extend(vertex.m_position);
+
   AutoGLErrorChecker checker;
   glGenVertexArrays(1, &m_vao);
 
@@ -27,12 +28,21 @@ Mesh::Mesh(std::vector<Vertex>&& a_vertices,
   glGenBuffers(1, &m_ebo);
 
   glBindBuffer(GL_ARRAY_BUFFER, m_vbo);
-  glBufferData(GL_ARRAY_BUFFER, sizeof(Vertex) * m_vertices.size(),
-               m_vertices.data(), GL_STATIC_DRAW);
+  glBufferData(GL_ARRAY_BUFFER, sizeof(Vertex) * a_vertices.size(),
+               a_vertices.data(), GL_STATIC_DRAW);
 
   glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_ebo);
-  glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(GLuint) * m_indices.size(),
-               m_indices.data(), GL_STATIC_DRAW);
+  glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(GLuint) * a_indices.size(),
+               a_indices.data(), GL_STATIC_DRAW);
+
+  bindBuffers();
+  glBindVertexArray(0);
+}
+
+void MeshData::bindBuffers() const {
+  AutoGLErrorChecker checker;
+  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_ebo);
+  glBindBuffer(GL_ARRAY_BUFFER, m_vbo);
 
 #define INT_TO_GLVOID(i) ((GLvoid*)i)
 
@@ -50,74 +60,48 @@ Mesh::Mesh(std::vector<Vertex>&& a_vertices,
   glEnableVertexAttribArray(2);
   glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex),
                         INT_TO_GLVOID(offsetof(Vertex, m_uv)));
-  glBindVertexArray(0);
+#undef INT_TO_GLVOID
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
 }
 
-Mesh::~Mesh() {
+MeshData::~MeshData() {
   AutoGLErrorChecker checker;
-  if (m_texture.isSome())
-    glDeleteTextures(1, &*m_texture);
-
-  if (m_vao == UNINITIALIZED) {
-    assert(m_vbo == UNINITIALIZED);
-    assert(m_ebo == UNINITIALIZED);
-    return;
-  }
-
   glDeleteVertexArrays(1, &m_vao);
   glDeleteBuffers(1, &m_vbo);
   glDeleteBuffers(1, &m_ebo);
 }
 
-void Mesh::draw(DrawContext& context) const {
-  AutoGLErrorChecker checker;
-  assert(glIsVertexArray(m_vao));
-
-  // LOG("Draw: %d, %zu", m_vao, m_indices.size());
-
-  // FIXME(emilio): This duplicates code with what node does, we should probably
-  // add a beginDraw/endDraw functions.
-  //
-  // This doesn't matter in practice because the way it works right now meshes
-  // don't have children, so this doesn't incur in more gl calls.
-  //
-  // Though that means that probably the class hierarchy needs to be redesigned?
-  // Who knows :-)
-  context.push(*this);
-
-  glUniform4fv(context.uniforms().m_material.m_diffuse, 1,
-               glm::value_ptr(m_material.m_diffuse));
-  glUniform4fv(context.uniforms().m_material.m_ambient, 1,
-               glm::value_ptr(m_material.m_ambient));
-  glUniform4fv(context.uniforms().m_material.m_emissive, 1,
-               glm::value_ptr(m_material.m_emissive));
-  glUniform4fv(context.uniforms().m_material.m_specular, 1,
-               glm::value_ptr(m_material.m_specular));
-  glUniform1f(context.uniforms().m_material.m_shininess,
-              m_material.m_shininess);
-  glUniform1f(context.uniforms().m_material.m_shininess_percent,
-              m_material.m_shininess_percent);
-  // LOG("Texture: %d", (int) m_texture.isSome());
-  glUniform1i(context.uniforms().m_usesTexture, m_texture.isSome());
-
-  if (m_texture) {
-    // TODO: We should be able to avoid this glUniform1i call and do the
-    // glActiveTexture call just once, but anyway.
-    glUniform1i(context.uniforms().m_texture, 0);
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, *m_texture);
-  }
+Mesh::Mesh(std::shared_ptr<const MeshData> a_data)
+  : m_data(std::move(a_data))
+  , m_materialIndex(MaterialTable::DEFAULT_MATERIAL) {
+  assert(m_data);
+}
 
-  glBindVertexArray(m_vao);
-  if (context.program().tessControlShader()) {
-    glPatchParameteri(GL_PATCH_VERTICES, 3);
-    glDrawElements(GL_PATCHES, m_indices.size(), GL_UNSIGNED_INT, nullptr);
-  } else {
-    glDrawElements(GL_TRIANGLES, m_indices.size(), GL_UNSIGNED_INT, nullptr);
+void Mesh::draw(DrawContext& context) const {
+  assert(glIsVertexArray(m_data->vao()));
+
+  RenderQueue* queue = context.queue();
+  if (!queue) {
+    RenderQueue immediate;
+    context.setQueue(&immediate);
+    draw(context);
+    context.setQueue(nullptr);
+    immediate.submit(context);
+    return;
   }
-  glBindVertexArray(0);
 
-  context.pop();
+  queue->push(*this, context.transform() * m_transform, context.program().id(),
+              context.instances());
 
   Node::draw(context);
 }
+
+void Mesh::registerMaterials(MaterialTable& a_table) {
+  m_materialIndex = a_table.add(m_data->material());
+  Node::registerMaterials(a_table);
+}
+
+void Mesh::collectMeshes(std::vector<const Mesh*>& a_meshes) const {
+  a_meshes.push_back(this);
+  Node::collectMeshes(a_meshes);
+}
@@ -15,15 +15,20 @@
 #include <vector>
 #include <memory>
 
-#define UNINITIALIZED ((GLuint)-1)
-
-class Mesh : public Node {
-  std::vector<Vertex> m_vertices;
-  std::vector<GLuint> m_indices;
+/**
+ * The immutable part of a mesh: its buffers, material and texture, which
+ * every Mesh loaded from the same model shares, see Node::fromFile.
+ */
+class MeshData final {
+  size_t m_indexCount;
 
   Material m_material;
 
-  // The texture we're using.
+  // The bounds of the vertices.
+  AABB m_localBounds;
+
+  // The texture we're using, owned by the model it was loaded with, since
+  // several meshes can use the same one.
   Optional<GLuint> m_texture;
 
   // The vertex array object.
@@ -36,30 +41,89 @@ class Mesh : public Node {
   GLuint m_ebo;
 
 public:
-  // No copy semantics, just move.
+  MeshData(const MeshData&) = delete;
+
+  MeshData(const std::vector<Vertex>& a_vertices,
+           const std::vector<GLuint>& a_indices,
+           Material a_material,
+           Optional<GLuint>&& a_texture);
+
+  ~MeshData();
+
+  AABB localBounds() const {
+    return m_localBounds;
+  }
+
+  const Material& material() const {
+    return m_material;
+  }
+
+  const Optional<GLuint>& texture() const {
+    return m_texture;
+  }
+
+  GLuint vao() const {
+    return m_vao;
+  }
+
+  size_t indexCount() const {
+    return m_indexCount;
+  }
+
+  /**
+   * Binds the vertex buffer to the attributes 0 to 2 (position, normal and uv
+   * coordinates), and the index buffer, to the currently bound vertex array
+   * object, for users that need their own one, like InstancedNode.
+   */
+  void bindBuffers() const;
+};
+
+class Mesh : public Node {
+  std::shared_ptr<const MeshData> m_data;
+
+  // The index of our material in the MaterialTable of the scene, see
+  // registerMaterials.
+  uint32_t m_materialIndex;
+
+public:
+  // No copy semantics.
   Mesh(const Mesh& aOther) = delete;
 
-  Mesh(Mesh&& aOther) {
-    m_vertices.swap(aOther.m_vertices);
-    m_indices.swap(aOther.m_indices);
+  explicit Mesh(std::shared_ptr<const MeshData> a_data);
 
-    m_material = aOther.m_material;
-    m_vao = aOther.m_vao;
-    m_vbo = aOther.m_vbo;
-    m_ebo = aOther.m_ebo;
-    m_transform = aOther.m_transform;
+  virtual AABB localBounds() const override {
+    return m_data->localBounds();
+  }
 
-    m_texture = std::move(aOther.m_texture);
+  const Material& material() const {
+    return m_data->material();
+  }
+
+  uint32_t materialIndex() const {
+    return m_materialIndex;
+  }
 
-    aOther.m_vao = aOther.m_vbo = aOther.m_ebo = UNINITIALIZED;
+  const Optional<GLuint>& texture() const {
+    return m_data->texture();
   }
 
-  virtual ~Mesh();
+  GLuint vao() const {
+    return m_data->vao();
+  }
 
-  Mesh(std::vector<Vertex>&& a_vertices,
-       std::vector<GLuint>&& a_indices,
-       Material a_material,
-       Optional<GLuint>&& a_texture);
+  size_t indexCount() const {
+    return m_data->indexCount();
+  }
+
+  void bindBuffers() const {
+    m_data->bindBuffers();
+  }
 
+  /**
+   * Pushes this mesh to the queue of the context, or, if it doesn't have
+   * one, draws it right away.
+   */
   virtual void draw(DrawContext&) const override;
+  virtual void registerMaterials(MaterialTable&) override;
+  virtual void collectMeshes(std::vector<const Mesh*>&) const override;
 };
@@ -1,3 +1,7 @@
+#include <climits>
+#include <cstdlib>
+#include <map>
+#include <string>
 #include <vector>
 
 #include "assimp/Importer.hpp"
@@ -26,9 +30,78 @@ void Node::draw(DrawContext& context) const {
   context.pop();
 }
 
-static std::unique_ptr<Node> meshFromAi(const Path& basePath,
-                                        const aiScene& scene,
-                                        const aiMesh& mesh) {
+void Node::registerMaterials(MaterialTable& a_table) {
+  for (auto& child : m_children)
+    child->registerMaterials(a_table);
+}
+
+void Node::collectMeshes(std::vector<const Mesh*>& a_meshes) const {
+  for (auto& child : m_children)
+    child->collectMeshes(a_meshes);
+}
+
+AABB Node::localBounds() const {
+  AABB ret;
+  for (auto& child : m_children)
+    ret.extend(child->bounds());
+  return ret;
+}
+
+namespace {
+
+/**
+ * Everything we load from a model file, shared among all the nodes loaded
+ * from it, see Node::fromFile. Each of their meshes keeps it alive.
+ */
+struct Model {
+  std::vector<std::unique_ptr<MeshData>> m_meshes;
+
+  // The textures of the meshes, by path, since several meshes usually use
+  // the same one.
+  std::map<std::string, GLuint> m_textures;
+
+  ~Model() {
+    for (auto& texture : m_textures)
+      glDeleteTextures(1, &texture.second);
+  }
+};
+
+} // anonymous namespace
+
+static Optional<GLuint> loadTexture(Model& a_model, const Path& a_path) {
+  auto existing = a_model.m_textures.find(a_path.as_str());
+  if (existing != a_model.m_textures.end())
+    return Some(existing->second);
+
+  sf::Image textureImporter;
+  if (!textureImporter.loadFromFile(a_path.as_str())) {
+    WARN("Loading texture failed: %s", a_path.c_str());
+    return None;
+  }
+
+  AutoGLErrorChecker checker;
+  auto size = textureImporter.getSize();
+  GLuint texture;
+  glGenTextures(1, &texture);
+  glBindTexture(GL_TEXTURE_2D, texture);
+  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, size.x, size.y, 0, GL_RGBA,
+               GL_UNSIGNED_BYTE, textureImporter.getPixelsPtr());
+
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+  glBindTexture(GL_TEXTURE_2D, 0);
+
+  a_model.m_textures[a_path.as_str()] = texture;
+  return Some(texture);
+}
+
+static std::unique_ptr<MeshData> meshFromAi(Model& model,
+                                            const Path& basePath,
+                                            const aiScene& scene,
+                                            const aiMesh& mesh) {
   assert(mesh.HasFaces());
   assert(mesh.HasPositions());
 
@@ -93,8 +166,6 @@ static std::unique_ptr<Node> meshFromAi(const Path& basePath,
       material.m_shininess,
       material.m_shininess_percent);
 
-  // TODO: This can load a bunch of textures from the same file, build a cache,
-  // and refcount, and all that stuff.
   Optional<GLuint> texture;
 
   uint32_t count = ai_material.GetTextureCount(aiTextureType_DIFFUSE);
@@ -103,7 +174,6 @@ static std::unique_ptr<Node> meshFromAi(const Path& basePath,
     aiString path;
     // TODO: Right now only load one, be better at this!
     for (uint32_t i = 0; i < 1; ++i) {
-      AutoGLErrorChecker checker;
       aiTextureMapping mapping;
       aiReturn ret =
           ai_material.GetTexture(aiTextureType_DIFFUSE, i, &path, &mapping);
@@ -125,25 +195,7 @@ static std::unique_ptr<Node> meshFromAi(const Path& basePath,
 
       LOG(" - %u: %s", i, texturePath.c_str());
 
-      sf::Image textureImporter;
-      if (!textureImporter.loadFromFile(texturePath.as_str())) {
-        WARN("Loading texture failed: %s", texturePath.c_str());
-        continue;
-      }
-
-      auto size = textureImporter.getSize();
-      texture.set(0);
-      glGenTextures(1, &*texture);
-      glBindTexture(GL_TEXTURE_2D, *texture);
-      glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, size.x, size.y, 0, GL_RGBA,
-                   GL_UNSIGNED_BYTE, textureImporter.getPixelsPtr());
-
-      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
-      glBindTexture(GL_TEXTURE_2D, 0);
+      texture = loadTexture(model, texturePath);
     }
   }
 
@@ -171,11 +223,11 @@ static std::unique_ptr<Node> meshFromAi(const Path& basePath,
     }
   }
 
-  return std::make_unique<Mesh>(std::move(vertices), std::move(indices),
-                                material, std::move(texture));
+  return std::make_unique<MeshData>(vertices, indices, material,
+                                    std::move(texture));
 }
 
-/* static */ std::unique_ptr<Node> Node::fromFile(const char* a_modelPath) {
+static std::shared_ptr<Model> loadModel(const char* a_modelPath) {
   Assimp::Importer importer;
   // NB: We flip the UV coordinates here instead of somewhere else.
   //
@@ -199,16 +251,59 @@ static std::unique_ptr<Node> meshFromAi(const Path& basePath,
   Path basePath(a_modelPath);
   basePath.pop();
 
-  // Not worth to add an extra layer of indirection in the simple case.
-  if (scene->mNumMeshes == 1)
-    return meshFromAi(basePath, *scene, *scene->mMeshes[0]);
-
-  auto ret = std::make_unique<Node>();
-
+  auto model = std::make_shared<Model>();
   for (size_t i = 0; i < scene->mNumMeshes; ++i) {
     assert(scene->mMeshes[i]);
-    ret->addChild(meshFromAi(basePath, *scene, *scene->mMeshes[i]));
+    model->m_meshes.push_back(
+        meshFromAi(*model, basePath, *scene, *scene->mMeshes[i]));
+  }
+
+  return model;
+}
+
+// The path we key the models with, so different ways to refer to the same
+// file share it.
+static std::string canonicalPath(const char* a_path) {
+#ifdef OS_WINDOWS
+  char buffer[_MAX_PATH];
+  if (_fullpath(buffer, a_path, _MAX_PATH))
+    return buffer;
+#else
+  char buffer[PATH_MAX];
+  if (realpath(a_path, buffer))
+    return buffer;
+#endif
+  // Let the importer complain about it.
+  return a_path;
+}
+
+/* static */ std::unique_ptr<Node> Node::fromFile(const char* a_modelPath) {
+  // NB: We only do GL from one thread, so no need to lock.
+  static std::map<std::string, std::weak_ptr<Model>> sModels;
+
+  std::string path = canonicalPath(a_modelPath);
+  auto& entry = sModels[path];
+  std::shared_ptr<Model> model = entry.lock();
+  if (!model) {
+    model = loadModel(path.c_str());
+    if (!model)
+      return nullptr;
+    entry = model;
   }
 
+  // Every mesh keeps the whole model alive, so its textures outlive them.
+  auto meshFor = [&](const std::unique_ptr<MeshData>& a_data) {
+    return std::make_unique<Mesh>(
+        std::shared_ptr<const MeshData>(model, a_data.get()));
+  };
+
+  // Not worth to add an extra layer of indirection in the simple case.
+  if (model->m_meshes.size() == 1)
+    return meshFor(model->m_meshes[0]);
+
+  auto ret = std::make_unique<Node>();
+  for (const auto& data : model->m_meshes)
+    ret->addChild(meshFor(data));
+
   return ret;
 }
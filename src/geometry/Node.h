@@ -2,13 +2,17 @@
 
 #include <list>
 #include <memory>
+#include <vector>
 
 #include "glm/glm.hpp"
 #include "glm/gtc/matrix_transform.hpp"
 
+#include "geometry/AABB.h"
 #include "tools/Optional.h"
 
 class DrawContext;
+class MaterialTable;
+class Mesh;
 
 /**
  * A node is an item in a scene.
@@ -18,21 +22,61 @@ class DrawContext;
 class Node {
   std::list<std::unique_ptr<Node>> m_children;
 
+  // See isStatic().
+  bool m_static;
+
 protected:
   // The local transform of this object.
   glm::mat4 m_transform;
 
 public:
-  Node() {}
+  Node() : m_static(false) {}
 
   virtual ~Node() {}
 
   virtual void draw(DrawContext& context) const;
 
+  /**
+   * Adds the materials of this node and its children to the table of the scene
+   * it's being added to, which the shaders read them from.
+   */
+  virtual void registerMaterials(MaterialTable&);
+
+  /** Appends the meshes of this node and its children. */
+  virtual void collectMeshes(std::vector<const Mesh*>&) const;
+
   void addChild(std::unique_ptr<Node> a_child) {
     m_children.push_back(std::move(a_child));
   }
 
+  /**
+   * Whether this node never moves nor changes once added to the scene, which
+   * lets the scene cache its shadows.
+   */
+  bool isStatic() const {
+    return m_static;
+  }
+
+  void setStatic(bool a_static) {
+    m_static = a_static;
+  }
+
+  /**
+   * The box this node and its children are in, in the space of the node,
+   * that is, without its own transform.
+   *
+   * An empty box means there's nothing to draw, or that the node draws
+   * something it doesn't know the bounds of, so it mustn't be culled.
+   */
+  virtual AABB localBounds() const;
+
+  /**
+   * The bounds of this node in the space of its parent.
+   */
+  AABB bounds() const {
+    return localBounds().transformed(m_transform);
+  }
+
   const glm::mat4& transform() const {
     return m_transform;
   }
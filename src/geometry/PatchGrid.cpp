@@ -0,0 +1,103 @@
+#include "geometry/PatchGrid.h"
+
+#include "base/ErrorChecker.h"
+
+#include "glm/glm.hpp"
+
+#include <map>
+#include <vector>
+
+PatchGrid::PatchGrid(uint32_t a_quads) : m_quads(a_quads) {
+  assert(m_quads > 0 && m_quads % 2 == 0 &&
+         "We need an even number of quads to split the grid in quadrants");
+
+  const uint32_t stride = m_quads + 1;
+  assert(stride * stride <= 65536 && "Indices must fit in a GLushort");
+
+  std::vector<glm::vec2> vertices;
+  vertices.reserve(stride * stride);
+  for (uint32_t y = 0; y < stride; ++y)
+    for (uint32_t x = 0; x < stride; ++x)
+      vertices.push_back(glm::vec2(x, y) / float(m_quads));
+
+  std::vector<GLushort> indices;
+  indices.reserve(indexCount() * 2);
+
+  auto pushQuads = [&](uint32_t x0, uint32_t y0, uint32_t count) {
+    for (uint32_t y = y0; y < y0 + count; ++y) {
+      for (uint32_t x = x0; x < x0 + count; ++x) {
+        GLushort i = y * stride + x;
+        indices.push_back(i);
+        indices.push_back(i + stride);
+        indices.push_back(i + stride + 1);
+
+        indices.push_back(i);
+        indices.push_back(i + stride + 1);
+        indices.push_back(i + 1);
+      }
+    }
+  };
+
+  const uint32_t half = m_quads / 2;
+  pushQuads(0, 0, m_quads);
+  for (uint32_t quadrant = 0; quadrant < 4; ++quadrant)
+    pushQuads((quadrant & 1) * half, (quadrant >> 1) * half, half);
+
+  assert(indices.size() == indexCount() * 2);
+
+  AutoGLErrorChecker checker;
+  glGenBuffers(1, &m_vbo);
+  glGenBuffers(1, &m_ebo);
+
+  glBindBuffer(GL_ARRAY_BUFFER, m_vbo);
+  glBufferData(GL_ARRAY_BUFFER, sizeof(glm::vec2) * vertices.size(),
+               vertices.data(), GL_STATIC_DRAW);
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+  // NB: No VAO bound here, so binding the element buffer is fine.
+  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_ebo);
+  glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(GLushort) * indices.size(),
+               indices.data(), GL_STATIC_DRAW);
+  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+}
+
+PatchGrid::~PatchGrid() {
+  glDeleteBuffers(1, &m_vbo);
+  glDeleteBuffers(1, &m_ebo);
+}
+
+/* static */ std::shared_ptr<PatchGrid> PatchGrid::get(uint32_t a_quads) {
+  // NB: We only do GL from one thread, so no need to lock.
+  static std::map<uint32_t, std::weak_ptr<PatchGrid>> sGrids;
+
+  auto& entry = sGrids[a_quads];
+  if (auto existing = entry.lock())
+    return existing;
+
+  auto grid = std::shared_ptr<PatchGrid>(new PatchGrid(a_quads));
+  entry = grid;
+  return grid;
+}
+
+void PatchGrid::setupVertexArray(GLuint a_attribute) const {
+  AutoGLErrorChecker checker;
+  glBindBuffer(GL_ARRAY_BUFFER, m_vbo);
+  glEnableVertexAttribArray(a_attribute);
+  glVertexAttribPointer(a_attribute, 2, GL_FLOAT, GL_FALSE, sizeof(glm::vec2),
+                        nullptr);
+  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_ebo);
+}
+
+size_t PatchGrid::indexCount(int32_t a_quadrant) const {
+  size_t whole = m_quads * m_quads * 6;
+  return a_quadrant == WHOLE_GRID ? whole : whole / 4;
+}
+
+const GLvoid* PatchGrid::indexOffset(int32_t a_quadrant) const {
+  if (a_quadrant == WHOLE_GRID)
+    return nullptr;
+
+  assert(a_quadrant >= 0 && a_quadrant < 4);
+  size_t first = indexCount() + a_quadrant * indexCount(a_quadrant);
+  return (const GLvoid*)(first * sizeof(GLushort));
+}
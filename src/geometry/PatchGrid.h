@@ -0,0 +1,63 @@
+#pragma once
+
+#include "base/gl.h"
+
+#include <memory>
+
+/**
+ * A small, indexed, square grid of quads with coordinates in [0, 1], meant to
+ * be drawn instanced to build bigger surfaces like terrains.
+ *
+ * The grid is uploaded once, and shared among all its users, each of which
+ * needs its own vertex array object (they usually have per-instance attributes
+ * on top of it).
+ *
+ * The index buffer contains the whole grid first, and then each of its four
+ * quadrants (top-left, top-right, bottom-left, bottom-right), so callers can
+ * draw only part of a patch.
+ *
+ * Triangles are wound so they face +Y when the grid is laid on the XZ plane
+ * (that is, with the grid y coordinate mapped to z).
+ */
+class PatchGrid final {
+  uint32_t m_quads;
+
+  GLuint m_vbo;
+  GLuint m_ebo;
+
+  explicit PatchGrid(uint32_t a_quads);
+
+public:
+  // Used as the quadrant to refer to the whole grid.
+  static const int32_t WHOLE_GRID = -1;
+
+  PatchGrid(const PatchGrid&) = delete;
+  ~PatchGrid();
+
+  /**
+   * Returns the grid with a_quads quads per side, creating it if nobody is
+   * using it yet.
+   */
+  static std::shared_ptr<PatchGrid> get(uint32_t a_quads);
+
+  uint32_t quads() const {
+    return m_quads;
+  }
+
+  /**
+   * Binds the grid vertex buffer to the given attribute (a vec2) and the index
+   * buffer to the currently bound vertex array object.
+   */
+  void setupVertexArray(GLuint a_attribute) const;
+
+  /** The number of indices of the whole grid, or of one of its quadrants. */
+  size_t indexCount(int32_t a_quadrant = WHOLE_GRID) const;
+
+  /** The offset into the index buffer for glDrawElements* calls. */
+  const GLvoid* indexOffset(int32_t a_quadrant = WHOLE_GRID) const;
+
+  /** The index type for glDrawElements* calls. */
+  GLenum indexType() const {
+    return GL_UNSIGNED_SHORT;
+  }
+};
@@ -0,0 +1,59 @@
+#pragma once
+
+#include "geometry/AABB.h"
+
+#include "glm/glm.hpp"
+
+#include <algorithm>
+#include <limits>
+#include <utility>
+
+/**
+ * A ray segment, from m_origin to m_origin + m_direction * m_maxDistance.
+ *
+ * The direction doesn't need to be normalized, distances are just measured in
+ * multiples of it.
+ */
+struct Ray {
+  glm::vec3 m_origin;
+  glm::vec3 m_direction;
+  float m_maxDistance = std::numeric_limits<float>::max();
+
+  Ray() {}
+  Ray(const glm::vec3& a_origin,
+      const glm::vec3& a_direction,
+      float a_maxDistance = std::numeric_limits<float>::max())
+    : m_origin(a_origin)
+    , m_direction(a_direction)
+    , m_maxDistance(a_maxDistance) {}
+
+  glm::vec3 at(float a_distance) const {
+    return m_origin + m_direction * a_distance;
+  }
+
+  /**
+   * Clips [a_near, a_far] to the part of the ray inside a_box, returning false
+   * if there's nothing left.
+   */
+  bool clip(const AABB& a_box, float& a_near, float& a_far) const {
+    for (int axis = 0; axis < 3; ++axis) {
+      if (m_direction[axis] == 0.0f) {
+        if (m_origin[axis] < a_box.m_min[axis] ||
+            m_origin[axis] > a_box.m_max[axis])
+          return false;
+        continue;
+      }
+
+      float inverse = 1.0f / m_direction[axis];
+      float entry = (a_box.m_min[axis] - m_origin[axis]) * inverse;
+      float exit = (a_box.m_max[axis] - m_origin[axis]) * inverse;
+      if (entry > exit)
+        std::swap(entry, exit);
+      a_near = std::max(a_near, entry);
+      a_far = std::min(a_far, exit);
+      if (a_near > a_far)
+        return false;
+    }
+    return true;
+  }
+};
@@ -0,0 +1,152 @@
+#include "geometry/RenderQueue.h"
+
+#include "base/ErrorChecker.h"
+#include "geometry/DrawContext.h"
+#include "geometry/InstancedNode.h"
+#include "geometry/Mesh.h"
+
+#include "glm/gtc/type_ptr.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+
+const uint32_t PASS_BITS = 4;
+const uint32_t PROGRAM_BITS = 12;
+const uint32_t TEXTURE_BITS = 16;
+const uint32_t VAO_BITS = 16;
+const uint32_t DEPTH_BITS = 16;
+
+static_assert(PASS_BITS + PROGRAM_BITS + TEXTURE_BITS + VAO_BITS +
+                      DEPTH_BITS ==
+                  64,
+              "The sort key should use all its bits");
+
+static uint64_t keyField(uint64_t a_value, uint32_t a_bits) {
+  return a_value & ((uint64_t(1) << a_bits) - 1);
+}
+
+void RenderQueue::begin(Pass a_pass, const glm::mat4& a_viewProjection) {
+  assert(m_items.empty() && "Forgot to submit the previous pass?");
+  m_pass = a_pass;
+  m_viewProjection = a_viewProjection;
+}
+
+/* static */ uint64_t RenderQueue::sortKey(Pass a_pass,
+                                           GLuint a_program,
+                                           GLuint a_texture,
+                                           GLuint a_vao,
+                                           float a_depth) {
+  const uint64_t maxDepth = (uint64_t(1) << DEPTH_BITS) - 1;
+  uint64_t depth =
+      uint64_t(std::round(glm::clamp(a_depth, 0.0f, 1.0f) * maxDepth));
+
+  uint64_t key = keyField(uint64_t(a_pass), PASS_BITS);
+  key = (key << PROGRAM_BITS) | keyField(a_program, PROGRAM_BITS);
+  key = (key << TEXTURE_BITS) | keyField(a_texture, TEXTURE_BITS);
+  key = (key << VAO_BITS) | keyField(a_vao, VAO_BITS);
+  key = (key << DEPTH_BITS) | depth;
+  return key;
+}
+
+void RenderQueue::push(const Mesh& a_mesh,
+                       const glm::mat4& a_transform,
+                       GLuint a_program,
+                       const InstancedNode* a_instances) {
+  // The depth of the center of the mesh, which is good enough to sort them.
+  // Instanced meshes have a vertex array of their own, so there's nothing to
+  // sort them against.
+  float depth = 0.0f;
+  if (!a_instances) {
+    glm::vec4 center = m_viewProjection * a_transform *
+                       glm::vec4(a_mesh.localBounds().center(), 1.0f);
+    if (center.w > 0.0f)
+      depth = center.z / center.w * 0.5f + 0.5f;
+  }
+
+  // The shadow maps only need the depth, so there's no texture to group by.
+  GLuint texture = 0;
+  if (m_pass != Pass::ShadowMap && a_mesh.texture())
+    texture = *a_mesh.texture();
+  GLuint vao = a_instances ? a_instances->vaoFor(a_mesh) : a_mesh.vao();
+  m_items.push_back(Item{
+      sortKey(m_pass, a_program, texture, vao, depth), &a_mesh, a_transform,
+      a_instances,
+  });
+}
+
+void RenderQueue::submit(const DrawContext& a_context) {
+  AutoGLErrorChecker checker;
+  if (m_items.empty())
+    return;
+
+  std::sort(m_items.begin(), m_items.end(),
+            [](const Item& a, const Item& b) { return a.m_key < b.m_key; });
+
+  const DrawContext::Uniforms& uniforms = a_context.uniforms();
+  const GLenum mode =
+      a_context.program().tessControlShader() ? GL_PATCHES : GL_TRIANGLES;
+  if (mode == GL_PATCHES)
+    glPatchParameteri(GL_PATCH_VERTICES, 3);
+
+  // The shadow maps only need the depth, so we don't set up the materials nor
+  // the textures for them.
+  const bool withMaterials = m_pass != Pass::ShadowMap;
+  if (withMaterials) {
+    // Every mesh samples its texture from the same unit, see
+    // Scene::setupUniforms.
+    glActiveTexture(GL_TEXTURE0);
+  }
+
+  Optional<uint32_t> materialIndex;
+  Optional<bool> usesTexture;
+  Optional<bool> instanced;
+  GLuint texture = 0;
+  GLuint vao = 0;
+  for (const Item& item : m_items) {
+    const Mesh& mesh = *item.m_mesh;
+    glUniformMatrix4fv(uniforms.m_transform, 1, GL_FALSE,
+                       glm::value_ptr(item.m_transform));
+
+    if (withMaterials) {
+      if (materialIndex.isNone() || *materialIndex != mesh.materialIndex()) {
+        materialIndex = Some(mesh.materialIndex());
+        glUniform1i(uniforms.m_materialIndex, *materialIndex);
+      }
+
+      if (usesTexture.isNone() || *usesTexture != mesh.texture().isSome()) {
+        usesTexture = Some(mesh.texture().isSome());
+        glUniform1i(uniforms.m_usesTexture, *usesTexture);
+      }
+
+      // Meshes without a texture leave the last one bound, since they don't
+      // sample it.
+      if (mesh.texture() && *mesh.texture() != texture) {
+        texture = *mesh.texture();
+        glBindTexture(GL_TEXTURE_2D, texture);
+      }
+    }
+
+    if (instanced.isNone() || *instanced != !!item.m_instances) {
+      instanced = Some(!!item.m_instances);
+      glUniform1i(uniforms.m_instanced, *instanced);
+    }
+
+    GLuint itemVao =
+        item.m_instances ? item.m_instances->vaoFor(mesh) : mesh.vao();
+    if (itemVao != vao) {
+      vao = itemVao;
+      glBindVertexArray(vao);
+    }
+
+    if (item.m_instances) {
+      glDrawElementsInstanced(mode, mesh.indexCount(), GL_UNSIGNED_INT,
+                              nullptr, item.m_instances->instanceCount());
+    } else {
+      glDrawElements(mode, mesh.indexCount(), GL_UNSIGNED_INT, nullptr);
+    }
+  }
+
+  glBindVertexArray(0);
+  m_items.clear();
+}
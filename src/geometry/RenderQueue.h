@@ -0,0 +1,86 @@
+#pragma once
+
+#include "base/gl.h"
+
+#include "glm/glm.hpp"
+
+#include <cstdint>
+#include <vector>
+
+class DrawContext;
+class InstancedNode;
+class Mesh;
+
+/**
+ * Collects the draw calls of the meshes of a pass while walking the scene
+ * graph, so they can be sorted and submitted together, skipping the state
+ * changes between draws that share it.
+ */
+class RenderQueue final {
+public:
+  // Passes sort before anything else, so we never interleave their draws.
+  enum class Pass : uint8_t {
+    ShadowMap,
+    Opaque,
+  };
+
+  struct Item {
+    uint64_t m_key;
+    const Mesh* m_mesh;
+    // The world transform of the mesh, or the one relative to the model of
+    // m_instances if it's instanced.
+    glm::mat4 m_transform;
+    // The node to draw the mesh once per instance of, if any.
+    const InstancedNode* m_instances;
+  };
+
+private:
+  Pass m_pass;
+  // The view-projection of the pass, to sort the draws front to back.
+  glm::mat4 m_viewProjection;
+  std::vector<Item> m_items;
+
+public:
+  explicit RenderQueue(Pass a_pass = Pass::Opaque,
+                       const glm::mat4& a_viewProjection = glm::mat4())
+    : m_pass(a_pass), m_viewProjection(a_viewProjection) {}
+
+  /**
+   * Starts collecting the draws of a new pass. The queue must be empty, that
+   * is, the previous one must have been submitted.
+   */
+  void begin(Pass, const glm::mat4& a_viewProjection);
+
+  /**
+   * The key draws get sorted with, from the most significant bits to the
+   * least: the pass, the program, the texture, the vertex array, and the
+   * depth, in [0, 1], so that among draws with the same state the nearest go
+   * first and occlude the rest before shading them.
+   *
+   * Names too big for their bits only make the sort group them worse, since
+   * the state changes are skipped comparing the real ones.
+   */
+  static uint64_t sortKey(Pass,
+                          GLuint a_program,
+                          GLuint a_texture,
+                          GLuint a_vao,
+                          float a_depth);
+
+  void push(const Mesh&,
+            const glm::mat4& a_transform,
+            GLuint a_program,
+            const InstancedNode* a_instances = nullptr);
+
+  bool empty() const {
+    return m_items.empty();
+  }
+
+  /**
+   * Sorts and draws everything pushed since begin() with the program and
+   * uniforms of the context, and empties the queue.
+   *
+   * The shadow map passes don't set the material nor the texture of the
+   * meshes, since they only need their depth.
+   */
+  void submit(const DrawContext&);
+};
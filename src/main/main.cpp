@@ -3,12 +3,14 @@
 #include <condition_variable>
 #include <cstddef>
 #include <cstdio>
+#include <cstdlib>
 #include <ctime>
 #include <iostream>
 #include <memory>
 #include <mutex>
 #include <random>
 #include <thread>
+#include <vector>
 
 #include "base/gl.h"
 #include "base/DebuggingUtils.h"
@@ -83,9 +85,33 @@ void renderer(std::shared_ptr<sf::Window> window,
   ShaderSet shaders("res/common.glsl", "res/vertex.glsl", "res/fragment.glsl");
   // auto scene = std::make_shared<Scene>(std::move(shaders),
   // Scene::DynTerrain);
-  auto terrainType = (argc > 1 && !strcmp(argv[1], "--bezier")) ?
-    Scene::BezierTerrain : Scene::DynTerrain;
-  auto scene = std::make_shared<Scene>(std::move(shaders), terrainType);
+  auto terrainType = Scene::DynTerrain;
+  ShadowMapSettings shadowMapSettings;
+  for (int i = 1; i < argc; ++i) {
+    if (!strcmp(argv[i], "--bezier")) {
+      terrainType = Scene::BezierTerrain;
+    } else if (!strcmp(argv[i], "--cdlod")) {
+      terrainType = Scene::CDLODTerrain;
+    } else if (!strcmp(argv[i], "--streamed")) {
+      terrainType = Scene::StreamedTerrain;
+    } else if (!strcmp(argv[i], "--shadow-size") && i + 1 < argc) {
+      int size = atoi(argv[++i]);
+      if (size > 0)
+        shadowMapSettings.m_size = size;
+      else
+        WARN("Invalid shadow map size: %s", argv[i]);
+    } else if (!strcmp(argv[i], "--shadow-depth") && i + 1 < argc) {
+      auto format = ShadowMapSettings::parseDepthFormat(argv[++i]);
+      if (format)
+        shadowMapSettings.m_depthFormat = *format;
+      else
+        WARN("Invalid shadow map depth format: %s (16, 24 or 32f)", argv[i]);
+    } else {
+      WARN("Unknown argument: %s", argv[i]);
+    }
+  }
+  auto scene = std::make_shared<Scene>(std::move(shaders), terrainType,
+                                       shadowMapSettings);
   *out_scene = scene;
 
   {
@@ -105,22 +131,37 @@ void renderer(std::shared_ptr<sf::Window> window,
     generator.seed(time(nullptr));
     std::uniform_int_distribution<size_t> distribution(0.0f,
                                                        TERRAIN_DIMENSIONS - 1);
+    std::vector<glm::vec2> treePositions(kNumTrees);
+    for (auto& position : treePositions) {
+      position.x = distribution(generator);
+      position.y = distribution(generator);
+    }
+
+    std::vector<float> treeHeights(kNumTrees);
+    scene->terrainHeightsAt(View(treePositions.data(), treePositions.size()),
+                            View(treeHeights.data(), treeHeights.size()));
+
+    std::vector<glm::mat4> treeTransforms;
     for (size_t i = 0; i < kNumTrees; ++i) {
-      auto tree = Mesh::fromFile("res/models/tree/lowpolytree.obj");
-      float x = distribution(generator);
-      float y = distribution(generator);
-      tree->translate(glm::vec3(x - TERRAIN_DIMENSIONS / 2,
-                                scene->terrainHeightAt(x, y) + 1.5f,
-                                y - TERRAIN_DIMENSIONS / 2));
-      scene->addObject(std::move(tree));
+      const glm::vec2& position = treePositions[i];
+      treeTransforms.push_back(glm::translate(
+          glm::mat4(), glm::vec3(position.x - TERRAIN_DIMENSIONS / 2,
+                                 treeHeights[i] + 1.5f,
+                                 position.y - TERRAIN_DIMENSIONS / 2)));
     }
 
+    auto tree = Mesh::fromFile("res/models/tree/lowpolytree.obj");
+    tree->setStatic(true);
+    scene->addInstances(std::move(tree), View(treeTransforms.data(),
+                                              treeTransforms.size()));
+
     // auto suzanne = Mesh::fromFile("res/models/suzanne.obj");
     // suzanne->scale(glm::vec3(0.5, 0.5, 0.5));
     // scene->addObject(std::move(suzanne));
     auto helicopter = Mesh::fromFile("res/models/helicopter/uh60.obj");
     helicopter->translate(glm::vec3(10.0, 10.0, -10.0));
     helicopter->rotate(glm::radians(270.0f), X_AXIS);
+    helicopter->setStatic(true);
     scene->addObject(std::move(helicopter));
     // scene->addObject(Mesh::fromFile("res/models/Airbus A310.obj"));
   }
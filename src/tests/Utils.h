@@ -2,6 +2,9 @@
 
 #include "base/Logging.h"
 
+#include <cstdio>
+#include <cstdlib>
+
 #define ASSERT(t)                                                              \
   do {                                                                         \
     if (!(t)) {                                                                \
@@ -0,0 +1,272 @@
+#include "base/BezierHeightField.h"
+#include "base/HeightField.h"
+#include "base/HeightFieldPyramid.h"
+#include "base/HorizonMap.h"
+#include "tests/Utils.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <vector>
+
+static bool approxEq(float a, float b) {
+  return std::fabs(a - b) < 1e-4f;
+}
+
+// A 4x3 field where height = x + 10 * y, so bilinear interpolation is exact.
+static HeightField makeField() {
+  const uint32_t width = 4;
+  const uint32_t height = 3;
+  std::vector<float> heights;
+  for (uint32_t y = 0; y < height; ++y)
+    for (uint32_t x = 0; x < width; ++x)
+      heights.push_back(x + 10.0f * y);
+  return HeightField(width, height, std::move(heights));
+}
+
+// Direct evaluation of the Bezier surface, without the weight table.
+static float bernstein(uint32_t i, float t) {
+  const float coefficients[4] = {1.0f, 3.0f, 3.0f, 1.0f};
+  return coefficients[i] * std::pow(t, float(i)) * std::pow(1.0f - t, 3.0f - i);
+}
+
+static float evaluateBezier(const std::vector<float>& controlHeights,
+                            uint32_t size,
+                            float u,
+                            float v) {
+  float x = u * size;
+  float y = v * size;
+  uint32_t patchX = std::min(uint32_t(x / 3.0f), (size - 4) / 3);
+  uint32_t patchY = std::min(uint32_t(y / 3.0f), (size - 4) / 3);
+  float s = (x - patchX * 3.0f) / 3.0f;
+  float t = (y - patchY * 3.0f) / 3.0f;
+
+  float ret = 0.0f;
+  for (uint32_t j = 0; j < 4; ++j)
+    for (uint32_t k = 0; k < 4; ++k)
+      ret += controlHeights[(patchX * 3 + j) * size + patchY * 3 + k] *
+             bernstein(j, s) * bernstein(k, t);
+  return ret;
+}
+
+static void testBezier() {
+  const uint32_t size = 3 * 3 + 4;
+
+  // Bezier surfaces reproduce linear functions exactly.
+  std::vector<float> linear;
+  for (uint32_t x = 0; x < size; ++x)
+    for (uint32_t y = 0; y < size; ++y)
+      linear.push_back(x * 0.5f - y * 0.25f);
+
+  BezierHeightField linearField(size, View(linear.data(), linear.size()));
+  ASSERT(approxEq(linearField.sample(0.0f, 0.0f), 0.0f));
+  ASSERT(approxEq(linearField.sample(5.5f / size, 2.0f / size), 2.25f));
+  ASSERT(approxEq(linearField.sample(2.0f, 2.0f), (size - 1) * 0.25f));
+
+  std::vector<float> bumpy;
+  for (uint32_t i = 0; i < size * size; ++i)
+    bumpy.push_back(std::sin(i * 1.7f));
+
+  BezierHeightField field(size, View(bumpy.data(), bumpy.size()));
+
+  std::vector<glm::vec2> points;
+  for (size_t i = 0; i < 53; ++i)
+    points.push_back(glm::vec2(i * 0.019f, 1.0f - i * 0.0185f));
+
+  std::vector<float> heights(points.size());
+  field.sampleMany(View(points.data(), points.size()),
+                   View(heights.data(), heights.size()), 1.0f, 3.0f);
+
+  for (size_t i = 0; i < points.size(); ++i) {
+    float u = std::min(points[i].x, (size - 1.0f) / size);
+    float v = std::min(points[i].y, (size - 1.0f) / size);
+    float expected = evaluateBezier(bumpy, size, u, v);
+    ASSERT(approxEq(field.sample(points[i].x, points[i].y), expected));
+    ASSERT(approxEq(heights[i], expected * 3.0f));
+  }
+}
+
+static void testRaycast(const HeightField& field) {
+  HeightFieldPyramid pyramid(field);
+  ASSERT_EQ(pyramid.levelCount(), 3u);
+
+  // Straight down.
+  auto hit = pyramid.raycast(Ray(glm::vec3(0.3f, 100.0f, 0.6f),
+                                 glm::vec3(0.0f, -1.0f, 0.0f)));
+  ASSERT(hit);
+  ASSERT(approxEq(*hit, 100.0f - field.sample(0.3f, 0.6f)));
+
+  // Too short, going up, outside of the field, and starting underground.
+  ASSERT(!pyramid.raycast(Ray(glm::vec3(0.3f, 100.0f, 0.6f),
+                              glm::vec3(0.0f, -1.0f, 0.0f), 50.0f)));
+  ASSERT(!pyramid.raycast(
+      Ray(glm::vec3(0.3f, 100.0f, 0.6f), glm::vec3(0.0f, 1.0f, 0.0f))));
+  ASSERT(!pyramid.raycast(
+      Ray(glm::vec3(1.5f, 100.0f, 0.6f), glm::vec3(0.0f, -1.0f, 0.0f))));
+  hit = pyramid.raycast(
+      Ray(glm::vec3(0.3f, -1.0f, 0.6f), glm::vec3(1.0f, 0.0f, 0.0f)));
+  ASSERT(hit);
+  ASSERT_EQ(*hit, 0.0f);
+
+  // Slanted rays, in world units, must end up on the surface.
+  std::vector<Ray> rays;
+  for (size_t i = 0; i < 9; ++i)
+    rays.push_back(Ray(glm::vec3(i * 0.25f, 120.0f, 4.0f - i * 0.3f),
+                       glm::vec3(1.0f - i * 0.15f, -40.0f, -0.5f)));
+
+  std::vector<Optional<float>> hits(rays.size());
+  pyramid.raycastMany(View(rays.data(), rays.size()),
+                      View(hits.data(), hits.size()), 0.25f);
+
+  for (size_t i = 0; i < rays.size(); ++i) {
+    ASSERT(hits[i]);
+    glm::vec3 position = rays[i].at(*hits[i]) * 0.25f;
+    ASSERT(approxEq(position.y, field.sample(position.x, position.z)));
+  }
+}
+
+static void testModify() {
+  HeightField field = makeField();
+  HeightFieldPyramid pyramid(field);
+  ASSERT(approxEq(pyramid.heightRange().x, 0.0f));
+  ASSERT(approxEq(pyramid.heightRange().y, 23.0f));
+
+  // Only (1, 1) and (2, 1) are inside.
+  HeightFieldRegion region =
+      field.regionBetween(glm::vec2(0.1f, 0.3f), glm::vec2(0.6f, 0.5f));
+  ASSERT_EQ(region.m_x, 1u);
+  ASSERT_EQ(region.m_y, 1u);
+  ASSERT_EQ(region.m_width, 2u);
+  ASSERT_EQ(region.m_height, 1u);
+  ASSERT(field.regionBetween(glm::vec2(0.1f), glm::vec2(0.2f)).empty());
+
+  HeightFieldRegion inflated = region.inflated(1, 4, 3);
+  ASSERT_EQ(inflated.m_x, 0u);
+  ASSERT_EQ(inflated.m_y, 0u);
+  ASSERT_EQ(inflated.m_width, 4u);
+  ASSERT_EQ(inflated.m_height, 3u);
+
+  // Raise a bump over everything else, a ray straight down must hit it after
+  // updating the pyramid.
+  field.set(2, 1, 50.0f);
+  pyramid.update(region);
+  ASSERT(approxEq(pyramid.heightRange().y, 50.0f));
+  auto hit = pyramid.raycast(Ray(glm::vec3(2.0f / 4.0f, 100.0f, 1.0f / 3.0f),
+                                 glm::vec3(0.0f, -1.0f, 0.0f)));
+  ASSERT(hit);
+  ASSERT(approxEq(*hit, 50.0f));
+
+  // And a ray grazing it from the side too.
+  hit = pyramid.raycast(Ray(glm::vec3(0.0f, 40.0f, 1.0f / 3.0f),
+                            glm::vec3(1.0f, 0.0f, 0.0f)));
+  ASSERT(hit);
+  ASSERT(*hit > 0.25f && *hit < 0.5f);
+}
+
+// 16-bit heightmaps must keep values that would be lost with 8 bits.
+static void testRaw16() {
+  const char* path = "test-heightfield.r16";
+  const uint16_t values[] = {0, 1, 256, 65535};
+  {
+    std::ofstream file(path, std::ios::binary);
+    for (uint16_t value : values) {
+      file.put(char(value & 0xff));
+      file.put(char(value >> 8));
+    }
+  }
+
+  HeightField field = HeightField::fromFile(path, 2.0f, -1.0f);
+  std::remove(path);
+
+  ASSERT_EQ(field.width(), 2u);
+  ASSERT_EQ(field.height(), 2u);
+  ASSERT(approxEq(field.at(0, 0), -1.0f));
+  ASSERT(field.at(1, 0) > -1.0f);
+  ASSERT(approxEq(field.at(0, 1), 256.0f / 65535.0f * 2.0f - 1.0f));
+  ASSERT(approxEq(field.at(1, 1), 1.0f));
+
+  ASSERT(HeightField::fromFile("does-not-exist.r16", 1.0f, 0.0f).empty());
+}
+
+// A wall across a flat field must raise the horizon only towards it.
+static void testHorizon() {
+  const uint32_t size = 8;
+  std::vector<float> heights(size * size, 0.0f);
+  for (uint32_t y = 0; y < size; ++y)
+    heights[y * size + 6] = 0.5f;
+  HeightField field(size, size, std::move(heights));
+
+  // Directions go +x, +y, -x, -y.
+  HorizonMap horizons(field, 4, size);
+  ASSERT_EQ(horizons.directionCount(), 4u);
+
+  // From x = 2 the wall is half a field high at half a field away, which
+  // makes a 45 degree horizon.
+  const float sine = std::sqrt(0.5f);
+  ASSERT(std::fabs(horizons.horizonAt(2, 3, 0) - sine) < 1.0f / 255.0f);
+  ASSERT(approxEq(horizons.horizonAt(2, 3, 1), 0.0f));
+  ASSERT(approxEq(horizons.horizonAt(2, 3, 2), 0.0f));
+  ASSERT(approxEq(horizons.horizonAt(7, 3, 0), 0.0f));
+  ASSERT(horizons.horizonAt(7, 3, 2) > horizons.horizonAt(2, 3, 0));
+
+  // Slices between two directions interpolate them.
+  HeightFieldRegion sample(2, 3, 1, 1);
+  std::vector<uint8_t> slice = horizons.slice(0.0f, sample);
+  ASSERT_EQ(slice.size(), 1u);
+  ASSERT(std::fabs(slice[0] / 255.0f - sine) < 1.0f / 255.0f);
+  slice = horizons.slice(3.14159265f / 4.0f, sample);
+  ASSERT(std::fabs(slice[0] / 255.0f - sine * 0.5f) < 1.0f / 255.0f);
+
+  // Removing the wall must clear the horizons that saw it.
+  for (uint32_t y = 0; y < size; ++y)
+    field.set(6, y, 0.0f);
+  HeightFieldRegion rebaked =
+      horizons.update(field, HeightFieldRegion(6, 0, 1, size));
+  ASSERT_EQ(rebaked.m_width, size);
+  ASSERT(approxEq(horizons.horizonAt(2, 3, 0), 0.0f));
+  ASSERT(approxEq(horizons.horizonAt(7, 3, 2), 0.0f));
+}
+
+int main() {
+  testBezier();
+  testModify();
+  testRaw16();
+  testHorizon();
+
+  HeightField field = makeField();
+  testRaycast(field);
+
+  ASSERT_EQ(field.width(), 4u);
+  ASSERT_EQ(field.height(), 3u);
+  ASSERT(approxEq(field.at(2, 1), 12.0f));
+
+  // Exact texels.
+  ASSERT(approxEq(field.sample(0.0f, 0.0f), 0.0f));
+  ASSERT(approxEq(field.sample(2.0f / 4.0f, 1.0f / 3.0f), 12.0f));
+
+  // In-between texels.
+  ASSERT(approxEq(field.sample(1.5f / 4.0f, 0.5f / 3.0f), 6.5f));
+
+  // Out of bounds clamps to the edges.
+  ASSERT(approxEq(field.sample(-1.0f, -1.0f), 0.0f));
+  ASSERT(approxEq(field.sample(2.0f, 2.0f), 23.0f));
+
+  // The batched version must agree with the scalar one, including the
+  // non-multiple-of-four tail and the scales.
+  std::vector<glm::vec2> points;
+  for (size_t i = 0; i < 37; ++i)
+    points.push_back(glm::vec2(i * 0.37f - 1.0f, i * 0.29f - 0.5f));
+
+  std::vector<float> heights(points.size());
+  field.sampleMany(View(points.data(), points.size()),
+                   View(heights.data(), heights.size()), 0.25f, 2.0f);
+
+  for (size_t i = 0; i < points.size(); ++i) {
+    float expected =
+        field.sample(points[i].x * 0.25f, points[i].y * 0.25f) * 2.0f;
+    ASSERT(approxEq(heights[i], expected));
+  }
+
+  return 0;
+}
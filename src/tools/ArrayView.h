@@ -1,5 +1,8 @@
 #pragma once
 
+#include <cassert>
+#include <cstddef>
+
 template <typename T>
 class ArrayView {
   T* m_ptr;
@@ -8,6 +11,11 @@ class ArrayView {
 public:
   ArrayView(T* ptr, size_t length) : m_ptr(ptr), m_length(length) {}
 
+  // Allows passing an ArrayView<T> where an ArrayView<const T> is expected.
+  template <typename U>
+  ArrayView(const ArrayView<U>& other)
+    : m_ptr(other.data()), m_length(other.size()) {}
+
   T* begin() {
     return m_ptr;
   }
@@ -22,14 +30,30 @@ public:
     return m_ptr + m_length;
   }
 
+  T* data() {
+    return m_ptr;
+  }
+
+  const T* data() const {
+    return m_ptr;
+  }
+
+  size_t size() const {
+    return m_length;
+  }
+
+  bool empty() const {
+    return m_length == 0;
+  }
+
   T& operator[](size_t i) {
     assert(i < m_length);
-    return m_ptr[m_length];
+    return m_ptr[i];
   }
 
   const T& operator[](size_t i) const {
     assert(i < m_length);
-    return m_ptr[m_length];
+    return m_ptr[i];
   }
 };
 